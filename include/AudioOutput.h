@@ -1,8 +1,10 @@
 #ifndef SOFTFM_AUDIOOUTPUT_H
 #define SOFTFM_AUDIOOUTPUT_H
 
+#include <atomic>
 #include <cstdint>
 #include <cstdio>
+#include <mutex>
 #include <string>
 #include <vector>
 
@@ -61,6 +63,11 @@ private:
 };
 
 // Write audio data as .WAV file.
+//
+// The RIFF header holds 32-bit sizes, so a file takes at most 4 GiB of
+// audio (about 6.2 hours of 48 kHz stereo). Writes beyond that limit
+// fail with an error (reported once) and the file keeps a valid header
+// for the audio before it.
 class WavAudioOutput : public AudioOutput {
 public:
   // Construct .WAV writer.
@@ -72,9 +79,18 @@ public:
   ~WavAudioOutput();
   bool write(const SampleVector &samples);
 
+  // Write audio data starting at sample frame (left/right pair) index
+  // frame instead of appending. May be called from several threads for
+  // disjoint ranges; the file must be seekable. Do not mix with write().
+  bool write_at(std::uint64_t frame, const SampleVector &samples);
+
 private:
   // (Re-)Write .WAV header.
-  bool write_header(unsigned int nsamples);
+  bool write_header(std::uint64_t data_size);
+
+  // Return true if data up to byte offset end (relative to the start
+  // of the audio data) fits in the file; otherwise set the error once.
+  bool check_size(std::uint64_t end);
 
   static void encode_chunk_id(std::uint8_t *ptr, const char *chunkname);
 
@@ -84,6 +100,10 @@ private:
   const unsigned sampleRate;
   std::FILE *m_stream;
   std::vector<std::uint8_t> m_bytebuf;
+  std::uint64_t m_data_size;             // data written by write
+  std::atomic<std::uint64_t> m_data_end; // end of data written by write_at
+  std::mutex m_error_mutex;
+  bool m_size_error;
 };
 
 #endif
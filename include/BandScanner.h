@@ -0,0 +1,91 @@
+#ifndef SOFTFM_BANDSCANNER_H
+#define SOFTFM_BANDSCANNER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Fft.h"
+#include "SoftFM.h"
+
+// Find FM broadcast stations in a frequency band.
+//
+// The tuner steps across the band in steps of the usable capture
+// bandwidth. At each step an averaged FFT power spectrum is measured, and
+// the steps are joined into one spectrum of the band. Every channel on the
+// channel raster gets the mean power within its bandwidth; channels which
+// exceed the noise floor (a low percentile of the band spectrum) by the
+// threshold and are stronger than their neighbours are reported as
+// stations, strongest first.
+//
+// Optionally each station is then decoded for a short time to check for
+// a stereo pilot. Stations close together share one capture.
+class BandScanner {
+public:
+  // Scan settings.
+  struct Config {
+    double freq_min;        // lowest channel in Hz
+    double freq_max;        // highest channel in Hz
+    double sample_rate;     // IQ sample rate in Hz
+    unsigned int fft_size;  // FFT length (power of 2)
+    unsigned int fft_count; // number of averaged FFTs per step
+    double channel_spacing; // channel raster in Hz
+    double threshold;       // detection threshold above noise floor in dB
+    double pilot_seconds;   // pilot check time per capture, or 0
+  };
+
+  // Detected station.
+  struct Station {
+    double frequency;   // in Hz
+    double power;       // channel power in dB (full scale)
+    double snr;         // channel power above noise floor in dB
+    bool pilot_checked; // true if stereo and pilot_level are valid
+    bool stereo;        // stereo pilot locked
+    double pilot_level; // pilot amplitude (nominal level is 0.1)
+  };
+
+  // Tune the receiver to a center frequency in Hz and read n IQ samples
+  // after the tuner has settled. Return false if an error occurred.
+  typedef std::function<bool(double, unsigned int, IQSampleVector &)>
+      Capture;
+
+  static constexpr double default_sample_rate = 2400000;
+
+  // Return default settings for the 76 - 108 MHz band.
+  static Config default_config();
+
+  BandScanner(const Config &config);
+
+  // Scan the band and return the detected stations, strongest first.
+  // Return false if a capture failed.
+  bool scan(const Capture &capture, std::vector<Station> &stations);
+
+  // Return the noise floor of the last scan in dB (full scale).
+  double get_noise_floor() const { return m_noise_floor; }
+
+  // Return the number of tuner steps of the last scan.
+  unsigned int get_step_count() const { return m_step_count; }
+
+private:
+  // Measure the band spectrum.
+  bool measure_spectrum(const Capture &capture);
+
+  // Return the mean power in dB of the band spectrum over [f1, f2].
+  double band_power(double f1, double f2) const;
+
+  // Decode the stations for a short time to check for a stereo pilot.
+  bool check_pilots(const Capture &capture, std::vector<Station> &stations);
+
+  const Config m_config;
+  const Fft m_fft;
+  double m_bin_width;       // band spectrum resolution in Hz
+  double m_usable;          // usable bandwidth per step in Hz
+  std::vector<float> m_band; // power per bin from freq_min on
+  double m_noise_floor;
+  unsigned int m_step_count;
+  IQSampleVector m_samples;
+  IQSampleVector m_fft_buf;
+  std::vector<float> m_power;
+};
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef SOFTFM_BATCHDECODER_H
+#define SOFTFM_BATCHDECODER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "FmDecode.h"
+#include "IQBlock.h"
+#include "IqFileSource.h"
+#include "SoftFM.h"
+
+// Decode many IQ recordings to .WAV files on a pool of worker threads.
+//
+// Each worker decodes one file at a time with its own FmDecoder and
+// fixed-size block buffers, so memory per worker does not depend on the
+// file size. Idle workers take the next undecoded file from a shared
+// index, largest files first, so no worker waits while others still
+// have long files queued.
+//
+// A single long recording can instead be split into time chunks which are
+// decoded in parallel (chunk_seconds > 0). Each chunk starts decoding
+// chunk_overlap seconds before its first output sample, so the filters,
+// the pilot PLL and the stereo lock detector have settled, and its audio
+// is written directly to its place in the .WAV file. Chunk starts are
+// aligned so that the output samples line up with a serial decode.
+//
+// Input files may also be IQ archives (see IqArchive.h). Decoding then
+// starts from the nearest decoder checkpoint instead, without warm-up,
+// so a time span can be decoded in time proportional to its length.
+class BatchDecoder {
+public:
+  // Decoder settings, same meaning as the FmDecoder parameters.
+  struct Config {
+    double sample_rate_if;
+    double ifeq_static_gain;
+    double ifeq_fit_factor;
+    double tuning_offset;  // for raw IQ files
+    double station_freq;   // for IQ archives, or 0 for the recorded station
+    double sample_rate_pcm;
+    double deemphasis;
+    double bandwidth_pcm;
+    unsigned int downsample;
+    bool pilot_shift;
+    unsigned int block_length; // IQ samples per block
+    unsigned int num_workers;  // number of worker threads
+    double chunk_seconds;      // chunk length, or 0 to decode files whole
+    double chunk_overlap;      // warm-up before each chunk in seconds
+    double span_begin;         // first second to decode
+    double span_end;           // end of decoding in seconds, or 0
+  };
+
+  // One recording to decode.
+  struct Job {
+    std::string input;  // IQ file (rtl_sdr format or IQ archive)
+    std::string output; // .WAV file
+  };
+
+  // Outcome of one job.
+  struct Result {
+    bool ok;
+    std::string error;
+    std::uint64_t iq_samples;    // IQ samples decoded
+    std::uint64_t audio_samples; // per channel
+    double seconds;              // wall time spent decoding
+    unsigned int worker;
+    unsigned int checkpoints_rejected; // archive checkpoints not usable
+  };
+
+  // Called from a worker thread after each finished job
+  // (calls are serialized).
+  typedef std::function<void(const Job &, const Result &)> Callback;
+
+  // Number of IQ samples at the start of each file whose audio is
+  // discarded while the IF filters settle (same as live mode).
+  static const unsigned int warmup_samples = 65536;
+
+  // Default warm-up before each chunk in seconds. The stereo lock
+  // detector alone needs 0.4 s after the pilot PLL has locked.
+  static constexpr double default_chunk_overlap = 1.0;
+
+  BatchDecoder(const Config &config);
+
+  // Decode all jobs and return one result per job (in job order).
+  // Files are decoded in parallel, or one after the other in parallel
+  // chunks if chunk_seconds > 0.
+  // stop_flag :: if not NULL, stop starting new jobs once set
+  // done      :: if set, called after each finished job
+  std::vector<Result> run(const std::vector<Job> &jobs,
+                          const std::atomic_bool *stop_flag = NULL,
+                          Callback done = Callback());
+
+  // Expand path to a list of IQ files.
+  // A directory gives all regular files in it (sorted by name);
+  // any other file is read as a list with one file name per line
+  // (empty lines and lines starting with '#' are skipped).
+  // Return false and set error if the path can not be read.
+  static bool list_inputs(const std::string &path,
+                          std::vector<std::string> &files,
+                          std::string &error);
+
+  // Return output file name for input: same base name with extension
+  // .wav, in directory outdir (or next to the input if outdir is empty).
+  static std::string output_name(const std::string &input,
+                                 const std::string &outdir);
+
+private:
+  // Per-worker block buffers, reused for all files and chunks.
+  struct Buffers {
+    IQBlock iqsamples;
+    SampleVector audio;
+  };
+
+  // Shared state of a file decoded in chunks.
+  struct ChunkedFile;
+
+  // Run task(index, worker) for index = 0 .. ntasks-1 on the workers.
+  // Workers take the next index from a shared counter when idle.
+  void run_tasks(unsigned int ntasks,
+                 const std::function<void(unsigned int, unsigned int)> &task);
+
+  // Return true if the stop flag is set.
+  bool stopped() const { return m_stop_flag != NULL && m_stop_flag->load(); }
+
+  // Construct a decoder with the configured settings.
+  // decoder_flags :: IqArchive decoder flags (RDS, AFC) of the recording
+  std::unique_ptr<FmDecoder> make_decoder(double tuning_offset,
+                                          std::uint32_t decoder_flags) const;
+
+  // Check that an opened file can be decoded with the configured
+  // settings and return the tuning offset for it.
+  bool check_input(const IqFileSource &source, double &tuning_offset,
+                   std::string &error) const;
+
+  // Return the number of audio frames discarded at the start of a file.
+  std::uint64_t warmup_frames() const;
+
+  // Return the audio frames [begin, end) to decode from each file.
+  void span_frames(std::uint64_t &begin, std::uint64_t &end) const;
+
+  // Construct a decoder to produce audio from frame begin on, and move
+  // source to the sample at which it starts.
+  // frame    :: set to the index of the first audio frame it produces
+  // rejected :: set to true if the decoder did not accept the checkpoint
+  //             of the archive (recorded with other settings)
+  // Return NULL if source can not seek.
+  std::unique_ptr<FmDecoder> start_decoder(IqFileSource &source,
+                                           double tuning_offset,
+                                           std::uint64_t begin,
+                                           std::uint64_t &frame,
+                                           bool &rejected) const;
+
+  // Return the IQ sample period at which decoding may start so that
+  // the audio samples line up with a decode from the start of the file.
+  // frames :: receives the number of audio frames per period
+  std::uint64_t align_period(std::uint64_t &frames) const;
+
+  // Decode one file.
+  void decode_file(const Job &job, Buffers &buf, Result &result);
+
+  // Decode one file in parallel chunks.
+  void decode_chunked(const Job &job, Result &result);
+
+  // Decode one chunk of a file decoded in chunks.
+  void decode_chunk(ChunkedFile &file, unsigned int chunk, Buffers &buf);
+
+  const Config m_config;
+  std::vector<Buffers> m_buffers;
+  std::atomic<unsigned int> m_next;
+  const std::atomic_bool *m_stop_flag;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SOFTFM_BUFFERARENA_H
+#define SOFTFM_BUFFERARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+#include "IQBlock.h"
+
+// Working buffers carved from a single aligned allocation.
+//
+// A layout is carved twice: first with no memory allocated, where take()
+// only adds up the space, then again after allocate(size()):
+//   arena.clear();
+//   ... take() every buffer ...
+//   arena.allocate(arena.size());
+//   ... take() every buffer again, in the same order ...
+// Each buffer starts on a 64-byte boundary, so the SIMD kernels see the
+// same alignment as with AlignedAllocator.
+class BufferArena {
+public:
+  static constexpr std::size_t alignment = 64;
+
+  BufferArena() : m_used(0) {}
+
+  // The buffers point into the storage, so it must not be shared.
+  BufferArena(const BufferArena &) = delete;
+  BufferArena &operator=(const BufferArena &) = delete;
+
+  // Free the memory and start measuring a new layout.
+  void clear() {
+    Storage().swap(m_storage);
+    m_used = 0;
+  }
+
+  // Allocate size bytes and start carving from the beginning.
+  void allocate(std::size_t size) {
+    m_storage.resize(size);
+    m_used = 0;
+  }
+
+  // Return the space taken so far in bytes.
+  std::size_t size() const { return m_used; }
+
+  // Return the space taken by an array of the given size in bytes.
+  static std::size_t padded(std::size_t bytes) {
+    return (bytes + alignment - 1) & ~(alignment - 1);
+  }
+
+  // Take an array of n elements; return NULL while measuring.
+  template <class T> T *take(std::size_t n) {
+    std::size_t bytes = padded(n * sizeof(T));
+    T *p = NULL;
+    if (!m_storage.empty()) {
+      assert(m_used + bytes <= m_storage.size());
+      p = reinterpret_cast<T *>(m_storage.data() + m_used);
+    }
+    m_used += bytes;
+    return p;
+  }
+
+private:
+  typedef std::vector<char, AlignedAllocator<char, alignment>> Storage;
+
+  Storage m_storage;
+  std::size_t m_used;
+};
+
+#endif
@@ -21,19 +21,30 @@
 #include <condition_variable>
 #include <mutex>
 #include <queue>
+#include <utility>
+#include <vector>
+
+#include "LatencyMonitor.h"
 
 // Buffer to move sample data between threads.
-template <class Element> class DataBuffer {
+// Block :: container of Element samples moved through the queue
+//          (with size() and empty(), like std::vector)
+template <class Element, class Block = std::vector<Element>>
+class DataBuffer {
 public:
   // Constructor.
   DataBuffer() : m_qlen(0), m_end_marked(false) {}
 
   // Add samples to the queue.
-  void push(std::vector<Element> &&samples) {
+  // timestamp :: Time stamp carried along with the block
+  //              (e.g. capture time), returned by pull().
+  void push(Block &&samples, double timestamp = 0) {
     if (!samples.empty()) {
+      double push_time = get_monotonic_time();
       std::unique_lock<std::mutex> lock(m_mutex);
       m_qlen += samples.size();
-      m_queue.push(move(samples));
+      m_queue.push(std::move(samples));
+      m_times.push(BlockTimes{timestamp, push_time});
       lock.unlock();
       m_cond.notify_all();
     }
@@ -57,15 +68,25 @@ public:
   // return the samples. If the end marker has been reached, return
   // an empty vector. If the queue is empty, wait until more data is pushed
   // or until the end marker is pushed.
-  std::vector<Element> pull() {
-    std::vector<Element> ret;
+  // timestamp  :: if not NULL, receives the time stamp given to push()
+  // queue_time :: if not NULL, receives the time in seconds the block
+  //               spent in the queue
+  Block pull(double *timestamp = NULL, double *queue_time = NULL) {
+    Block ret;
     std::unique_lock<std::mutex> lock(m_mutex);
     while (m_queue.empty() && !m_end_marked)
       m_cond.wait(lock);
     if (!m_queue.empty()) {
       m_qlen -= m_queue.front().size();
-      swap(ret, m_queue.front());
+      std::swap(ret, m_queue.front());
       m_queue.pop();
+      BlockTimes t = m_times.front();
+      m_times.pop();
+      lock.unlock();
+      if (timestamp != NULL)
+        *timestamp = t.timestamp;
+      if (queue_time != NULL)
+        *queue_time = get_monotonic_time() - t.push_time;
     }
     return ret;
   }
@@ -84,9 +105,15 @@ public:
   }
 
 private:
+  struct BlockTimes {
+    double timestamp;
+    double push_time;
+  };
+
   std::size_t m_qlen;
   bool m_end_marked;
-  std::queue<std::vector<Element>> m_queue;
+  std::queue<Block> m_queue;
+  std::queue<BlockTimes> m_times;
   std::mutex m_mutex;
   std::condition_variable m_cond;
 };
@@ -0,0 +1,197 @@
+#ifndef SOFTFM_DECODERSTATE_H
+#define SOFTFM_DECODERSTATE_H
+
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+// Writer for binary decoder state snapshots (see FmDecoder::save_state()).
+// Values are stored as raw bytes in host byte order, so a snapshot can
+// only be restored on a host with the same byte order and type sizes.
+class StateWriter {
+public:
+  // Append to data.
+  explicit StateWriter(std::vector<std::uint8_t> &data) : m_data(data) {}
+
+  // Write a plain value.
+  template <class T> void put(const T &value) { put_raw(&value, sizeof(T)); }
+
+  // Write a vector (length and elements).
+  template <class T, class A> void put(const std::vector<T, A> &v) {
+    put(std::uint32_t(v.size()));
+    put_raw(v.data(), v.size() * sizeof(T));
+  }
+
+  // Write a queue of sample indices (length and elements).
+  void put(const std::deque<std::uint64_t> &d) {
+    put(std::uint32_t(d.size()));
+    for (std::uint64_t v : d)
+      put(v);
+  }
+
+private:
+  void put_raw(const void *p, std::size_t n) {
+    const std::uint8_t *b = static_cast<const std::uint8_t *>(p);
+    m_data.insert(m_data.end(), b, b + n);
+  }
+
+  std::vector<std::uint8_t> &m_data;
+};
+
+// Return false for values a decoder never saves: NaN or infinite
+// floating-point numbers. The bits are tested, because -ffast-math lets
+// the compiler assume that std::isfinite() is always true.
+inline bool state_value_valid(float v) {
+  std::uint32_t b;
+  std::memcpy(&b, &v, sizeof(b));
+  return (b & 0x7f800000u) != 0x7f800000u;
+}
+
+inline bool state_value_valid(double v) {
+  std::uint64_t b;
+  std::memcpy(&b, &v, sizeof(b));
+  return (b & 0x7ff0000000000000ull) != 0x7ff0000000000000ull;
+}
+
+template <class T> bool state_value_valid(const std::complex<T> &v) {
+  return state_value_valid(v.real()) && state_value_valid(v.imag());
+}
+
+template <class T> bool state_value_valid(const T &) { return true; }
+
+template <class T, std::size_t N> bool state_value_valid(const T (&v)[N]) {
+  for (std::size_t i = 0; i < N; i++) {
+    if (!state_value_valid(v[i]))
+      return false;
+  }
+  return true;
+}
+
+// Reader for binary decoder state snapshots.
+//
+// A reader in check mode only validates the snapshot without storing
+// anything, so a decoder can verify a complete snapshot before changing
+// its state. Snapshots come from files and library callers, so every
+// value which indexes an array or bounds a loop is range checked in both
+// modes, and NaN or infinite floating-point values are rejected.
+class StateReader {
+public:
+  // Read from size bytes at data.
+  StateReader(const std::uint8_t *data, std::size_t size, bool check_only)
+      : m_data(data), m_size(size), m_pos(0), m_check_only(check_only),
+        m_ok(true) {}
+
+  // Read a plain value.
+  template <class T> void get(T &value) {
+    T v;
+    read(v);
+    if (storing())
+      std::memcpy(&value, &v, sizeof(T));
+  }
+
+  // Read a bool, which must be stored as 0 or 1.
+  void get(bool &value) {
+    static_assert(sizeof(bool) == 1, "bool is written as one byte");
+    std::uint8_t v = 0;
+    get_raw(&v, sizeof(v), true);
+    require(v <= 1);
+    if (storing())
+      value = (v != 0);
+  }
+
+  // Read a value and fail unless min <= value <= max.
+  template <class T> void get(T &value, const T &min, const T &max) {
+    T v = min;
+    read(v);
+    require(v >= min && v <= max);
+    if (storing())
+      value = v;
+  }
+
+  // Read a vector. Its length is fixed by the decoder parameters, so it
+  // must equal the current length of v.
+  template <class T, class A> void get(std::vector<T, A> &v) {
+    std::uint32_t n = 0;
+    get_raw(&n, sizeof(n), true);
+    if (n != v.size()) {
+      m_ok = false;
+      return;
+    }
+    for (std::uint32_t i = 0; i < n && m_ok; i++)
+      get(v[i]);
+  }
+
+  // Read a queue of sample indices.
+  void get(std::deque<std::uint64_t> &d) {
+    std::uint32_t n = 0;
+    get_raw(&n, sizeof(n), true);
+    if (!m_ok || n > (m_size - m_pos) / sizeof(std::uint64_t)) {
+      m_ok = false;
+      return;
+    }
+    if (!m_check_only)
+      d.clear();
+    for (std::uint32_t i = 0; i < n; i++) {
+      std::uint64_t v = 0;
+      get_raw(&v, sizeof(v), true);
+      if (!m_check_only)
+        d.push_back(v);
+    }
+  }
+
+  // Read a value and fail unless it equals expected
+  // (used for snapshot headers and decoder parameters).
+  template <class T> void expect(const T &expected) {
+    T value;
+    get_raw(&value, sizeof(T), true);
+    if (m_ok && std::memcmp(&value, &expected, sizeof(T)) != 0)
+      m_ok = false;
+  }
+
+  // Read a value also in check mode, for values which are checked
+  // against each other with require() before they are stored.
+  template <class T> void read(T &value) {
+    get_raw(&value, sizeof(T), true);
+    if (m_ok)
+      require(state_value_valid(value));
+  }
+
+  // Fail unless condition holds.
+  void require(bool condition) {
+    if (!condition)
+      m_ok = false;
+  }
+
+  // Return true if the values read so far are valid and are to be stored
+  // (not in check mode).
+  bool storing() const { return m_ok && !m_check_only; }
+
+  // Return true if all reads so far succeeded.
+  bool ok() const { return m_ok; }
+
+  // Return true if the whole snapshot has been read.
+  bool at_end() const { return m_pos == m_size; }
+
+private:
+  // Copy n bytes to p (unless in check mode and not force).
+  void get_raw(void *p, std::size_t n, bool force = false) {
+    if (!m_ok || n > m_size - m_pos) {
+      m_ok = false;
+      return;
+    }
+    if (force || !m_check_only)
+      std::memcpy(p, m_data + m_pos, n);
+    m_pos += n;
+  }
+
+  const std::uint8_t *m_data;
+  std::size_t m_size;
+  std::size_t m_pos;
+  bool m_check_only;
+  bool m_ok;
+};
+
+#endif
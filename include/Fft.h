@@ -0,0 +1,33 @@
+#ifndef SOFTFM_FFT_H
+#define SOFTFM_FFT_H
+
+#include <vector>
+
+#include "SoftFM.h"
+
+// Radix-2 complex FFT with precomputed twiddle factors.
+class Fft {
+public:
+  // Prepare transforms of length size (a power of 2).
+  explicit Fft(unsigned int size);
+
+  // Return the transform length.
+  unsigned int size() const { return m_size; }
+
+  // Transform size() samples in place (forward, unscaled).
+  void forward(IQSample *data) const;
+
+  // Multiply size() samples by a Hann window and add the power of each
+  // frequency bin to power, with zero frequency in the middle
+  // (bin size() / 2). buf is used as scratch space.
+  void add_power(const IQSample *samples, std::vector<float> &power,
+                 IQSampleVector &buf) const;
+
+private:
+  unsigned int m_size;
+  std::vector<unsigned int> m_bitrev;
+  IQSampleVector m_twiddle;
+  std::vector<float> m_window;
+};
+
+#endif
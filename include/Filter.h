@@ -18,9 +18,24 @@
 #ifndef SOFTFM_FILTER_H
 #define SOFTFM_FILTER_H
 
+#include "DecoderState.h"
+#include "FirDesign.h"
+#include "FirHistory.h"
+#include "IQBlock.h"
+#include "Kernels.h"
 #include "SoftFM.h"
+#include <cstdint>
 #include <vector>
 
+// Each filter has a vector-based process() and an array-based overload
+// taking a pointer and a sample count, for callers which own their buffers.
+// The array-based overloads never allocate output; the caller provides
+// room for n output samples, or for max_output_size(n) samples where the
+// output length differs from the input length. The output of the FIR
+// filters must not overlap their input, because the input of an output
+// sample is still needed for the following ones; the other filters may
+// run in place (process_inplace() for vectors).
+
 // Fine tuner which shifts the frequency of an IQ signal by a fixed offset.
 class FineTuner {
 public:
@@ -31,56 +46,186 @@ public:
   //               (sample_rate * freq_shift / table_size).
   FineTuner(unsigned int table_size, int freq_shift);
 
+  // Change the frequency shift (reusing the tables).
+  // The oscillator phase continues smoothly across the change.
+  void set_freq_shift(int freq_shift);
+
+  // Return the frequency shift.
+  int get_freq_shift() const { return m_shift; }
+
   // Process samples.
-  void process(const IQSampleVector &samples_in, IQSampleVector &samples_out);
+  void process(const IQBlock &samples_in, IQBlock &samples_out);
+
+  // Process n samples from separate I/Q arrays
+  // (out_i and out_q may equal in_i and in_q).
+  void process(const IQSample::value_type *in_i,
+               const IQSample::value_type *in_q, unsigned int n,
+               IQSample::value_type *out_i, IQSample::value_type *out_q);
+
+  // Process samples in-place.
+  void process_inplace(IQBlock &samples);
+
+  // Save or restore the oscillator frequency and phase.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
 
 private:
+  // Fill the tables for the current shift and phase.
+  void make_tables();
+
   unsigned int m_index;
-  IQSampleVector m_table;
+  int m_shift;
+  double m_phase;       // oscillator phase at table index 0
+  int m_table_shift;    // shift and phase of the table contents
+  double m_table_phase;
+  IQPlane m_table_i;
+  IQPlane m_table_q;
 };
 
-// Low-pass filter for IQ samples, based on Lanczos FIR filter.
+// Low-pass filter for IQ samples, based on equiripple FIR filter.
 class LowPassFilterFirIQ {
 public:
-  // Construct low-pass filter.
-  // filter_order :: FIR filter order.
-  // cutoff       :: Cutoff frequency relative to the full sample rate
-  //                 (valid range 0.0 ... 0.5).
-  LowPassFilterFirIQ(unsigned int filter_order, double cutoff);
+  // Construct low-pass filter with the fewest taps which meet spec.
+  // spec :: Filter specification relative to the sample rate.
+  explicit LowPassFilterFirIQ(const LowPassSpec &spec);
+
+  // Return the number of filter taps.
+  unsigned int get_taps() const { return m_coeff.size(); }
 
   // Process samples.
-  void process(const IQSampleVector &samples_in, IQSampleVector &samples_out);
+  void process(const IQBlock &samples_in, IQBlock &samples_out);
+
+  // Process n samples from separate I/Q arrays.
+  void process(const IQSample::value_type *in_i,
+               const IQSample::value_type *in_q, unsigned int n,
+               IQSample::value_type *out_i, IQSample::value_type *out_q);
+
+  // Save or restore the filter history.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
 
 private:
+  typedef FirHistory<IQSample::value_type> History;
+
+  // Filter one plane with the filter history of that plane.
+  void filter_plane(const IQSample::value_type *samples_in, unsigned int n,
+                    History &history, IQSample::value_type *samples_out);
+
   std::vector<IQSample::value_type> m_coeff;
-  IQSampleVector m_state;
+  FirKernel m_fir; // selected at construction
+  History m_history_i;
+  History m_history_q;
 };
 
 // Downsampler with low-pass FIR filter for real-valued signals.
-// Step 1: Low-pass filter based on Lanczos FIR filter
+// Step 1: Low-pass filter based on equiripple FIR filter
 // Step 2: (optional) Decimation by an arbitrary factor (integer or float)
 class DownsampleFilter {
 public:
   // Construct low-pass filter with optional downsampling.
-  // filter_order :: FIR filter order
-  // cutoff       :: Cutoff frequency relative to the full input sample rate
+  // spec         :: Filter specification relative to the input sample rate
   // downsample   :: Decimation factor (>= 1) or 1 to disable
   // integer_factor :: Enables a faster and more precise algorithm that
   //                   only works for integer downsample factors
   // The output sample rate is (input_sample_rate / downsample)
-  DownsampleFilter(unsigned int filter_order, double cutoff,
-                   double downsample = 1, bool integer_factor = true);
+  DownsampleFilter(const LowPassSpec &spec, double downsample = 1,
+                   bool integer_factor = true);
+
+  // Return the number of filter taps.
+  unsigned int get_taps() const { return m_order; }
+
+  // Return the maximum number of output samples which the next call
+  // to process() produces from n input samples.
+  unsigned int max_output_size(unsigned int n) const;
 
   // Process samples.
-  void process(const SampleVector &samples_in, SampleVector &samples_out);
+  // stats :: If not NULL, receives the level of the output
+  void process(const SampleVector &samples_in, SampleVector &samples_out,
+               SampleStats *stats = NULL);
+
+  // Process n samples from an array.
+  // out_capacity must be at least max_output_size(n).
+  // Return the number of output samples.
+  unsigned int process(const Sample *samples_in, unsigned int n,
+                       Sample *samples_out, unsigned int out_capacity,
+                       SampleStats *stats = NULL);
+
+  // Clear the filter history and start resampling at the next input
+  // sample, as if the filter had just been constructed.
+  void reset();
+
+  // Save or restore the filter history and resampling position.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
 
 private:
   double m_downsample;
   unsigned int m_downsample_int;
   unsigned int m_pos_int;
-  Sample m_pos_frac;
-  SampleVector m_coeff;
-  SampleVector m_state;
+  std::uint64_t m_in_cnt;
+  std::uint64_t m_out_cnt;
+  unsigned int m_order;
+  bool m_symmetric;          // use the folded kernel (integer factor only)
+  DecimateKernel m_decimate; // fixed-length kernel (integer factor) or NULL
+  SampleVector m_coeff_rev;
+  FirHistory<Sample> m_history;
+};
+
+// Low-pass filter with exact rational resampling by L/M (polyphase).
+class RationalResampler {
+public:
+  // Largest interpolation factor L (number of filter phases).
+  static const unsigned int max_phases = 1024;
+
+  // Find the resampling ratio L/M (in lowest terms) from rate_in to
+  // rate_out. If the exact ratio needs more than max_phases phases
+  // (or a rate is not an integer), find the closest fraction with at
+  // most max_phases phases instead.
+  // Return true if the ratio is exact.
+  static bool find_ratio(double rate_in, double rate_out,
+                         unsigned int &interpolation,
+                         unsigned int &decimation);
+
+  // Construct resampler.
+  // rate_in  :: Input sample rate (only the ratio to rate_out matters)
+  // rate_out :: Output sample rate
+  // spec     :: Filter specification relative to the input sample rate
+  RationalResampler(double rate_in, double rate_out, const LowPassSpec &spec);
+
+  // Return the number of filter taps per output sample.
+  unsigned int get_taps() const { return m_order; }
+
+  // Return the interpolation factor L.
+  unsigned int get_interpolation() const { return m_interpolation; }
+
+  // Return the decimation factor M.
+  unsigned int get_decimation() const { return m_decimation; }
+
+  // Return the maximum number of output samples which the next call
+  // to process() produces from n input samples.
+  unsigned int max_output_size(unsigned int n) const;
+
+  // Process samples.
+  void process(const SampleVector &samples_in, SampleVector &samples_out);
+
+  // Process n samples from an array.
+  // out_capacity must be at least max_output_size(n).
+  // Return the number of output samples.
+  unsigned int process(const Sample *samples_in, unsigned int n,
+                       Sample *samples_out, unsigned int out_capacity);
+
+  // Save or restore the filter history and resampling position.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
+private:
+  unsigned int m_interpolation;
+  unsigned int m_decimation;
+  unsigned int m_order;
+  std::uint64_t m_pos; // next output position in 1/L input samples
+  bool m_symmetric;         // every phase is symmetric (L = 1)
+  SampleVector m_coeff_rev; // m_order reversed coefficients per phase
+  FirHistory<Sample> m_history;
 };
 
 // First order low-pass IIR filter for real-valued signals.
@@ -93,6 +238,9 @@ public:
   // Process samples.
   void process(const SampleVector &samples_in, SampleVector &samples_out);
 
+  // Process n samples from an array (samples_out may equal samples_in).
+  void process(const Sample *samples_in, unsigned int n, Sample *samples_out);
+
   // Process samples in-place.
   void process_inplace(SampleVector &samples);
 
@@ -100,9 +248,18 @@ public:
   void process_interleaved(const SampleVector &samples_in,
                            SampleVector &samples_out);
 
+  // Process n interleaved samples from an array
+  // (samples_out may equal samples_in).
+  void process_interleaved(const Sample *samples_in, unsigned int n,
+                           Sample *samples_out);
+
   // Process interleaved samples in-place.
   void process_interleaved_inplace(SampleVector &samples);
 
+  // Save or restore the filter state.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
 private:
   double m_timeconst;
   Sample m_a1;
@@ -122,6 +279,16 @@ public:
   // Process samples.
   void process(const SampleVector &samples_in, SampleVector &samples_out);
 
+  // Process n samples from an array (samples_out may equal samples_in).
+  void process(const Sample *samples_in, unsigned int n, Sample *samples_out);
+
+  // Process samples in-place.
+  void process_inplace(SampleVector &samples);
+
+  // Save or restore the filter state.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
 private:
   Sample b0, a1, a2, a3, a4;
   Sample y1, y2, y3, y4;
@@ -138,9 +305,16 @@ public:
   // Process samples.
   void process(const SampleVector &samples_in, SampleVector &samples_out);
 
+  // Process n samples from an array (samples_out may equal samples_in).
+  void process(const Sample *samples_in, unsigned int n, Sample *samples_out);
+
   // Process samples in-place.
   void process_inplace(SampleVector &samples);
 
+  // Save or restore the filter state.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
 private:
   Sample b0, b1, b2, a1, a2;
   Sample x1, x2, y1, y2;
@@ -0,0 +1,34 @@
+#ifndef SOFTFM_FIRDESIGN_H
+#define SOFTFM_FIRDESIGN_H
+
+#include <vector>
+
+// Specification of a linear-phase low-pass FIR filter.
+// Frequencies are relative to the sample rate (0.0 ... 0.5).
+struct LowPassSpec {
+  double passband;    // passband edge
+  double stopband;    // stopband edge (passband < stopband <= 0.5)
+  double ripple;      // maximum passband deviation from unity gain in dB
+  double attenuation; // minimum stopband attenuation in dB
+};
+
+// Design an equiripple low-pass filter with ntaps taps (Parks-McClellan).
+// weight    :: Stopband error weight relative to the passband
+// coeff     :: Receives ntaps symmetric coefficients
+// deviation :: Receives the maximum weighted error (passband deviation)
+// Return false if the exchange algorithm did not converge.
+bool design_equiripple_lowpass(unsigned int ntaps, double passband,
+                               double stopband, double weight,
+                               std::vector<double> &coeff, double &deviation);
+
+// Design a low-pass filter which meets spec with the fewest taps.
+// Filters longer than a few hundred taps (polyphase prototypes) use a
+// Kaiser window instead of the exchange algorithm. Designs are cached per
+// spec (thread safe), so constructing further filters is cheap.
+// coeff :: Receives the symmetric coefficients
+void design_lowpass(const LowPassSpec &spec, std::vector<double> &coeff);
+
+// Estimate the number of taps design_lowpass() needs for spec.
+unsigned int estimate_lowpass_taps(const LowPassSpec &spec);
+
+#endif
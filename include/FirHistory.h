@@ -0,0 +1,83 @@
+#ifndef SOFTFM_FIRHISTORY_H
+#define SOFTFM_FIRHISTORY_H
+
+#include <algorithm>
+#include <vector>
+
+#include "DecoderState.h"
+#include "IQBlock.h"
+
+// Input history shared by the FIR filters.
+//
+// A FIR filter of order N sees its input as x = (last N input samples,
+// new block), and each output sample is a dot product over a window of
+// at most N + 1 consecutive samples of x. FirHistory presents every such
+// window as one contiguous array without copying the block: a window which
+// starts in the history reads a staging buffer holding the history and the
+// first N samples of the block, any later window reads the block itself.
+// So each output is a single dot product with no boundary cases, and only
+// 2 * N samples are copied per block.
+//
+// Per block:
+//   history.begin(in, n);
+//   ... dot products over history.window(s), s < n ...
+//   history.end();
+// The block must not change until end() is called.
+template <class T> class FirHistory {
+public:
+  // Construct history of order samples (initially zero).
+  explicit FirHistory(unsigned int order = 0)
+      : m_order(order), m_history(order), m_stage(2 * order), m_in(NULL),
+        m_n(0) {}
+
+  // Return the number of history samples.
+  unsigned int order() const { return m_order; }
+
+  // Start a block of n input samples.
+  void begin(const T *in, unsigned int n) {
+    m_in = in;
+    m_n = n;
+    std::copy(m_history.begin(), m_history.end(), m_stage.begin());
+    std::copy(in, in + staged(), m_stage.begin() + m_order);
+  }
+
+  // Return the number of windows which start in the staging buffer;
+  // window(s) for s >= staged() points directly into the block.
+  unsigned int staged() const { return std::min(m_n, m_order); }
+
+  // Return a pointer to x[s], the start of a window of at most
+  // order + 1 samples (s < n).
+  const T *window(unsigned int s) const {
+    return (s < m_order) ? m_stage.data() + s : m_in + (s - m_order);
+  }
+
+  // Finish the block and keep the last order samples of x.
+  void end() {
+    if (m_n >= m_order) {
+      std::copy(m_in + m_n - m_order, m_in + m_n, m_history.begin());
+    } else {
+      std::copy(m_stage.begin() + m_n, m_stage.begin() + m_n + m_order,
+                m_history.begin());
+    }
+    m_in = NULL;
+    m_n = 0;
+  }
+
+  // Clear the history to zero.
+  void reset() { std::fill(m_history.begin(), m_history.end(), T(0)); }
+
+  // Save or restore the history.
+  void save_state(StateWriter &w) const { w.put(m_history); }
+  void restore_state(StateReader &r) { r.get(m_history); }
+
+private:
+  typedef std::vector<T, AlignedAllocator<T>> Buffer;
+
+  unsigned int m_order;
+  Buffer m_history; // last order input samples
+  Buffer m_stage;   // history followed by the start of the block
+  const T *m_in;
+  unsigned int m_n;
+};
+
+#endif
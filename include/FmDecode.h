@@ -2,10 +2,15 @@
 #define SOFTFM_FMDECODE_H
 
 #include <cstdint>
+#include <deque>
 #include <vector>
 
+#include "BufferArena.h"
+#include "DecoderState.h"
 #include "Filter.h"
+#include "RdsDecoder.h"
 #include "SoftFM.h"
+#include "StageProfiler.h"
 
 // Detect frequency by phase discrimination between successive samples.
 class PhaseDiscriminator {
@@ -18,12 +23,30 @@ public:
   // Process samples.
   // Output is a sequence of frequency estimates, scaled such that
   // output value +/- 1.0 represents the maximum frequency deviation.
-  void process(const IQSampleVector &samples_in, SampleVector &samples_out);
+  void process(const IQBlock &samples_in, SampleVector &samples_out);
+
+  // Process n samples from separate I/Q arrays;
+  // samples_out must have room for n samples.
+  void process(const IQSample::value_type *in_i,
+               const IQSample::value_type *in_q, unsigned int n,
+               Sample *samples_out);
+
+  // Return the peak magnitude of the IQ samples of the last block.
+  double get_peak_level() const { return m_peak_level; }
+
+  // Return the RMS magnitude of the IQ samples of the last block.
+  double get_rms_level() const { return m_rms_level; }
+
+  // Save or restore the previous samples.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
 
 private:
   const Sample m_freq_scale_factor;
   IQSample m_last1_sample;
   IQSample m_last2_sample;
+  double m_peak_level;
+  double m_rms_level;
 };
 
 class DiscriminatorEqualizer {
@@ -31,9 +54,28 @@ public:
   // Construct equalizer for phase discriminator.
   DiscriminatorEqualizer(double ifeq_static_gain, double ifeq_fit_factor);
 
+  // Return the equalizer parameters for an IF sample rate, which
+  // compensate the aperture effect of the phase discriminator up to
+  // 57 kHz. They are fitted once per rate and cached (thread safe).
+  static void get_parameters(double sample_rate_if, double &static_gain,
+                             double &fit_factor);
+
   // process samples.
   // Output is a sequence of equalized output.
-  void process(const SampleVector &samples_in, SampleVector &samples_out);
+  // stats :: If not NULL, receives the level of the output
+  void process(const SampleVector &samples_in, SampleVector &samples_out,
+               SampleStats *stats = NULL);
+
+  // Process n samples from an array (samples_out may equal samples_in).
+  void process(const Sample *samples_in, unsigned int n, Sample *samples_out,
+               SampleStats *stats = NULL);
+
+  // Process samples in-place.
+  void process_inplace(SampleVector &samples, SampleStats *stats = NULL);
+
+  // Save or restore the previous sample.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
 
 private:
   double m_static_gain;
@@ -63,39 +105,71 @@ public:
 
   // Process samples and extract 19 kHz pilot tone.
   // Generate phase-locked 38 kHz tone with unit amplitude.
-  // pilot_shift :: true to shift pilot phase
-  //             :: (use cos(2*x) instead of sin (2*x))
-  //             :: (for multipath distortion detection)
+  // pilot_shift   :: true to shift pilot phase
+  //               :: (use cos(2*x) instead of sin (2*x))
+  //               :: (for multipath distortion detection)
+  // pilot_phasor  :: if not NULL, receives the locked 19 kHz phasor
+  //                  (cos(x), sin(x)) for each sample (used for RDS)
   void process(SampleVector &samples_in, SampleVector &samples_out,
-               bool pilot_shift);
+               bool pilot_shift, IQSampleVector *pilot_phasor = NULL);
+
+  // Process n samples from an array; samples_out (and pilot_phasor
+  // if not NULL) must have room for n samples and must not overlap
+  // samples_in, from which the locked pilot tone is removed in place.
+  void process(Sample *samples_in, unsigned int n, Sample *samples_out,
+               bool pilot_shift, IQSample *pilot_phasor = NULL);
 
   // Return true if the phase-locked loop is locked.
   bool locked() const { return m_lock_cnt >= m_lock_delay; }
 
   // Return detected amplitude of pilot signal.
-  double get_pilot_level() const { return 2 * m_pilot_level; }
+  double get_pilot_level() const { return 2 * m_pilot_level_last; }
 
   // Return PPS events from the most recently processed block.
-  std::vector<PpsEvent> get_pps_events() const { return m_pps_events; }
+  const std::vector<PpsEvent> &get_pps_events() const { return m_pps_events; }
+
+  // Return indices of the samples, counted from the start of the stream,
+  // at which the lock status changed in the most recently processed block.
+  // The lock status is only updated at the end of fixed-length windows,
+  // so it does not depend on how the input is split into blocks.
+  const std::vector<std::uint64_t> &get_lock_changes() const {
+    return m_lock_changes;
+  }
 
   // Return detected phase error of pilot signal.
   double get_phase_error() const { return m_loopfilter_x1; }
 
+  // Return the number of samples processed.
+  std::uint64_t get_sample_count() const { return m_sample_cnt; }
+
+  // Drop the lock and restart acquisition at the center frequency
+  // (for a new station). Sample and PPS counters continue.
+  void reset();
+
+  // Save or restore the loop, level and lock detector state.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
 private:
   Sample m_minfreq, m_maxfreq;
   Sample m_phasor_b0, m_phasor_a1, m_phasor_a2;
   Sample m_phasor_i1, m_phasor_i2, m_phasor_q1, m_phasor_q2;
   Sample m_loopfilter_b0, m_loopfilter_b1;
   Sample m_loopfilter_x1;
+  Sample m_center_freq;
   Sample m_freq, m_phase;
   Sample m_minsignal;
   Sample m_pilot_level;
+  Sample m_pilot_level_last;
+  int m_level_window;
+  int m_level_cnt;
   int m_lock_delay;
   int m_lock_cnt;
   int m_pilot_periods;
   std::uint64_t m_pps_cnt;
   std::uint64_t m_sample_cnt;
   std::vector<PpsEvent> m_pps_events;
+  std::vector<std::uint64_t> m_lock_changes;
 };
 
 // Complete decoder for FM broadcast signal.
@@ -109,6 +183,27 @@ public:
   static constexpr double pilot_freq = 19000;
   static constexpr unsigned int finetuner_table_size = 256;
 
+  // Finer tuning resolution for automatic frequency control
+  // (234 Hz at 960 kS/s), and maximum correction in Hz.
+  static constexpr unsigned int afc_table_size = 4096;
+  static constexpr double afc_range = 25000;
+
+  // Sample rates chosen by plan_rates().
+  struct RatePlan {
+    unsigned int downsample;    // IF to baseband decimation factor
+    unsigned int interpolation; // baseband to audio resampling by L/M
+    unsigned int decimation;
+    bool exact;  // false if L/M only approximates the ratio of the rates
+    double cost; // estimated multiply-accumulates per audio frame
+  };
+
+  // Choose the decimation from IF to baseband rate which needs the
+  // fewest multiply-accumulates per audio frame, keeping the baseband
+  // rate at least 2.2 * bandwidth_if (no loss of information) and
+  // preferring an exact baseband to audio resampling ratio.
+  static RatePlan plan_rates(double sample_rate_if, double sample_rate_pcm,
+                             double bandwidth_if = default_bandwidth_if);
+
   // Construct FM decoder.
   // Stereo decoding always enabled.
   // sample_rate_if   :: IQ sample rate in Hz.
@@ -131,13 +226,19 @@ public:
   // pilot_shift      :: True to shift pilot signal phase
   //                  :: (use cos(2*x) instead of sin (2*x))
   //                  :: (for multipath distortion detection)
+  // rds              :: True to enable the RDS decoder
+  // afc              :: True to keep the station centred in the IF filter
+  //                     by retuning the fine tuner from the measured
+  //                     carrier offset (corrections are applied between
+  //                     blocks, so the output depends on the block length)
   FmDecoder(double sample_rate_if, double ifeq_static_gain,
             double ifeq_fit_factor, double tuning_offset,
             double sample_rate_pcm, double deemphasis = default_deemphasis_eu,
             double bandwidth_if = default_bandwidth_if,
             double freq_dev = default_freq_dev,
             double bandwidth_pcm = default_bandwidth_pcm,
-            unsigned int downsample = 1, bool pilot_shift = false);
+            unsigned int downsample = 1, bool pilot_shift = false,
+            bool rds = false, bool afc = false);
 
   // Process IQ samples and return audio samples.
   //
@@ -145,21 +246,90 @@ public:
   // channels are interleaved in the output vector (even if no stereo
   // signal is detected). If the decoder is set in mono mode, the output
   // vector only contains samples for one channel.
+  //
+  // The audio output does not depend on how the IQ stream is split into
+  // blocks, so any block length (including very small ones) may be used.
   void process(const IQSampleVector &samples_in, SampleVector &audio);
 
+  // Process IQ samples already split into I/Q planes.
+  // (avoids the conversion done by the IQSampleVector version)
+  void process(const IQBlock &samples_in, SampleVector &audio);
+
+  // Return the maximum number of audio samples (left and right counted
+  // separately) which the next call to process() produces from n IQ samples.
+  unsigned int max_output_size(unsigned int n) const;
+
+  // Allocate the working buffers for blocks of up to n IQ samples.
+  // All intermediate signals of a block are carved from one aligned
+  // allocation which is reused for every block, so process() does not
+  // allocate memory unless a longer block arrives.
+  void reserve(unsigned int n);
+
+  // Process n IQ samples from separate I/Q arrays owned by the caller,
+  // and write interleaved left/right audio samples to audio.
+  // out_capacity must be at least max_output_size(n).
+  // Return the number of audio samples written.
+  unsigned int process(const IQSample::value_type *in_i,
+                       const IQSample::value_type *in_q, unsigned int n,
+                       Sample *audio, unsigned int out_capacity);
+
+  // Same as above for an array of interleaved IQ samples.
+  unsigned int process(const IQSample *samples_in, unsigned int n,
+                       Sample *audio, unsigned int out_capacity);
+
+  // Save the complete decoder state (filter histories, oscillator and
+  // PLL phase, lock detector, levels and RDS) as a compact binary
+  // snapshot. A decoder restored from it continues exactly where this
+  // one stopped, without warm-up or PLL re-lock.
+  void save_state(std::vector<std::uint8_t> &data) const;
+
+  // Restore a snapshot made by save_state() of a decoder constructed
+  // with the same parameters. Return false, leaving the decoder
+  // unchanged, if the snapshot is invalid or does not match.
+  bool restore_state(const std::uint8_t *data, std::size_t size);
+
   // Return true if a stereo signal is detected.
   bool stereo_detected() const { return m_stereo_detected; }
 
+  // Return the number of audio frames produced so far.
+  std::uint64_t get_pcm_count() const { return m_pcm_cnt; }
+
+  // Return the number of IF samples processed so far.
+  std::uint64_t get_sample_count() const { return m_if_cnt; }
+
+  // Change the frequency offset of the station while running, reusing
+  // all buffers and filters.
+  // tuning_offset :: new offset in Hz with respect to the receiver LO
+  //                  (after any change of the tuner frequency)
+  // new_station   :: true to drop the pilot lock, stereo status, RDS
+  //                  programme information and carrier offset estimate of
+  //                  the previous station; false for a small correction
+  //                  of the same station
+  // Return the index of the first IF sample decoded at the new offset
+  // (the next sample passed to process()).
+  // A snapshot can only be restored into a decoder with the same offset.
+  std::uint64_t retune(double tuning_offset, bool new_station);
+
   // Return actual frequency offset in Hz with respect to receiver LO.
   double get_tuning_offset() const {
-    double tuned =
-        -m_tuning_shift * m_sample_rate_if / double(m_tuning_table_size);
+    double tuned = -(m_tuning_shift + m_afc_shift) * m_sample_rate_if /
+                   double(m_tuning_table_size);
     return tuned + m_baseband_mean * m_freq_dev;
   }
 
-  // Return RMS IF level (where full scale IQ signal is 1.0).
+  // Return the correction in Hz applied by automatic frequency control.
+  double get_afc_offset() const {
+    return -m_afc_shift * m_sample_rate_if / double(m_tuning_table_size);
+  }
+
+  // Return RMS IF level of the last block (where full scale IQ signal
+  // is 1.0).
   double get_if_level() const { return m_if_level; }
 
+  // Return peak IF level of the last block. A longer block is more likely
+  // to contain a higher peak, so this depends on the block length.
+  double get_if_peak_level() const { return m_if_peak_level; }
+
   // Return RMS baseband signal level (where nominal level is 0.707).
   double get_baseband_level() const { return m_baseband_level; }
 
@@ -170,49 +340,100 @@ public:
   double get_phase_error() const { return m_pilotpll.get_phase_error(); }
 
   // Return PPS events from the most recently processed block.
-  std::vector<PilotPhaseLock::PpsEvent> get_pps_events() const {
+  const std::vector<PilotPhaseLock::PpsEvent> &get_pps_events() const {
     return m_pilotpll.get_pps_events();
   }
 
+  // Return true if the RDS decoder is enabled.
+  bool rds_enabled() const { return m_rds_enabled; }
+
+  // Return the RDS decoder (groups and programme information).
+  const RdsDecoder &get_rds() const { return m_rds; }
+
+  // Return per-stage processing time statistics.
+  // (all zero unless compiled with SOFTFM_PROFILE)
+  const StageProfiler &get_profiler() const { return m_profiler; }
+
 private:
+  // Working buffer which holds an IQ block as separate I/Q planes, or a
+  // real signal in the same memory once the planes are no longer needed.
+  struct StageBuffer {
+    IQSample::value_type *i;
+    IQSample::value_type *q;
+    Sample *x;
+  };
+
+  // Carve the working buffers for blocks of n IQ samples from the arena.
+  void carve_buffers(unsigned int n);
+
   // Demodulate stereo L-R signal.
-  void demod_stereo(const SampleVector &samples_baseband,
-                    SampleVector &samples_stereo);
+  void demod_stereo(const Sample *samples_baseband, unsigned int n,
+                    Sample *samples_stereo);
+
+  // Build n frames of interleaved left/right output, switching between
+  // mono and stereo at the PCM samples where the pilot lock status changed.
+  void make_left_right(const Sample *samples_mono,
+                       const Sample *samples_stereo, unsigned int n,
+                       Sample *audio);
 
   // Duplicate mono signal in left/right channels.
-  void mono_to_left_right(const SampleVector &samples_mono,
-                          SampleVector &audio);
+  void mono_to_left_right(const Sample *samples_mono, Sample *audio,
+                          unsigned int begin,
+                          unsigned int end);
 
   // Extract left/right channels from mono/stereo signals.
-  void stereo_to_left_right(const SampleVector &samples_mono,
-                            const SampleVector &samples_stereo,
-                            SampleVector &audio);
+  void stereo_to_left_right(const Sample *samples_mono,
+                            const Sample *samples_stereo,
+                            Sample *audio, unsigned int begin,
+                            unsigned int end);
+
+  // Re-centre the fine tuner on the measured carrier offset.
+  void update_afc();
+
+  // Return the largest fine tuner correction of the AFC in table steps.
+  int afc_max_shift() const;
+
+  // Read the decoder state from a snapshot (or only check it).
+  void read_state(StateReader &r);
 
   // Fill zero signal in left/right channels.
-  // (samples_mono used for the size determination only)
-  void zero_to_left_right(const SampleVector &samples_mono,
-                          SampleVector &audio);
+  void zero_to_left_right(Sample *audio, unsigned int begin,
+                          unsigned int end);
 
   // Data members.
   const double m_sample_rate_if;
   const double m_sample_rate_baseband;
+  const double m_pcm_step;
   const int m_tuning_table_size;
-  const int m_tuning_shift;
+  int m_tuning_shift;
   const double m_freq_dev;
   const unsigned int m_downsample;
   const bool m_pilot_shift;
+  const bool m_rds_enabled;
+  const bool m_afc_enabled;
+  int m_afc_shift;
   bool m_stereo_detected;
+  bool m_stereo_output;
+  std::uint64_t m_pcm_cnt;
+  std::deque<std::uint64_t> m_pcm_lock_changes;
+  std::uint64_t m_if_cnt;
   double m_if_level;
+  double m_if_peak_level;
   double m_baseband_mean;
   double m_baseband_level;
 
-  IQSampleVector m_buf_iftuned;
-  IQSampleVector m_buf_iffiltered;
-  SampleVector m_buf_baseband;
-  SampleVector m_buf_baseband_raw;
-  SampleVector m_buf_mono;
-  SampleVector m_buf_rawstereo;
-  SampleVector m_buf_stereo;
+  // Working buffers, carved from m_arena for blocks of up to
+  // m_buf_capacity IQ samples (m_buf_baseband_capacity baseband and
+  // m_buf_pcm_capacity audio samples). The stages run in place or
+  // alternate between m_buf_ping and m_buf_pong.
+  BufferArena m_arena;
+  unsigned int m_buf_capacity;
+  unsigned int m_buf_baseband_capacity;
+  unsigned int m_buf_pcm_capacity;
+  StageBuffer m_buf_ping;
+  StageBuffer m_buf_pong;
+  Sample *m_buf_mono;
+  IQSample *m_buf_pilot_phasor;
 
   FineTuner m_finetuner;
   LowPassFilterFirIQ m_iffilter;
@@ -220,12 +441,13 @@ private:
   DiscriminatorEqualizer m_disceq;
   DownsampleFilter m_resample_baseband;
   PilotPhaseLock m_pilotpll;
-  DownsampleFilter m_resample_mono;
-  DownsampleFilter m_resample_stereo;
+  RationalResampler m_resample_mono;
+  RationalResampler m_resample_stereo;
   HighPassFilterIir m_dcblock_mono;
   HighPassFilterIir m_dcblock_stereo;
-  LowPassFilterRC m_deemph_mono;
-  LowPassFilterRC m_deemph_stereo;
+  LowPassFilterRC m_deemph;
+  RdsDecoder m_rds;
+  StageProfiler m_profiler;
 };
 
 #endif
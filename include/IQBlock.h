@@ -0,0 +1,96 @@
+#ifndef SOFTFM_IQBLOCK_H
+#define SOFTFM_IQBLOCK_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+#include "Kernels.h"
+#include "SoftFM.h"
+
+// Allocator for std::vector which returns memory aligned to
+// Alignment bytes, so SIMD kernels can use aligned loads.
+template <class T, std::size_t Alignment = 64> class AlignedAllocator {
+public:
+  typedef T value_type;
+
+  template <class U> struct rebind {
+    typedef AlignedAllocator<U, Alignment> other;
+  };
+
+  AlignedAllocator() {}
+  template <class U>
+  AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+  T *allocate(std::size_t n) {
+    void *p = NULL;
+    if (posix_memalign(&p, Alignment, n * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, std::size_t) { free(p); }
+};
+
+template <class T, class U, std::size_t A>
+bool operator==(const AlignedAllocator<T, A> &,
+                const AlignedAllocator<U, A> &) {
+  return true;
+}
+
+template <class T, class U, std::size_t A>
+bool operator!=(const AlignedAllocator<T, A> &,
+                const AlignedAllocator<U, A> &) {
+  return false;
+}
+
+// One plane (I or Q) of an IQ block.
+typedef std::vector<IQSample::value_type,
+                    AlignedAllocator<IQSample::value_type>>
+    IQPlane;
+
+// Block of IQ samples stored as separate, aligned I and Q planes
+// (structure of arrays). The front-end kernels work on this layout
+// because interleaved std::complex data needs shuffles to vectorize.
+struct IQBlock {
+  IQPlane i;
+  IQPlane q;
+
+  unsigned int size() const { return i.size(); }
+  bool empty() const { return i.empty(); }
+
+  void resize(unsigned int n) {
+    i.resize(n);
+    q.resize(n);
+  }
+
+  void clear() {
+    i.clear();
+    q.clear();
+  }
+};
+
+// Split interleaved IQ samples into I and Q planes.
+inline void iq_deinterleave(const IQSampleVector &samples_in,
+                            IQBlock &samples_out) {
+  unsigned int n = samples_in.size();
+  samples_out.resize(n);
+
+  kernels().deinterleave(
+      reinterpret_cast<const IQSample::value_type *>(samples_in.data()),
+      samples_out.i.data(), samples_out.q.data(), n);
+}
+
+// Merge I and Q planes into interleaved IQ samples.
+inline void iq_interleave(const IQBlock &samples_in,
+                          IQSampleVector &samples_out) {
+  unsigned int n = samples_in.size();
+  samples_out.resize(n);
+
+  for (unsigned int k = 0; k < n; k++) {
+    samples_out[k] = IQSample(samples_in.i[k], samples_in.q[k]);
+  }
+}
+
+#endif
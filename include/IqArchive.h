@@ -0,0 +1,146 @@
+#ifndef SOFTFM_IQARCHIVE_H
+#define SOFTFM_IQARCHIVE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "IQBlock.h"
+#include "SoftFM.h"
+
+class FmDecoder;
+
+// SoftFM IQ archive: a seekable container for long IQ recordings.
+//
+// The file starts with a header holding the capture metadata, followed by
+// chunks of IQ samples (unsigned 8-bit I/Q pairs as written by rtl_sdr).
+// Each chunk can carry a checkpoint: a snapshot of the decoder state (see
+// FmDecoder::save_state()) taken just before the first sample of the
+// chunk. An index of all chunks and a trailer follow the last chunk.
+//
+// A reader (IqFileSource) finds any sample through the index, and can
+// restore the decoder from the nearest checkpoint to decode a time span
+// without decoding the recording from the start. If the writer did not
+// finish (no index), the chunks are found by scanning the file.
+//
+// All values are stored in host byte order, like decoder snapshots.
+//
+//   header     magic "SFMIQARC", version, sample format, sample rate,
+//              tuner frequency, station frequency, tuner gain,
+//              decoder flags, start time
+//   chunk      magic, state size, first sample, number of samples,
+//              first audio frame, decoder snapshot, IQ data
+//   index      first sample, file offset, number of samples, state size
+//              (one entry per chunk)
+//   trailer    index offset, number of chunks, magic
+namespace IqArchive {
+
+static const char file_magic[8] = {'S', 'F', 'M', 'I', 'Q', 'A', 'R', 'C'};
+static const std::uint32_t version = 1;
+static const std::uint32_t format_u8 = 1;
+static const std::uint32_t chunk_magic = 0x434d4653;   // "SFMC"
+static const std::uint32_t trailer_magic = 0x584d4653; // "SFMX"
+
+// Decoder flags: options of the decoder which made the checkpoints.
+// A checkpoint only restores into a decoder with the same options.
+static const std::uint32_t decoder_rds = 1;
+static const std::uint32_t decoder_afc = 2;
+
+static const unsigned int header_size = 56;
+static const unsigned int chunk_header_size = 32;
+static const unsigned int index_entry_size = 24;
+static const unsigned int trailer_size = 16;
+
+// Capture metadata.
+struct Info {
+  double sample_rate;     // IQ sample rate in Hz
+  double frequency;       // tuner center frequency in Hz
+  double station;         // frequency of the decoded station in Hz
+  std::int32_t gain;      // tuner gain in 0.1 dB, or INT32_MIN for auto
+  std::uint32_t decoder_flags; // decoder_rds, decoder_afc
+  double start_time;      // Unix time of the first sample
+};
+
+// Decoder snapshot stored with a chunk.
+struct Checkpoint {
+  std::uint64_t sample; // IQ sample index at which the snapshot was taken
+  std::uint64_t frame;  // audio frames decoded before that sample
+  std::vector<std::uint8_t> state;
+};
+
+} // namespace IqArchive
+
+// Write an IQ archive.
+class IqArchiveWriter {
+public:
+  // Default chunk length (and checkpoint interval) in seconds.
+  static constexpr double default_chunk_seconds = 10.0;
+
+  // Create archive file.
+  // filename      :: file name (including path)
+  // info          :: capture metadata
+  // chunk_samples :: minimum number of IQ samples per chunk
+  IqArchiveWriter(const std::string &filename, const IqArchive::Info &info,
+                  std::uint64_t chunk_samples);
+
+  // Finish and close the archive.
+  ~IqArchiveWriter();
+
+  // Append a block of IQ samples.
+  // decoder :: if not NULL, the decoder which has processed all samples
+  //            written so far; its state is stored as checkpoint when
+  //            a new chunk starts with this block
+  // Return false if an error occurred.
+  bool write(const IQBlock &samples, const FmDecoder *decoder = NULL);
+
+  // Write the index and close the file.
+  // Return false if an error occurred.
+  bool close();
+
+  // Return the number of IQ samples written.
+  std::uint64_t get_sample_count() const { return m_sample_count; }
+
+  // Return the last error, or return an empty string if there is no error.
+  std::string error() {
+    std::string ret(m_error);
+    m_error.clear();
+    return ret;
+  }
+
+  // Return true if the file is OK, return false if there is an error.
+  operator bool() const { return m_file != NULL && m_error.empty(); }
+
+private:
+  struct IndexEntry {
+    std::uint64_t first_sample;
+    std::uint64_t offset;
+    std::uint32_t nsamples;
+    std::uint32_t state_size;
+  };
+
+  // Start a new chunk at the current sample.
+  bool begin_chunk(const FmDecoder *decoder);
+
+  // Write the final sample count of the current chunk.
+  bool end_chunk();
+
+  // Write n bytes; set error on failure.
+  bool write_bytes(const void *data, std::size_t n);
+
+  std::FILE *m_file;
+  std::string m_error;
+  std::uint64_t m_chunk_samples;
+  std::uint64_t m_sample_count;
+  std::uint64_t m_frame_base;
+  bool m_have_frame_base;
+  bool m_chunk_open;
+  std::vector<IndexEntry> m_index;
+  std::vector<std::uint8_t> m_state;
+  std::vector<std::uint8_t> m_buf;
+
+  IqArchiveWriter(const IqArchiveWriter &);            // no copy constructor
+  IqArchiveWriter &operator=(const IqArchiveWriter &); // no assignment
+};
+
+#endif
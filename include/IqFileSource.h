@@ -0,0 +1,109 @@
+#ifndef SOFTFM_IQFILESOURCE_H
+#define SOFTFM_IQFILESOURCE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "IQBlock.h"
+#include "IqArchive.h"
+#include "SoftFM.h"
+
+// Read IQ samples from a recording made with rtl_sdr
+// (interleaved unsigned 8-bit I/Q pairs, no header),
+// or from an IQ archive written by IqArchiveWriter.
+class IqFileSource {
+public:
+  static const int default_block_length = 65536;
+
+  // Open IQ file.
+  // filename     :: file name (including path)
+  // block_length :: maximum number of samples returned per block
+  IqFileSource(const std::string &filename,
+               unsigned int block_length = default_block_length);
+
+  // Close IQ file.
+  ~IqFileSource();
+
+  // Return the number of IQ samples in the file.
+  std::uint64_t get_sample_count() const { return m_sample_count; }
+
+  // Return the index of the next sample to be read.
+  std::uint64_t get_position() const { return m_position; }
+
+  // Continue reading at sample index position.
+  // Return false if the file is not seekable.
+  bool seek(std::uint64_t position);
+
+  // Return true if the file is an IQ archive.
+  bool is_archive() const { return m_archive; }
+
+  // Return the capture metadata of an IQ archive.
+  const IqArchive::Info &get_info() const { return m_info; }
+
+  // Read the last decoder checkpoint at or before sample index position.
+  // Return false if the file has no such checkpoint.
+  bool get_checkpoint(std::uint64_t position,
+                      IqArchive::Checkpoint &checkpoint);
+
+  // Read the next block of up to block_length samples.
+  // Return false at end of file or if an error occurred.
+  bool get_samples(IQBlock &samples);
+
+  // Read the next block of up to block_length samples.
+  bool get_samples(IQSampleVector &samples);
+
+  // Return the last error, or return an empty string if there is no error.
+  std::string error() {
+    std::string ret(m_error);
+    m_error.clear();
+    return ret;
+  }
+
+  // Return true if the file is OK, return false if there is an error.
+  operator bool() const { return m_file != NULL && m_error.empty(); }
+
+private:
+  // Location of a chunk of an IQ archive.
+  struct Chunk {
+    std::uint64_t first_sample;
+    std::uint64_t offset; // file offset of the chunk header
+    std::uint32_t nsamples;
+    std::uint32_t state_size;
+  };
+
+  // Read the archive header and index; return false if invalid.
+  bool open_archive(std::uint64_t file_size);
+
+  // Rebuild the index of an unfinished archive by scanning its chunks.
+  bool scan_archive(std::uint64_t file_size);
+
+  // Read n bytes at file offset; return false on error.
+  bool read_at(std::uint64_t offset, void *data, std::size_t n);
+
+  // Return the index of the chunk holding sample index position.
+  unsigned int find_chunk(std::uint64_t position) const;
+
+  // Return the file offset of sample index position.
+  std::uint64_t sample_offset(std::uint64_t position) const;
+
+  // Read raw bytes of the next block; return number of samples read.
+  unsigned int read_block();
+
+  std::FILE *m_file;
+  std::string m_error;
+  unsigned int m_block_length;
+  std::uint64_t m_sample_count;
+  std::uint64_t m_position;
+  std::vector<std::uint8_t> m_buf;
+  bool m_archive;
+  IqArchive::Info m_info;
+  std::vector<Chunk> m_chunks;
+  unsigned int m_chunk; // chunk holding m_position
+
+  IqFileSource(const IqFileSource &);            // no copy constructor
+  IqFileSource &operator=(const IqFileSource &); // no assignment operator
+};
+
+#endif
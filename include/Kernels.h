@@ -0,0 +1,98 @@
+#ifndef SOFTFM_KERNELS_H
+#define SOFTFM_KERNELS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "SoftFM.h"
+
+// Real FIR filter: y[k] = sum(coeff[j] * x[k + j], j < ntaps) for k < n.
+typedef void (*FirKernel)(const float *x, const float *coeff,
+                          unsigned int ntaps, float *y, unsigned int n);
+
+// Decimating FIR filter:
+// y[i] = sum(c[j] * x[i * step + j], j < ntaps) for i < n.
+// Also adds the output to stats.
+typedef void (*DecimateKernel)(const Sample *x, const Sample *c,
+                               unsigned int ntaps, unsigned int step,
+                               Sample *y, unsigned int n, SampleStats &stats);
+
+// Hot inner loops of the decoder, built once for each instruction set.
+// The best variant supported by the CPU is selected at run time,
+// so the binary does not depend on the features of the build host.
+struct KernelTable {
+  // Short name of the variant ("generic", "sse2", "avx2", "avx512").
+  const char *name;
+
+  // Convert n unsigned 8-bit samples to float: (x - 128) / 128.
+  void (*u8_to_float)(const std::uint8_t *in, float *out, unsigned int n);
+
+  // Convert n interleaved unsigned 8-bit IQ pairs to separate I/Q planes.
+  void (*u8_to_planes)(const std::uint8_t *in, float *out_i, float *out_q,
+                       unsigned int n);
+
+  // Split n interleaved float IQ pairs into separate I/Q planes.
+  void (*deinterleave)(const float *in, float *out_i, float *out_q,
+                       unsigned int n);
+
+  // Complex multiplication: y[k] = x[k] * t[k] for k < n.
+  void (*mix)(const float *xi, const float *xq, const float *ti,
+              const float *tq, float *yi, float *yq, unsigned int n);
+
+  // Real FIR filter: y[k] = sum(coeff[j] * x[k + j], j < ntaps) for k < n.
+  void (*fir)(const float *x, const float *coeff, unsigned int ntaps,
+              float *y, unsigned int n);
+
+  // Dot product: sum(x[j] * c[j], j < n).
+  Sample (*dot)(const Sample *x, const Sample *c, unsigned int n);
+
+  // Same as fir for symmetric coefficients (coeff[j] == coeff[ntaps-1-j]);
+  // adds each mirrored pair of input samples before multiplying.
+  void (*fir_sym)(const float *x, const float *coeff, unsigned int ntaps,
+                  float *y, unsigned int n);
+
+  // Same as dot for symmetric coefficients (c[j] == c[n-1-j]).
+  Sample (*dot_sym)(const Sample *x, const Sample *c, unsigned int n);
+
+  // Return a fir_sym kernel built for exactly ntaps taps (fully unrolled,
+  // coefficients held in registers), or NULL if there is none.
+  FirKernel (*fir_sym_fixed)(unsigned int ntaps);
+
+  // Return a decimating kernel built for exactly ntaps taps,
+  // or NULL if there is none.
+  DecimateKernel (*decimate_fixed)(unsigned int ntaps);
+
+  // Phase discriminator:
+  // out[k] = scale * arg(conj(s[k]) * s[k + 1]) for k < n.
+  // (reads n + 1 samples)
+  // Return the peak power max(|s[k]|^2, k < n),
+  // and set power to the total power sum(|s[k]|^2, k < n).
+  float (*phase_disc)(const float *si, const float *sq, Sample scale,
+                      Sample *out, unsigned int n, float &power);
+
+  // Convert n samples to 16-bit little-endian PCM, clipped to +/- 1.0.
+  void (*pcm_s16le)(const Sample *in, std::uint8_t *out, unsigned int n);
+};
+
+// Return the kernel variant in use.
+// The best variant supported by the CPU is selected on the first call.
+const KernelTable &kernels();
+
+// Use the named variant instead of the automatically selected one.
+// Filters pick some of their kernels when they are constructed, so call
+// this before constructing a decoder.
+// Return false if the name is unknown or the CPU does not support it.
+bool force_kernels(const std::string &name);
+
+// Return all variants built into this binary, best first.
+std::vector<const KernelTable *> all_kernels();
+
+// Return true if the CPU can run the specified variant.
+bool kernels_supported(const KernelTable &k);
+
+// Return a space-separated list of the detected CPU features
+// relevant to the kernel variants.
+std::string cpu_features();
+
+#endif
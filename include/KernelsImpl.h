@@ -0,0 +1,223 @@
+#ifndef SOFTFM_KERNELSIMPL_H
+#define SOFTFM_KERNELSIMPL_H
+
+// Kernel implementations, included once by each sfmbase/Kernels_*.cpp.
+// Each of those files is compiled with different instruction set flags,
+// so everything here has internal linkage: an out-of-line copy built
+// for one instruction set must never be shared with another variant.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "Kernels.h"
+#include "fastatan2.h"
+
+namespace {
+
+void k_u8_to_float(const std::uint8_t *in, float *out, unsigned int n) {
+  for (unsigned int k = 0; k < n; k++) {
+    out[k] = (int(in[k]) - 128) / 128.0f;
+  }
+}
+
+void k_u8_to_planes(const std::uint8_t *in, float *out_i, float *out_q,
+                    unsigned int n) {
+  for (unsigned int k = 0; k < n; k++) {
+    out_i[k] = (int(in[2 * k]) - 128) / 128.0f;
+    out_q[k] = (int(in[2 * k + 1]) - 128) / 128.0f;
+  }
+}
+
+void k_deinterleave(const float *in, float *out_i, float *out_q,
+                    unsigned int n) {
+  for (unsigned int k = 0; k < n; k++) {
+    out_i[k] = in[2 * k];
+    out_q[k] = in[2 * k + 1];
+  }
+}
+
+void k_mix(const float *xi, const float *xq, const float *ti, const float *tq,
+           float *yi, float *yq, unsigned int n) {
+  for (unsigned int k = 0; k < n; k++) {
+    float a = xi[k], b = xq[k];
+    yi[k] = a * ti[k] - b * tq[k];
+    yq[k] = a * tq[k] + b * ti[k];
+  }
+}
+
+void k_fir(const float *x, const float *coeff, unsigned int ntaps, float *y,
+           unsigned int n) {
+  // Number of output samples computed per pass over the coefficients;
+  // small enough to keep the output in L1 cache.
+  const unsigned int tile = 1024;
+
+  // Accumulate one coefficient at a time over a tile of output samples,
+  // so the inner loop is a plain vectorizable multiply-add.
+  for (unsigned int k0 = 0; k0 < n; k0 += tile) {
+    unsigned int m = (n - k0 < tile) ? n - k0 : tile;
+    const float *xt = x + k0;
+    float *yt = y + k0;
+    float c = coeff[0];
+    for (unsigned int k = 0; k < m; k++)
+      yt[k] = xt[k] * c;
+    for (unsigned int j = 1; j < ntaps; j++) {
+      c = coeff[j];
+      const float *xj = xt + j;
+      for (unsigned int k = 0; k < m; k++)
+        yt[k] += xj[k] * c;
+    }
+  }
+}
+
+Sample k_dot(const Sample *x, const Sample *c, unsigned int n) {
+  Sample y = 0;
+  for (unsigned int j = 0; j < n; j++)
+    y += x[j] * c[j];
+  return y;
+}
+
+void k_fir_sym(const float *x, const float *coeff, unsigned int ntaps,
+               float *y, unsigned int n) {
+  const unsigned int tile = 1024;
+  const unsigned int half = ntaps / 2;
+
+  // As k_fir, but one pass per mirrored pair of taps:
+  // y[k] = sum(coeff[j] * (x[k + j] + x[k + ntaps - 1 - j]), j < half)
+  //        (+ coeff[half] * x[k + half] for an odd number of taps)
+  for (unsigned int k0 = 0; k0 < n; k0 += tile) {
+    unsigned int m = (n - k0 < tile) ? n - k0 : tile;
+    const float *xt = x + k0;
+    float *yt = y + k0;
+    if (ntaps % 2) {
+      float c = coeff[half];
+      const float *xm = xt + half;
+      for (unsigned int k = 0; k < m; k++)
+        yt[k] = xm[k] * c;
+    } else {
+      for (unsigned int k = 0; k < m; k++)
+        yt[k] = 0;
+    }
+    for (unsigned int j = 0; j < half; j++) {
+      float c = coeff[j];
+      const float *xa = xt + j;
+      const float *xb = xt + ntaps - 1 - j;
+      for (unsigned int k = 0; k < m; k++)
+        yt[k] += (xa[k] + xb[k]) * c;
+    }
+  }
+}
+
+Sample k_dot_sym(const Sample *x, const Sample *c, unsigned int n) {
+  const unsigned int half = n / 2;
+  const Sample *xr = x + n - 1;
+  Sample y = (n % 2) ? x[half] * c[half] : 0;
+  for (unsigned int j = 0; j < half; j++)
+    y += (x[j] + xr[-int(j)]) * c[j];
+  return y;
+}
+
+// Longest filters with fixed-length kernels.
+const unsigned int max_fixed_fir_taps = 32;
+const unsigned int max_fixed_decimate_taps = 64;
+
+template <unsigned int N>
+void k_fir_sym_n(const float *x, const float *coeff, unsigned int, float *y,
+                 unsigned int n) {
+  // With N known at compile time, the tap loop unrolls completely and the
+  // coefficients stay in registers while the output loop is vectorized.
+  const unsigned int half = N / 2;
+  float c[N - half];
+  for (unsigned int j = 0; j < N - half; j++)
+    c[j] = coeff[j];
+  for (unsigned int k = 0; k < n; k++) {
+    const float *xk = x + k;
+    float y0 = (N % 2) ? xk[half] * c[half] : 0;
+    for (unsigned int j = 0; j < half; j++)
+      y0 += (xk[j] + xk[N - 1 - j]) * c[j];
+    y[k] = y0;
+  }
+}
+
+template <unsigned int N>
+void k_decimate_n(const Sample *x, const Sample *coeff, unsigned int,
+                  unsigned int step, Sample *y, unsigned int n,
+                  SampleStats &stats) {
+  Sample c[N];
+  for (unsigned int j = 0; j < N; j++)
+    c[j] = coeff[j];
+  Sample sum = 0, sumsq = 0;
+  for (unsigned int i = 0; i < n; i++) {
+    const Sample *xi = x + i * step;
+    Sample y0 = 0;
+    for (unsigned int j = 0; j < N; j++)
+      y0 += xi[j] * c[j];
+    y[i] = y0;
+    sum += y0;
+    sumsq += y0 * y0;
+  }
+  stats.sum += sum;
+  stats.sumsq += sumsq;
+  stats.count += n;
+}
+
+// Find the instance for ntaps among N, N - 1, ... 3 taps.
+template <unsigned int N> FirKernel k_fir_sym_lookup(unsigned int ntaps) {
+  return (ntaps == N) ? k_fir_sym_n<N> : k_fir_sym_lookup<N - 1>(ntaps);
+}
+
+template <> FirKernel k_fir_sym_lookup<2>(unsigned int) { return NULL; }
+
+template <unsigned int N>
+DecimateKernel k_decimate_lookup(unsigned int ntaps) {
+  return (ntaps == N) ? k_decimate_n<N> : k_decimate_lookup<N - 1>(ntaps);
+}
+
+template <> DecimateKernel k_decimate_lookup<2>(unsigned int) { return NULL; }
+
+FirKernel k_fir_sym_fixed(unsigned int ntaps) {
+  return k_fir_sym_lookup<max_fixed_fir_taps>(ntaps);
+}
+
+DecimateKernel k_decimate_fixed(unsigned int ntaps) {
+  return k_decimate_lookup<max_fixed_decimate_taps>(ntaps);
+}
+
+float k_phase_disc(const float *si, const float *sq, Sample scale,
+                   Sample *out, unsigned int n, float &power) {
+  // d = conj(s[k]) * s[k + 1]
+  float peak = 0, sum = 0;
+  for (unsigned int k = 0; k < n; k++) {
+    float dre = si[k] * si[k + 1] + sq[k] * sq[k + 1];
+    float dim = si[k] * sq[k + 1] - sq[k] * si[k + 1];
+    out[k] = fastatan2_nb(dim, dre) * scale;
+    float p = si[k] * si[k] + sq[k] * sq[k];
+    peak = (p > peak) ? p : peak;
+    sum += p;
+  }
+  power = sum;
+  return peak;
+}
+
+void k_pcm_s16le(const Sample *in, std::uint8_t *out, unsigned int n) {
+  for (unsigned int k = 0; k < n; k++) {
+    Sample s = in[k];
+    s = (s < -1.0) ? -1.0 : (s > 1.0) ? 1.0 : s;
+    long v = lrint(s * 32767);
+    unsigned long u = v;
+    out[2 * k] = u & 0xff;
+    out[2 * k + 1] = (u >> 8) & 0xff;
+  }
+}
+
+} // anonymous namespace
+
+// Initializer for the KernelTable of a variant.
+#define SOFTFM_KERNEL_TABLE(name)                                              \
+  {                                                                            \
+    name, k_u8_to_float, k_u8_to_planes, k_deinterleave, k_mix, k_fir, k_dot,  \
+        k_fir_sym, k_dot_sym, k_fir_sym_fixed, k_decimate_fixed, k_phase_disc, \
+        k_pcm_s16le                                                            \
+  }
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef SOFTFM_LATENCYMONITOR_H
+#define SOFTFM_LATENCYMONITOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Return monotonic time stamp in seconds (for latency measurement).
+inline double get_monotonic_time() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Histogram of latency values with logarithmic buckets
+// (8 buckets per octave, 1 ns .. ~20 minutes).
+// Values may be recorded from any thread without locking.
+class LatencyHistogram {
+public:
+  static const unsigned int num_buckets = 320;
+
+  LatencyHistogram();
+
+  // Record a latency value in seconds.
+  void record(double seconds);
+
+  // Return number of recorded values.
+  std::uint64_t count() const { return m_count.load(); }
+
+  // Return the latency in seconds below which the fraction p
+  // (0.0 .. 1.0) of recorded values falls.
+  double percentile(double p) const;
+
+  // Return maximum recorded latency in seconds.
+  double max() const { return m_max_ns.load() * 1.0e-9; }
+
+private:
+  static unsigned int bucket_index(std::uint64_t ns);
+  static std::uint64_t bucket_upper(unsigned int idx);
+
+  std::atomic<std::uint64_t> m_buckets[num_buckets];
+  std::atomic<std::uint64_t> m_count;
+  std::atomic<std::uint64_t> m_max_ns;
+};
+
+// Latency statistics for each hop of a sample block from the USB read
+// to the audio write.
+class LatencyMonitor {
+public:
+  enum Hop {
+    SOURCE_QUEUE, // captured by rtlsdr_read_sync -> pulled by decoder
+    DECODE,       // FmDecoder::process()
+    OUTPUT_QUEUE, // pushed to output buffer -> pulled by writer
+    AUDIO_WRITE,  // AudioOutput::write()
+    END_TO_END,   // captured -> written to audio output
+    NUM_HOPS
+  };
+
+  // Return short printable name of a hop.
+  static const char *hop_name(int hop);
+
+  // Record a latency value in seconds for the specified hop.
+  void record(Hop hop, double seconds) { m_hist[hop].record(seconds); }
+
+  // Return histogram of the specified hop.
+  const LatencyHistogram &get(Hop hop) const { return m_hist[hop]; }
+
+  // Write percentiles of all hops in a machine-readable text format.
+  void dump(std::FILE *fp) const;
+
+  // Atomically replace the specified file with a new dump.
+  // Return true for success.
+  bool dump_file(const std::string &filename) const;
+
+private:
+  LatencyHistogram m_hist[NUM_HOPS];
+};
+
+#endif
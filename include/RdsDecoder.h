@@ -0,0 +1,155 @@
+#ifndef SOFTFM_RDSDECODER_H
+#define SOFTFM_RDSDECODER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "DecoderState.h"
+#include "Filter.h"
+#include "SoftFM.h"
+
+// Decoder for RDS data on the 57 kHz subcarrier.
+//
+// The subcarrier is the third harmonic of the stereo pilot, so the
+// carrier is derived from the locked pilot phasor of PilotPhaseLock
+// instead of running a separate carrier recovery loop.
+class RdsDecoder {
+public:
+  // RDS bit rate (57 kHz / 48).
+  static constexpr double bit_rate = 1187.5;
+
+  // Decoded RDS group (four blocks with valid checkwords).
+  struct Group {
+    std::uint64_t sample_index; // baseband sample completing the group
+    std::uint16_t pi;           // programme identification
+    unsigned int group_type;    // group type code 0 .. 15
+    bool version_b;             // true for version B groups
+    bool tp;                    // traffic programme flag
+    unsigned int pty;           // programme type
+    std::uint16_t blocks[4];    // raw information words A, B, C/C', D
+  };
+
+  // Construct RDS decoder.
+  // sample_rate :: Baseband sample rate in Hz.
+  RdsDecoder(double sample_rate);
+
+  // Process baseband samples.
+  // samples_in    :: Baseband (MPX) samples.
+  // pilot_phasor  :: Unit phasor of the locked 19 kHz pilot per sample.
+  // pilot_locked  :: True if the pilot PLL is locked.
+  void process(const SampleVector &samples_in,
+               const IQSampleVector &pilot_phasor, bool pilot_locked);
+
+  // Process n baseband samples from arrays; pilot_phasor must hold
+  // n samples if pilot_locked is true.
+  void process(const Sample *samples_in, unsigned int n,
+               const IQSample *pilot_phasor, bool pilot_locked);
+
+  // Return groups decoded from the most recently processed block.
+  const std::vector<Group> &get_groups() const { return m_groups; }
+
+  // Return true if block synchronization has been acquired.
+  bool synced() const { return m_synced; }
+
+  // Return last received programme identification (0 if none).
+  std::uint16_t get_pi() const { return m_pi; }
+
+  // Return last received programme type.
+  unsigned int get_pty() const { return m_pty; }
+
+  // Return programme service name (8 characters).
+  std::string get_ps() const { return std::string(m_ps, 8); }
+
+  // Return radiotext (up to 64 characters).
+  std::string get_rt() const;
+
+  // Copy programme service name to ps (9 bytes, NUL-terminated).
+  void get_ps(char *ps) const;
+
+  // Copy radiotext to rt (65 bytes, NUL-terminated).
+  void get_rt(char *rt) const;
+
+  // Drop synchronization and forget the programme information
+  // (for a new station).
+  void reset();
+
+  // Save or restore the demodulator, sync and programme state.
+  void save_state(StateWriter &w) const;
+  void restore_state(StateReader &r);
+
+private:
+  // Process one demodulated RDS sample at the decimated rate.
+  void process_symbol_sample(IQSample z);
+
+  // Process one differentially decoded data bit.
+  void process_bit(unsigned int bit);
+
+  // Decode the contents of a complete group.
+  void decode_group(const std::uint16_t *blocks);
+
+  // Reset block synchronization state.
+  void reset_sync();
+
+  // Read n programme information characters from a snapshot.
+  static void get_chars(StateReader &r, char *s, unsigned int n);
+
+  const unsigned int m_downsample;
+  const double m_sample_rate_rds;
+  const double m_clock_step;
+
+  SampleVector m_buf_mix_i;
+  SampleVector m_buf_mix_q;
+  SampleVector m_buf_rds_i;
+  SampleVector m_buf_rds_q;
+  DownsampleFilter m_resample_i;
+  DownsampleFilter m_resample_q;
+
+  // Carrier phase estimate (BPSK squared).
+  IQSample m_carrier_acc;
+  IQSample m_carrier_rot;
+
+  // Biphase matched filter.
+  std::vector<Sample> m_symbol_hist;
+  unsigned int m_symbol_pos;
+
+  // Bit clock recovery.
+  static constexpr unsigned int clock_bins = 8;
+  double m_clock_phase;
+  Sample m_clock_energy[clock_bins];
+  unsigned int m_clock_best;
+  bool m_clock_done;
+  unsigned int m_prev_symbol;
+
+  // Block synchronization.
+  std::uint32_t m_shift_reg;
+  unsigned int m_bit_cnt;
+  bool m_synced;
+  int m_last_offset;
+  unsigned int m_last_offset_bit;
+  unsigned int m_block_pos;
+  unsigned int m_block_bits;
+  unsigned int m_block_errors;
+  unsigned int m_block_cnt;
+  std::uint16_t m_blocks[4];
+  bool m_blocks_valid[4];
+
+  // Decoded programme information.
+  std::uint16_t m_pi;
+  unsigned int m_pty;
+  char m_ps[8];
+  char m_rt[64];
+  int m_rt_ab;
+
+  // Pilot lock status of the previous block.
+  bool m_pilot_locked;
+
+  // Number of baseband samples processed, and baseband index of the
+  // current sample at the decimated rate.
+  std::uint64_t m_sample_cnt;
+  std::uint64_t m_symbol_sample_index;
+
+  std::vector<Group> m_groups;
+};
+
+#endif
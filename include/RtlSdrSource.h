@@ -5,11 +5,17 @@
 #include <string>
 #include <vector>
 
+#include "IQBlock.h"
 #include "SoftFM.h"
 
 class RtlSdrSource {
 public:
   static const int default_block_length = 65536;
+  static const int min_block_length = 256;
+
+  // Time in seconds for the tuner to lock on a new frequency
+  // (with a safe margin).
+  static constexpr double tuner_settle_time = 0.05;
 
   // Open RTL-SDR device.
   RtlSdrSource(int dev_index);
@@ -21,12 +27,26 @@ public:
   // sample_rate  :: desired sample rate in Hz.
   // frequency    :: desired center frequency in Hz.
   // tuner_gain   :: desired tuner gain in 0.1 dB, or INT_MIN for auto-gain.
-  // block_length :: preferred number of samples per block.
+  // block_length :: preferred number of samples per block
+  //                 (rounded down to a multiple of min_block_length).
   // Return true for success, false if an error occurred.
   bool configure(std::uint32_t sample_rate, std::uint32_t frequency,
                  int tuner_gain, int block_length = default_block_length,
                  bool agcmode = false);
 
+  // Change the center frequency while streaming.
+  // Unlike configure(), this does not reset the USB buffer, so streaming
+  // continues without a gap. The first settle_samples() samples read
+  // after the change may still come from the old frequency or from the
+  // tuner while it locks.
+  // Return true for success, false if an error occurred.
+  bool set_frequency(std::uint32_t frequency);
+
+  // Return the number of samples after set_frequency() which are not
+  // reliably at the new frequency: one block already in the USB transfer
+  // plus the tuner lock time.
+  std::uint64_t settle_samples();
+
   // Return current sample frequency in Hz.
   std::uint32_t get_sample_rate();
 
@@ -39,6 +59,9 @@ public:
   // Return a list of supported tuner gain settings in units of 0.1 dB.
   std::vector<int> get_tuner_gains();
 
+  // Return the number of samples per block (after rounding).
+  int get_block_length() const { return m_block_length; }
+
   // Return name of opened RTL-SDR device.
   std::string get_device_name() const { return m_devname; }
 
@@ -47,6 +70,9 @@ public:
   // Return true for success, false if an error occurred.
   bool get_samples(IQSampleVector &samples);
 
+  // Fetch a bunch of samples from the device into separate I/Q planes.
+  bool get_samples(IQBlock &samples);
+
   // Return the last error, or return an empty string if there is no error.
   std::string error() {
     std::string ret(m_error);
@@ -61,8 +87,12 @@ public:
   static std::vector<std::string> get_device_names();
 
 private:
+  // Read one block of raw samples into m_buf.
+  bool read_block();
+
   struct rtlsdr_dev *m_dev;
   int m_block_length;
+  std::vector<std::uint8_t> m_buf;
   std::string m_devname;
   std::string m_error;
 };
@@ -10,21 +10,17 @@ typedef std::vector<IQSample> IQSampleVector;
 typedef double Sample;
 typedef std::vector<Sample> SampleVector;
 
-// Compute mean and RMS over a sample vector.
-inline void samples_mean_rms(const SampleVector &samples, double &mean,
-                             double &rms) {
-  Sample vsum = 0;
-  Sample vsumsq = 0;
+// Mean and RMS level of a block of samples, accumulated by the stage
+// which produces the block (so the block is not read again).
+struct SampleStats {
+  Sample sum;
+  Sample sumsq;
+  unsigned int count;
 
-  unsigned int n = samples.size();
-  for (unsigned int i = 0; i < n; i++) {
-    Sample v = samples[i];
-    vsum += v;
-    vsumsq += v * v;
-  }
+  SampleStats() : sum(0), sumsq(0), count(0) {}
 
-  mean = vsum / n;
-  rms = sqrt(vsumsq / n);
-}
+  double mean() const { return sum / count; }
+  double rms() const { return sqrt(sumsq / count); }
+};
 
 #endif
@@ -0,0 +1,136 @@
+#ifndef SOFTFM_SPECTRUMMONITOR_H
+#define SOFTFM_SPECTRUMMONITOR_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Fft.h"
+#include "IQBlock.h"
+#include "SoftFM.h"
+
+// Spectrum monitor: writes averaged power spectra of the whole IF band
+// (for a waterfall display) while the decoder runs.
+//
+// The decoder thread offers every IQ block; the monitor copies only the
+// samples of one spectrum per frame interval and hands them to its own
+// thread, which computes the spectrum and writes the frame. Handing over
+// never waits: if the monitor thread is still busy with the previous
+// frame (or blocked on a slow pipe), the new frame is dropped.
+//
+// Each frame is a header followed by one byte per frequency bin, from
+// -sample_rate/2 to +sample_rate/2. Values are stored in host byte order.
+//
+//   magic          uint32 "SFMW"
+//   nbins          uint32 number of frequency bins
+//   sample_index   uint64 IQ sample index of the first sample
+//   time           double Unix time of the first sample
+//   center_freq    double tuner frequency in Hz
+//   sample_rate    double IQ sample rate in Hz
+//   averages       uint32 number of averaged transforms
+//   dropped        uint32 number of frames dropped so far
+//   power          uint8[nbins] power in 0.5 dB steps, 0 = -127.5 dB
+//                  and 255 = 0 dB (full scale sine)
+class SpectrumMonitor {
+public:
+  static const std::uint32_t frame_magic = 0x574d4653; // "SFMW"
+  static const unsigned int header_size = 48;
+
+  static const unsigned int default_fft_size = 1024;
+  static const unsigned int default_averages = 16;
+  static constexpr double default_frame_rate = 10.0;
+
+  // Open the output file and start the monitor thread.
+  // filename    :: output file name or named pipe, "-" for stdout
+  // sample_rate :: IQ sample rate in Hz
+  // fft_size    :: number of frequency bins (a power of 2)
+  // averages    :: number of transforms averaged per frame
+  // frame_rate  :: frames per second
+  SpectrumMonitor(const std::string &filename, double sample_rate,
+                  unsigned int fft_size = default_fft_size,
+                  unsigned int averages = default_averages,
+                  double frame_rate = default_frame_rate);
+
+  // Stop the monitor thread and close the output file.
+  ~SpectrumMonitor();
+
+  // Offer a block of IQ samples; never waits for the monitor thread.
+  // sample_index :: IQ sample index of the first sample in the block
+  // time         :: Unix time of the first sample in the block
+  // center_freq  :: tuner frequency in Hz
+  void offer(const IQBlock &samples, std::uint64_t sample_index,
+             double time, double center_freq);
+
+  // Return the number of frames written.
+  std::uint64_t get_frame_count() const { return m_frame_count.load(); }
+
+  // Return the number of frames dropped.
+  std::uint64_t get_drop_count() const { return m_drop_count.load(); }
+
+  // Return the last error, or return an empty string if there is no error.
+  std::string error() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string ret(m_error);
+    m_error.clear();
+    return ret;
+  }
+
+  // Return true if the output is OK, return false if there is an error.
+  operator bool() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_file != NULL && m_error.empty();
+  }
+
+private:
+  // Samples and metadata of one frame.
+  struct Frame {
+    IQSampleVector samples;
+    std::uint64_t sample_index;
+    double time;
+    double center_freq;
+  };
+
+  // Compute and write frames until stopped.
+  void run();
+
+  // Compute the spectrum of a frame and write it.
+  bool write_frame(const Frame &frame, std::uint32_t dropped);
+
+  const Fft m_fft;
+  const double m_sample_rate;
+  const unsigned int m_averages;
+  const std::uint64_t m_frame_interval;
+
+  // Used only by the decoder thread.
+  Frame m_collect;
+  std::uint64_t m_next_frame;
+
+  // Shared with the monitor thread, protected by m_mutex.
+  std::mutex m_mutex;
+  std::condition_variable m_cond;
+  Frame m_pending;
+  bool m_have_pending;
+  bool m_stop;
+  std::string m_error;
+  std::atomic<std::uint64_t> m_frame_count;
+  std::atomic<std::uint64_t> m_drop_count;
+
+  // Used only by the monitor thread (after start).
+  std::FILE *m_file;
+  bool m_close_file;
+  std::vector<float> m_power;
+  IQSampleVector m_fft_buf;
+  std::vector<std::uint8_t> m_out;
+
+  std::thread m_thread;
+
+  SpectrumMonitor(const SpectrumMonitor &);            // no copy constructor
+  SpectrumMonitor &operator=(const SpectrumMonitor &); // no assignment
+};
+
+#endif
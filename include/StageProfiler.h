@@ -0,0 +1,144 @@
+#ifndef SOFTFM_STAGEPROFILER_H
+#define SOFTFM_STAGEPROFILER_H
+
+#include <cstdint>
+
+#ifdef SOFTFM_PROFILE
+#include <chrono>
+#endif
+
+// Processing stages of FmDecoder::process() measured by StageProfiler.
+struct DecoderStage {
+  enum Id {
+    FINETUNER,
+    IF_FILTER,
+    PHASE_DISC,
+    DISC_EQ,
+    RESAMPLE_BASEBAND,
+    BASEBAND_LEVEL,
+    PILOT_PLL,
+    RDS,
+    RESAMPLE_MONO,
+    DEMOD_STEREO,
+    RESAMPLE_STEREO,
+    AUDIO_OUTPUT,
+    COUNT
+  };
+
+  // Return short printable name of a stage.
+  static const char *name(int stage) {
+    static const char *const names[COUNT] = {
+        "finetuner",     "if_filter",    "phase_disc",      "disc_eq",
+        "resample_bb",   "baseband_lvl", "pilot_pll",       "rds",
+        "resample_mono", "demod_stereo", "resample_stereo", "audio_output"};
+    return (stage >= 0 && stage < COUNT) ? names[stage] : "?";
+  }
+};
+
+#ifdef SOFTFM_PROFILE
+
+// Per-stage timing of the decoder, enabled with -DSOFTFM_PROFILE.
+//
+// Times are accumulated per block and normalized to the number of
+// IF input samples, so all stages are directly comparable.
+// The windowed figures cover the most recently completed window of
+// window_samples input samples.
+class StageProfiler {
+public:
+  static constexpr bool enabled = true;
+
+  // Construct profiler.
+  // window_samples :: Length of the measurement window in input samples.
+  StageProfiler(std::uint64_t window_samples = 1000000)
+      : m_window_length(window_samples), m_total_samples(0),
+        m_window_samples(0), m_last_window_samples(0) {
+    for (int i = 0; i < DecoderStage::COUNT; i++) {
+      m_total_ns[i] = 0;
+      m_window_ns[i] = 0;
+      m_last_window_ns[i] = 0;
+    }
+  }
+
+  // Start timing a block of input samples.
+  void begin_block(std::uint64_t nsamples) {
+    m_block_samples = nsamples;
+    m_mark = clock::now();
+  }
+
+  // Charge the time since the previous mark to the specified stage.
+  void mark(int stage) {
+    clock::time_point now = clock::now();
+    std::uint64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(now - m_mark)
+            .count();
+    m_total_ns[stage] += ns;
+    m_window_ns[stage] += ns;
+    m_mark = now;
+  }
+
+  // Finish timing the current block.
+  void end_block() {
+    m_total_samples += m_block_samples;
+    m_window_samples += m_block_samples;
+    if (m_window_samples >= m_window_length) {
+      for (int i = 0; i < DecoderStage::COUNT; i++) {
+        m_last_window_ns[i] = m_window_ns[i];
+        m_window_ns[i] = 0;
+      }
+      m_last_window_samples = m_window_samples;
+      m_window_samples = 0;
+    }
+  }
+
+  // Return cumulative processing time in ns per input sample.
+  double get_ns_per_sample(int stage) const {
+    return m_total_samples ? double(m_total_ns[stage]) / m_total_samples : 0;
+  }
+
+  // Return processing time in ns per input sample over the last window.
+  double get_window_ns_per_sample(int stage) const {
+    return m_last_window_samples
+               ? double(m_last_window_ns[stage]) / m_last_window_samples
+               : 0;
+  }
+
+  // Return cumulative processing time in ns for the specified stage.
+  std::uint64_t get_total_ns(int stage) const { return m_total_ns[stage]; }
+
+  // Return number of input samples processed.
+  std::uint64_t get_total_samples() const { return m_total_samples; }
+
+private:
+  typedef std::chrono::steady_clock clock;
+
+  const std::uint64_t m_window_length;
+  std::uint64_t m_block_samples;
+  std::uint64_t m_total_samples;
+  std::uint64_t m_window_samples;
+  std::uint64_t m_last_window_samples;
+  std::uint64_t m_total_ns[DecoderStage::COUNT];
+  std::uint64_t m_window_ns[DecoderStage::COUNT];
+  std::uint64_t m_last_window_ns[DecoderStage::COUNT];
+  clock::time_point m_mark;
+};
+
+#else
+
+// Profiling disabled: all calls compile to nothing.
+class StageProfiler {
+public:
+  static constexpr bool enabled = false;
+
+  StageProfiler(std::uint64_t = 0) {}
+  void begin_block(std::uint64_t) {}
+  void mark(int) {}
+  void end_block() {}
+  double get_ns_per_sample(int) const { return 0; }
+  double get_window_ns_per_sample(int) const { return 0; }
+  std::uint64_t get_total_ns(int) const { return 0; }
+  std::uint64_t get_total_samples() const { return 0; }
+};
+
+#endif
+
+#endif
@@ -25,7 +25,7 @@
 // For the algorithms, see:
 // https://www.dsprelated.com/showarticle/1052.php
 
-inline float fastatan2(float y, float x) {
+static inline float fastatan2(float y, float x) {
   const float n1 = 0.97239411f;
   const float n2 = -0.19194795f;
   const float pi = (float)(M_PI);
@@ -72,4 +72,25 @@ inline float fastatan2(float y, float x) {
   return result;
 }
 
+// Fast arctan2, branch-free form of fastatan2() with the same approximation.
+// Use this in loops which should be vectorized by the compiler.
+// (static so that kernel variants built for different instruction sets
+// never share an out-of-line copy)
+static inline float fastatan2_nb(float y, float x) {
+  const float n1 = 0.97239411f;
+  const float n2 = -0.19194795f;
+  const float pi = (float)(M_PI);
+  const float pi_2 = pi / 2.0f;
+  const float ax = fabsf(x);
+  const float ay = fabsf(y);
+  const bool swap = ay > ax;
+  const float num = swap ? ax : ay;
+  const float den = swap ? ay : ax;
+  const float z = (den > 0.0f) ? num / den : 0.0f;
+  float a = (n1 + n2 * z * z) * z;
+  a = swap ? pi_2 - a : a;
+  a = (x < 0.0f) ? pi - a : a;
+  return copysignf(a, y);
+}
+
 #endif // INCLUDE_FASTATAN2_H_
@@ -0,0 +1,164 @@
+/*
+ * C API of the SoftFM decoder (libsfmdecoder).
+ *
+ * Embeds the FM broadcast decoder in another process without the RTL-SDR
+ * front end. The caller owns all sample buffers: sfm_decoder_process*()
+ * read IQ samples from the caller's arrays and write PCM samples into the
+ * caller's array. Internal work buffers are allocated by
+ * sfm_decoder_create() for blocks of up to max_block_length samples, so
+ * decoding such blocks does not allocate; a longer block grows them once.
+ *
+ * A decoder handle must not be used by more than one thread at a time.
+ */
+
+#ifndef SOFTFM_SFMDECODER_H
+#define SOFTFM_SFMDECODER_H
+
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define SFM_API __attribute__((visibility("default")))
+#else
+#define SFM_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Version of this API; incremented on incompatible changes. */
+#define SFM_API_VERSION 1
+
+/* Opaque decoder handle. */
+typedef struct sfm_decoder sfm_decoder;
+
+/*
+ * Decoder configuration.
+ * Initialize with sfm_decoder_config_init(), then change fields as needed.
+ * New fields are only ever appended; struct_size tells the library which
+ * fields the caller knows about.
+ */
+typedef struct sfm_decoder_config {
+  uint32_t struct_size;     /* set by sfm_decoder_config_init() */
+  double sample_rate_if;    /* IQ sample rate in Hz */
+  double sample_rate_pcm;   /* audio sample rate in Hz */
+  double tuning_offset;     /* station frequency minus LO frequency in Hz */
+  double deemphasis;        /* de-emphasis time constant in us (0 = off) */
+  double bandwidth_if;      /* half bandwidth of IF signal in Hz */
+  double freq_dev;          /* full scale frequency deviation in Hz */
+  double bandwidth_pcm;     /* half bandwidth of audio signal in Hz */
+  uint32_t downsample;      /* downsampling factor after demodulation */
+  uint32_t max_block_length; /* largest n passed to sfm_decoder_process*()
+                                (0 = allocate on first use) */
+  int pilot_shift;          /* nonzero to shift pilot phase (QMM) */
+  int rds;                  /* nonzero to decode RDS */
+  double ifeq_static_gain;  /* discriminator equalizer static gain */
+  double ifeq_fit_factor;   /* discriminator equalizer fit factor */
+} sfm_decoder_config;
+
+/* Decoder status, filled by sfm_decoder_get_stats(). */
+typedef struct sfm_decoder_stats {
+  uint32_t struct_size;     /* set by the caller to sizeof(sfm_decoder_stats) */
+  int stereo;               /* nonzero if a stereo pilot is locked */
+  double tuning_offset;     /* measured station offset from LO in Hz */
+  double if_level;          /* IF RMS level (full scale 1.0) */
+  double baseband_level;    /* RMS baseband level (nominal 0.707) */
+  double pilot_level;       /* stereo pilot amplitude (nominal 0.1) */
+  double phase_error;       /* stereo pilot phase error */
+  int rds_synced;           /* nonzero if RDS block sync is held */
+  uint16_t rds_pi;          /* RDS programme identification */
+  uint32_t rds_pty;         /* RDS programme type */
+  char rds_ps[9];           /* RDS programme service name (NUL-terminated) */
+  char rds_rt[65];          /* RDS radiotext (NUL-terminated) */
+} sfm_decoder_stats;
+
+/* Return SFM_API_VERSION of the library. */
+SFM_API unsigned int sfm_api_version(void);
+
+/*
+ * Fill cfg with the defaults for the specified sample rates
+ * (broadcast FM, 50 us de-emphasis, downsampling and equalizer as used
+ * by softfm for this IF sample rate, blocks of up to 65536 samples).
+ */
+SFM_API void sfm_decoder_config_init(sfm_decoder_config *cfg,
+                                     double sample_rate_if,
+                                     double sample_rate_pcm);
+
+/*
+ * Create a decoder and allocate its work buffers.
+ * Return NULL on invalid configuration or no memory.
+ */
+SFM_API sfm_decoder *sfm_decoder_create(const sfm_decoder_config *cfg);
+
+/* Destroy a decoder (NULL is ignored). */
+SFM_API void sfm_decoder_destroy(sfm_decoder *dec);
+
+/*
+ * Return the maximum number of PCM samples (left and right counted
+ * separately) which the next call produces from n IQ samples.
+ */
+SFM_API unsigned int sfm_decoder_max_output(const sfm_decoder *dec,
+                                            unsigned int n);
+
+/*
+ * Decode n IQ samples stored as separate I and Q arrays, which is the
+ * cheapest form. Interleaved left/right PCM samples (nominal full scale
+ * +/- 1.0) are written to pcm, which must have room for pcm_capacity
+ * samples. Return the number of PCM samples written, or -1 if
+ * pcm_capacity is less than sfm_decoder_max_output(dec, n) or the work
+ * buffers can not be grown.
+ */
+SFM_API int sfm_decoder_process_planes(sfm_decoder *dec, const float *in_i,
+                                       const float *in_q, unsigned int n,
+                                       double *pcm, unsigned int pcm_capacity);
+
+/*
+ * Same as sfm_decoder_process_planes() for n interleaved IQ pairs
+ * (2 * n floats: I, Q, I, Q, ...).
+ */
+SFM_API int sfm_decoder_process(sfm_decoder *dec, const float *iq,
+                                unsigned int n, double *pcm,
+                                unsigned int pcm_capacity);
+
+/*
+ * Fill stats with the current decoder status.
+ * stats->struct_size must be set by the caller.
+ */
+SFM_API void sfm_decoder_get_stats(const sfm_decoder *dec,
+                                   sfm_decoder_stats *stats);
+
+/*
+ * Change the station offset from the receiver LO (tuning_offset in Hz)
+ * while running; the next sample passed to the decoder is the first one
+ * decoded at the new offset. If new_station is nonzero, the pilot lock,
+ * stereo status and RDS information of the previous station are dropped.
+ * Return 0 on success, or -1 if the offset is outside the IF band or the
+ * decoder fails.
+ */
+SFM_API int sfm_decoder_retune(sfm_decoder *dec, double tuning_offset,
+                               int new_station);
+
+/*
+ * Save the decoder state (filter histories, PLL, lock detector, RDS) as
+ * a binary snapshot. The snapshot is written to buf if capacity is large
+ * enough. Return the snapshot size in bytes (call with capacity 0 to
+ * query the size).
+ */
+SFM_API unsigned long sfm_decoder_save_state(const sfm_decoder *dec,
+                                             void *buf,
+                                             unsigned long capacity);
+
+/*
+ * Restore a snapshot made by sfm_decoder_save_state() of a decoder with
+ * the same configuration; decoding continues without warm-up.
+ * Return 0 on success, or -1 (decoder unchanged) if the snapshot is
+ * invalid or does not match the configuration.
+ */
+SFM_API int sfm_decoder_restore_state(sfm_decoder *dec, const void *buf,
+                                      unsigned long size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -27,15 +27,23 @@
 #include <cstring>
 #include <getopt.h>
 #include <memory>
+#include <mutex>
+#include <sys/select.h>
 #include <sys/time.h>
 #include <thread>
 #include <unistd.h>
 
 #include "AudioOutput.h"
+#include "BandScanner.h"
+#include "BatchDecoder.h"
 #include "DataBuffer.h"
 #include "FmDecode.h"
+#include "IqArchive.h"
+#include "Kernels.h"
+#include "LatencyMonitor.h"
 #include "MovingAverage.h"
 #include "RtlSdrSource.h"
+#include "SpectrumMonitor.h"
 #include "SoftFM.h"
 #include "util.h"
 
@@ -49,31 +57,74 @@ void adjust_gain(SampleVector &samples, double gain) {
   }
 }
 
+// Change of the tuner frequency, requested by the main loop and carried
+// out by the source thread between two blocks.
+struct TunerRetune {
+  std::mutex mutex;
+  bool requested;
+  bool applied;
+  double frequency;           // requested, then actual tuner frequency
+  std::uint64_t sample_index; // first sample after the tuner settled
+
+  TunerRetune()
+      : requested(false), applied(false), frequency(0), sample_index(0) {}
+};
+
 // Read data from source device and put it in a buffer.
 // This code runs in a separate thread.
 // The RTL-SDR library is not capable of buffering large amounts of data.
 // Running this in a background thread ensures that the time between calls
 // to RtlSdrSource::get_samples() is very short.
-void read_source_data(RtlSdrSource *rtlsdr, DataBuffer<IQSample> *buf) {
-  IQSampleVector iqsamples;
+void read_source_data(RtlSdrSource *rtlsdr,
+                      DataBuffer<IQSample, IQBlock> *buf,
+                      TunerRetune *retune) {
+  IQBlock iqsamples;
+  std::uint64_t sample_cnt = 0;
 
   while (!stop_flag.load()) {
 
+    // Retune between blocks. Samples in the settle window may still come
+    // from the old frequency or from the tuner while it locks, so the
+    // change is reported at the first sample after that window.
+    {
+      std::lock_guard<std::mutex> lock(retune->mutex);
+      if (retune->requested) {
+        retune->requested = false;
+        if (!rtlsdr->set_frequency(retune->frequency)) {
+          fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr->error().c_str());
+          exit(1);
+        }
+        retune->frequency = rtlsdr->get_frequency();
+        retune->sample_index = sample_cnt + rtlsdr->settle_samples();
+        retune->applied = true;
+      }
+    }
+
     if (!rtlsdr->get_samples(iqsamples)) {
       fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr->error().c_str());
       exit(1);
     }
+    sample_cnt += iqsamples.size();
 
-    buf->push(move(iqsamples));
+    // Time stamp the block at capture for latency measurement.
+    buf->push(std::move(iqsamples), get_monotonic_time());
   }
 
   buf->push_end();
 }
 
+// Report an audio output error and stop, since the audio is lost
+// (for example when the reader of the output pipe has exited).
+static void stop_on_audio_error(AudioOutput *output) {
+  fprintf(stderr, "\nERROR: AudioOutput: %s, stopping ...\n",
+          output->error().c_str());
+  stop_flag.store(true);
+}
+
 // Get data from output buffer and write to output stream.
 // This code runs in a separate thread.
 void write_output_data(AudioOutput *output, DataBuffer<Sample> *buf,
-                       unsigned int buf_minfill) {
+                       unsigned int buf_minfill, LatencyMonitor *latency) {
   while (!stop_flag.load()) {
 
     if (buf->queued_samples() == 0) {
@@ -90,10 +141,49 @@ void write_output_data(AudioOutput *output, DataBuffer<Sample> *buf,
     }
 
     // Get samples from buffer and write to output.
-    SampleVector samples = buf->pull();
+    double capture_time = 0, queue_time = 0;
+    SampleVector samples = buf->pull(&capture_time, &queue_time);
+    if (samples.empty())
+      continue;
+    latency->record(LatencyMonitor::OUTPUT_QUEUE, queue_time);
+    double write_start = get_monotonic_time();
     output->write(samples);
-    if (!(*output)) {
-      fprintf(stderr, "ERROR: AudioOutput: %s\n", output->error().c_str());
+    double write_end = get_monotonic_time();
+    latency->record(LatencyMonitor::AUDIO_WRITE, write_end - write_start);
+    latency->record(LatencyMonitor::END_TO_END, write_end - capture_time);
+    if (!(*output))
+      stop_on_audio_error(output);
+  }
+}
+
+// Read station frequencies (one per line) from stdin without blocking.
+// Return false at end of input.
+static bool poll_frequencies(std::string &line, std::vector<double> &freqs) {
+  for (;;) {
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    struct timeval tv = {0, 0};
+    if (select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) <= 0)
+      return true;
+
+    char buf[256];
+    ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+    if (n <= 0)
+      return false;
+    for (ssize_t i = 0; i < n; i++) {
+      if (buf[i] != '\n') {
+        line += buf[i];
+        continue;
+      }
+      double f;
+      if (parse_dbl(line.c_str(), f) && f > 0) {
+        freqs.push_back(f);
+      } else if (!line.empty()) {
+        fprintf(stderr, "\nWARNING: ignoring invalid frequency '%s'\n",
+                line.c_str());
+      }
+      line.clear();
     }
   }
 }
@@ -111,10 +201,38 @@ static void handle_sigterm(int sig) {
   size++; // dummy
 }
 
+// Catch Ctrl-C and SIGTERM, and ignore SIGPIPE.
+static void install_signal_handlers() {
+  struct sigaction sigact;
+  sigact.sa_handler = handle_sigterm;
+  sigemptyset(&sigact.sa_mask);
+  sigact.sa_flags = SA_RESETHAND;
+  if (sigaction(SIGINT, &sigact, NULL) < 0) {
+    fprintf(stderr, "WARNING: can not install SIGINT handler (%s)\n",
+            strerror(errno));
+  }
+  if (sigaction(SIGTERM, &sigact, NULL) < 0) {
+    fprintf(stderr, "WARNING: can not install SIGTERM handler (%s)\n",
+            strerror(errno));
+  }
+
+  // A write to a closed pipe fails with EPIPE instead of killing the
+  // process: the spectrum monitor stops, and an audio output error
+  // stops softfm cleanly.
+  sigact.sa_handler = SIG_IGN;
+  sigact.sa_flags = 0;
+  if (sigaction(SIGPIPE, &sigact, NULL) < 0) {
+    fprintf(stderr, "WARNING: can not ignore SIGPIPE (%s)\n",
+            strerror(errno));
+  }
+}
+
+
 void usage() {
   fprintf(
       stderr,
       "Usage: softfm -f freq [options]\n"
+      "       softfm -I path [options]\n"
       "  -f freq       Frequency of radio station in Hz\n"
       "  -d devidx     RTL-SDR device index, 'list' to show device list "
       "(default 0)\n"
@@ -127,11 +245,48 @@ void usage() {
       "  -W filename   Write audio data to .WAV file\n"
       "  -T filename   Write pulse-per-second timestamps\n"
       "                use filename '-' to write to stdout\n"
+      "  -D filename   Decode RDS and write received groups\n"
+      "                use filename '-' to write to stdout\n"
+      "  -l filename   Write latency percentiles per processing hop\n"
+      "                (rewritten every 10 seconds)\n"
       "  -b seconds    Set audio buffer size in seconds\n"
+      "  -B length     Set IQ block length in samples (default 65536)\n"
+      "                use small values (e.g. 1024) for low latency;\n"
+      "                rounded down to a multiple of 256 for RTL-SDR input\n"
       "  -q            Set quiet mode\n"
       "  -X            Shift pilot phase (for Quadrature Multipath Monitor)\n"
       "  -U            Set deemphasis to 75 microseconds (default: 50)\n"
       "  -L            Set if sample rate to 240kHz (default: 960kHz)\n"
+      "  -i ifrate     Set if sample rate in Hz (the tuner accepts\n"
+      "                225001 - 300000 and 900001 - 3200000)\n"
+      "  -K variant    Force kernel variant (generic, sse2, avx2, avx512)\n"
+      "  -F            Show CPU features and kernel variants, then exit\n"
+      "  -I path       Batch mode: decode the IQ files (rtl_sdr format) in\n"
+      "                directory path, or listed one per line in file path,\n"
+      "                to .WAV files; no RTL-SDR device is used\n"
+      "  -J jobs       Number of batch worker threads (default: all cores)\n"
+      "  -o dir        Write batch .WAV files to dir (default: next to\n"
+      "                each input file)\n"
+      "  -t offset     Station offset from the recording center frequency\n"
+      "                in Hz for batch mode (default 0)\n"
+      "  -S filename   Resume from the decoder state saved in filename\n"
+      "                (if it exists) and save the state there on exit\n"
+      "  -C seconds    Batch mode: split each file into chunks of this\n"
+      "                length and decode them in parallel (for long files)\n"
+      "  -N seconds    Scan 76-108 MHz for stations and print them, strongest\n"
+      "                first; check each for a stereo pilot during the\n"
+      "                given time (0 for no check)\n"
+      "  -M filename   Write IF spectrum frames (10 per second) to file or\n"
+      "                named pipe, '-' for stdout; frames are dropped when\n"
+      "                the reader falls behind\n"
+      "  -Z            Automatic frequency control: keep the station\n"
+      "                centred in the IF filter as the tuner drifts\n"
+      "  -c            Read new station frequencies in Hz from stdin (one\n"
+      "                per line) and retune without restarting\n"
+      "  -A filename   Record IQ samples to a seekable IQ archive with\n"
+      "                decoder checkpoints (batch mode reads it with -I)\n"
+      "  -E from[,to]  Batch mode: decode only this span of each file,\n"
+      "                in seconds or [hh:]mm:ss from its start\n"
       "\n");
 }
 
@@ -156,6 +311,25 @@ bool parse_int(const char *s, int &v, bool allow_unit = false) {
   return true;
 }
 
+// Parse a time in seconds or as [hh:]mm:ss[.frac].
+bool parse_time(const char *s, double &v) {
+  v = 0;
+  const char *p = s;
+  for (int field = 0; field < 3; field++) {
+    char *endp;
+    double t = strtod(p, &endp);
+    if (endp == p || t < 0)
+      return false;
+    v = 60 * v + t;
+    if (*endp == '\0')
+      return true;
+    if (*endp != ':')
+      return false;
+    p = endp + 1;
+  }
+  return false;
+}
+
 // Return Unix time stamp in seconds.
 double get_time() {
   struct timeval tv;
@@ -163,6 +337,178 @@ double get_time() {
   return tv.tv_sec + 1.0e-6 * tv.tv_usec;
 }
 
+// Read a decoder state snapshot from a file.
+// Return false if the file does not exist or can not be read.
+static bool read_state_file(const std::string &filename,
+                            std::vector<std::uint8_t> &data) {
+  FILE *f = fopen(filename.c_str(), "rb");
+  if (f == NULL)
+    return false;
+  data.clear();
+  std::uint8_t buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+    data.insert(data.end(), buf, buf + n);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+// Write a decoder state snapshot to a file.
+static bool write_state_file(const std::string &filename,
+                             const std::vector<std::uint8_t> &data) {
+  FILE *f = fopen(filename.c_str(), "wb");
+  if (f == NULL)
+    return false;
+  bool ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+  return (fclose(f) == 0) && ok;
+}
+
+// Decode IQ files listed by path on a pool of worker threads.
+int run_batch(const std::string &path, const std::string &outdir,
+              const BatchDecoder::Config &config, bool quietmode) {
+  std::vector<std::string> files;
+  std::string error;
+  if (!BatchDecoder::list_inputs(path, files, error)) {
+    fprintf(stderr, "ERROR: %s\n", error.c_str());
+    return 1;
+  }
+
+  std::vector<BatchDecoder::Job> jobs(files.size());
+  for (unsigned int i = 0; i < files.size(); i++) {
+    jobs[i].input = files[i];
+    jobs[i].output = BatchDecoder::output_name(files[i], outdir);
+  }
+
+  if (!quietmode) {
+    fprintf(stderr, "batch input:       %u files\n", (unsigned int)jobs.size());
+    fprintf(stderr, "IF sample rate:    %.0f Hz\n", config.sample_rate_if);
+    fprintf(stderr, "audio sample rate: %.0f Hz\n", config.sample_rate_pcm);
+    fprintf(stderr, "worker threads:    %u\n", config.num_workers);
+    if (config.chunk_seconds > 0) {
+      fprintf(stderr, "chunk length:      %.1f s (%.1f s overlap)\n",
+              config.chunk_seconds, config.chunk_overlap);
+    }
+    fprintf(stderr, "kernel variant:    %s\n", kernels().name);
+  }
+
+  double start = get_monotonic_time();
+  BatchDecoder batch(config);
+  std::vector<BatchDecoder::Result> results = batch.run(
+      jobs, &stop_flag,
+      [quietmode, &config](const BatchDecoder::Job &job,
+                           const BatchDecoder::Result &r) {
+        if (r.checkpoints_rejected > 0) {
+          fprintf(stderr,
+                  "WARNING: %s: %u checkpoints do not match the decoder "
+                  "settings, decoding from an earlier sample instead\n",
+                  job.input.c_str(), r.checkpoints_rejected);
+        }
+        if (!r.ok) {
+          fprintf(stderr, "ERROR: %s: %s\n", job.input.c_str(),
+                  r.error.c_str());
+        } else if (!quietmode) {
+          double secs = r.audio_samples / config.sample_rate_pcm;
+          fprintf(stderr, "[%2u] %s -> %s (%.1f s audio, %.1fx real time)\n",
+                  r.worker, job.input.c_str(), job.output.c_str(), secs,
+                  secs / std::max(r.seconds, 1.0e-9));
+        }
+      });
+  double elapsed = get_monotonic_time() - start;
+
+  // Aggregate throughput.
+  std::uint64_t iq_samples = 0;
+  std::uint64_t audio_samples = 0;
+  unsigned int nfail = 0;
+  for (const BatchDecoder::Result &r : results) {
+    iq_samples += r.iq_samples;
+    audio_samples += r.audio_samples;
+    if (!r.ok)
+      nfail++;
+  }
+  double audio_secs = audio_samples / config.sample_rate_pcm;
+  elapsed = std::max(elapsed, 1.0e-9);
+  fprintf(stderr,
+          "batch: %u files, %u failed, %.1f s audio in %.1f s "
+          "(%.1fx real time, %.1f MS/s)\n",
+          (unsigned int)results.size(), nfail, audio_secs, elapsed,
+          audio_secs / elapsed, iq_samples / elapsed * 1.0e-6);
+
+  return (nfail > 0) ? 1 : 0;
+}
+
+// Scan the FM band with an RTL-SDR device and print the stations found.
+int run_scan(int devidx, int lnagain, bool agcmode, double pilot_seconds,
+             bool quietmode) {
+  BandScanner::Config config = BandScanner::default_config();
+  config.pilot_seconds = pilot_seconds;
+
+  RtlSdrSource rtlsdr(devidx);
+  const int block_length = 16384;
+  rtlsdr.configure(config.sample_rate, config.freq_min, lnagain, block_length,
+                   agcmode);
+  if (!rtlsdr) {
+    fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+    return 1;
+  }
+
+  // Tune, then drop the samples captured while the tuner settles
+  // (about 20 ms).
+  const unsigned int settle_samples = lrint(0.02 * config.sample_rate);
+  IQSampleVector block;
+  BandScanner::Capture capture = [&](double center, unsigned int n,
+                                     IQSampleVector &samples) {
+    if (!rtlsdr.set_frequency(lrint(center)))
+      return false;
+    for (unsigned int k = 0; k < settle_samples; k += block.size()) {
+      if (!rtlsdr.get_samples(block))
+        return false;
+    }
+    samples.clear();
+    while (samples.size() < n) {
+      if (!rtlsdr.get_samples(block))
+        return false;
+      samples.insert(samples.end(), block.begin(), block.end());
+    }
+    samples.resize(n);
+    return true;
+  };
+
+  if (!quietmode) {
+    fprintf(stderr, "scanning %.1f - %.1f MHz at %.1f MS/s\n",
+            config.freq_min * 1.0e-6, config.freq_max * 1.0e-6,
+            config.sample_rate * 1.0e-6);
+  }
+
+  double start = get_monotonic_time();
+  BandScanner scanner(config);
+  std::vector<BandScanner::Station> stations;
+  if (!scanner.scan(capture, stations)) {
+    fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
+    return 1;
+  }
+
+  if (!quietmode) {
+    fprintf(stderr,
+            "%u steps in %.1f s, noise floor %.1f dB, %u stations found\n",
+            scanner.get_step_count(), get_monotonic_time() - start,
+            scanner.get_noise_floor(), (unsigned int)stations.size());
+  }
+
+  printf("#rank  freq_MHz  power_dB  snr_dB  stereo  pilot\n");
+  for (unsigned int i = 0; i < stations.size(); i++) {
+    const BandScanner::Station &s = stations[i];
+    printf("%5u %9.1f %9.1f %7.1f", i + 1, s.frequency * 1.0e-6, s.power,
+           s.snr);
+    if (s.pilot_checked)
+      printf("  %6s  %5.3f\n", s.stereo ? "yes" : "no", s.pilot_level);
+    else
+      printf("  %6s  %5s\n", "-", "-");
+  }
+
+  return 0;
+}
+
 int main(int argc, char **argv) {
   double freq = -1;
   int devidx = 0;
@@ -176,14 +522,34 @@ int main(int argc, char **argv) {
   std::string filename;
   std::string ppsfilename;
   FILE *ppsfile = NULL;
+  std::string rdsfilename;
+  FILE *rdsfile = NULL;
+  std::string latencyfilename;
+  std::string statefilename;
+  std::string archivefilename;
+  bool retune_stdin = false;
+  double scan_pilot_seconds = -1;
+  std::string spectrumfilename;
+  bool afc = false;
   double bufsecs = -1;
+  int block_length = RtlSdrSource::default_block_length;
   bool pilot_shift = false;
   double if_level_max = 0;
   double if_level_min = 10;
   bool deemphasis_na = false;
   bool low_iffreq = false;
+  int ifrate_opt = 0;
   double ifeq_static_gain = 1.0;
   double ifeq_fit_factor = 0.0;
+  std::string kernelname;
+  bool show_cpu_features = false;
+  std::string batchpath;
+  std::string batchoutdir;
+  int batchjobs = 0;
+  double batchoffset = 0;
+  double batchchunk = 0;
+  double span_begin = 0;
+  double span_end = 0;
 
   fprintf(stderr, "softfm-jj1bdx Version 0.2.3, final\n");
   fprintf(stderr,
@@ -197,10 +563,27 @@ int main(int argc, char **argv) {
       {"pps", 1, NULL, 'T'},   {"buffer", 1, NULL, 'b'},
       {"quiet", 1, NULL, 'q'}, {"pilotshift", 0, NULL, 'X'},
       {"usa", 0, NULL, 'U'},   {"lowif", 0, NULL, 'L'},
+      {"ifrate", 1, NULL, 'i'},
+      {"rds", 1, NULL, 'D'},   {"latency", 1, NULL, 'l'},
+      {"block-length", 1, NULL, 'B'},
+      {"kernel", 1, NULL, 'K'},
+      {"cpu-features", 0, NULL, 'F'},
+      {"batch", 1, NULL, 'I'},
+      {"jobs", 1, NULL, 'J'},
+      {"outdir", 1, NULL, 'o'},
+      {"offset", 1, NULL, 't'},
+      {"chunk", 1, NULL, 'C'},
+      {"state", 1, NULL, 'S'},
+      {"archive", 1, NULL, 'A'},
+      {"span", 1, NULL, 'E'},
+      {"retune", 0, NULL, 'c'},
+      {"scan", 1, NULL, 'N'},
+      {"spectrum", 1, NULL, 'M'},
+      {"afc", 0, NULL, 'Z'},
       {NULL, 0, NULL, 0}};
 
   int c, longindex;
-  while ((c = getopt_long(argc, argv, "f:d:g:r:R:W:P::T:b:aqXUL", longopts,
+  while ((c = getopt_long(argc, argv, "f:d:g:r:R:W:P::T:D:l:b:B:K:I:J:o:t:C:S:A:E:N:M:i:aqXULFcZ", longopts,
                           &longindex)) >= 0) {
     switch (c) {
     case 'f':
@@ -245,11 +628,23 @@ int main(int argc, char **argv) {
     case 'T':
       ppsfilename = optarg;
       break;
+    case 'D':
+      rdsfilename = optarg;
+      break;
+    case 'l':
+      latencyfilename = optarg;
+      break;
     case 'b':
       if (!parse_dbl(optarg, bufsecs) || bufsecs < 0) {
         badarg("-b");
       }
       break;
+    case 'B':
+      if (!parse_int(optarg, block_length, true) ||
+          block_length < RtlSdrSource::min_block_length) {
+        badarg("-B");
+      }
+      break;
     case 'a':
       agcmode = true;
       break;
@@ -265,6 +660,69 @@ int main(int argc, char **argv) {
     case 'L':
       low_iffreq = true;
       break;
+    case 'i':
+      if (!parse_int(optarg, ifrate_opt, true) || ifrate_opt < 1) {
+        badarg("-i");
+      }
+      break;
+    case 'K':
+      kernelname = optarg;
+      break;
+    case 'F':
+      show_cpu_features = true;
+      break;
+    case 'I':
+      batchpath = optarg;
+      break;
+    case 'J':
+      if (!parse_int(optarg, batchjobs) || batchjobs < 1) {
+        badarg("-J");
+      }
+      break;
+    case 'o':
+      batchoutdir = optarg;
+      break;
+    case 't':
+      if (!parse_dbl(optarg, batchoffset)) {
+        badarg("-t");
+      }
+      break;
+    case 'S':
+      statefilename = optarg;
+      break;
+    case 'C':
+      if (!parse_dbl(optarg, batchchunk) || batchchunk <= 0) {
+        badarg("-C");
+      }
+      break;
+    case 'A':
+      archivefilename = optarg;
+      break;
+    case 'c':
+      retune_stdin = true;
+      break;
+    case 'Z':
+      afc = true;
+      break;
+    case 'M':
+      spectrumfilename = optarg;
+      break;
+    case 'N':
+      if (!parse_dbl(optarg, scan_pilot_seconds) || scan_pilot_seconds < 0) {
+        badarg("-N");
+      }
+      break;
+    case 'E': {
+      std::string arg(optarg);
+      std::string::size_type comma = arg.find(',');
+      if (!parse_time(arg.substr(0, comma).c_str(), span_begin) ||
+          (comma != std::string::npos &&
+           (!parse_time(arg.substr(comma + 1).c_str(), span_end) ||
+            span_end <= span_begin))) {
+        badarg("-E");
+      }
+      break;
+    }
     default:
       usage();
       fprintf(stderr, "ERROR: Invalid command line options\n");
@@ -278,6 +736,61 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  // Select kernel variant.
+  if (!kernelname.empty() && !force_kernels(kernelname)) {
+    fprintf(stderr, "ERROR: kernel variant '%s' unknown or not supported "
+                    "by this CPU\n",
+            kernelname.c_str());
+    exit(1);
+  }
+
+  if (show_cpu_features) {
+    fprintf(stderr, "CPU features:      %s\n", cpu_features().c_str());
+    fprintf(stderr, "kernel variants:  ");
+    for (const KernelTable *k : all_kernels()) {
+      fprintf(stderr, " %s%s", k->name, kernels_supported(*k) ? "" : "(n/a)");
+    }
+    fprintf(stderr, "\n");
+    fprintf(stderr, "selected kernels:  %s\n", kernels().name);
+    exit(0);
+  }
+
+  if (ifrate_opt > 0) {
+    ifrate = ifrate_opt;
+  } else if (low_iffreq) {
+    ifrate = 240000;
+  } else {
+    ifrate = 960000;
+  }
+
+  if (!batchpath.empty()) {
+    // Decode IQ files instead of a live device.
+    DiscriminatorEqualizer::get_parameters(ifrate, ifeq_static_gain,
+                                           ifeq_fit_factor);
+    BatchDecoder::Config config;
+    config.sample_rate_if = ifrate;
+    config.ifeq_static_gain = ifeq_static_gain;
+    config.ifeq_fit_factor = ifeq_fit_factor;
+    config.tuning_offset = batchoffset;
+    config.station_freq = (freq > 0) ? freq : 0;
+    config.sample_rate_pcm = pcmrate;
+    config.deemphasis = deemphasis_na ? 75.0 : 50.0;
+    config.bandwidth_pcm =
+        std::min(FmDecoder::default_bandwidth_pcm, 0.45 * pcmrate);
+    config.downsample = FmDecoder::plan_rates(ifrate, pcmrate).downsample;
+    config.pilot_shift = pilot_shift;
+    config.block_length = block_length;
+    config.num_workers = (batchjobs > 0)
+                             ? batchjobs
+                             : std::max(1u, std::thread::hardware_concurrency());
+    config.chunk_seconds = batchchunk;
+    config.chunk_overlap = BatchDecoder::default_chunk_overlap;
+    config.span_begin = span_begin;
+    config.span_end = span_end;
+    install_signal_handlers();
+    return run_batch(batchpath, batchoutdir, config, quietmode);
+  }
+
   std::vector<std::string> devnames = RtlSdrSource::get_device_names();
   if (devidx < 0 || (unsigned int)devidx >= devnames.size()) {
     if (devidx != -1) {
@@ -295,35 +808,23 @@ int main(int argc, char **argv) {
     fprintf(stderr, "using device %d: %s\n", devidx, devnames[devidx].c_str());
   }
 
+  if (scan_pilot_seconds >= 0) {
+    return run_scan(devidx, lnagain, agcmode, scan_pilot_seconds, quietmode);
+  }
+
   if (freq <= 0) {
     usage();
     fprintf(stderr, "ERROR: Specify a tuning frequency\n");
     exit(1);
   }
 
-  if (low_iffreq) {
-    ifrate = 240000;
-    ifeq_static_gain = 1.47112063;
-    ifeq_fit_factor = 0.48567701;
-  } else {
-    ifrate = 960000;
-    ifeq_static_gain = 1.3412962;
-    ifeq_fit_factor = 0.34135089;
+  if (retune_stdin && !archivefilename.empty()) {
+    fprintf(stderr, "ERROR: -c can not be combined with -A\n");
+    exit(1);
   }
 
   // Catch Ctrl-C and SIGTERM
-  struct sigaction sigact;
-  sigact.sa_handler = handle_sigterm;
-  sigemptyset(&sigact.sa_mask);
-  sigact.sa_flags = SA_RESETHAND;
-  if (sigaction(SIGINT, &sigact, NULL) < 0) {
-    fprintf(stderr, "WARNING: can not install SIGINT handler (%s)\n",
-            strerror(errno));
-  }
-  if (sigaction(SIGTERM, &sigact, NULL) < 0) {
-    fprintf(stderr, "WARNING: can not install SIGTERM handler (%s)\n",
-            strerror(errno));
-  }
+  install_signal_handlers();
 
   // Intentionally tune at a higher frequency to avoid DC offset.
   double tuner_freq = freq + 0.2 * ifrate;
@@ -353,13 +854,15 @@ int main(int argc, char **argv) {
   }
 
   // Configure RTL-SDR device and start streaming.
-  rtlsdr.configure(ifrate, tuner_freq, lnagain,
-                   RtlSdrSource::default_block_length, agcmode);
+  rtlsdr.configure(ifrate, tuner_freq, lnagain, block_length, agcmode);
   if (!rtlsdr) {
     fprintf(stderr, "ERROR: RtlSdr: %s\n", rtlsdr.error().c_str());
     exit(1);
   }
 
+  // The device rounds the block length to whole USB transfers.
+  block_length = rtlsdr.get_block_length();
+
   tuner_freq = rtlsdr.get_frequency();
   ifrate = rtlsdr.get_sample_rate();
 
@@ -375,22 +878,30 @@ int main(int argc, char **argv) {
     fprintf(stderr, "IF sample rate:    %.0f Hz\n", ifrate);
     fprintf(stderr, "RTL AGC mode:      %s\n",
             agcmode ? "enabled" : "disabled");
+    fprintf(stderr, "IQ block length:   %d samples (%.2f ms)\n", block_length,
+            block_length * 1.0e3 / ifrate);
+    fprintf(stderr, "kernel variant:    %s\n", kernels().name);
   }
 
   double delta_if = tuner_freq - freq;
   MovingAverage<float> ppm_average(40, 0.0f);
 
   // Create source data queue.
-  DataBuffer<IQSample> source_buffer;
+  DataBuffer<IQSample, IQBlock> source_buffer;
 
   // Start reading from device in separate thread.
-  std::thread source_thread(read_source_data, &rtlsdr, &source_buffer);
+  TunerRetune tuner_retune;
+  std::thread source_thread(read_source_data, &rtlsdr, &source_buffer,
+                            &tuner_retune);
 
+  // Choose the downsampling factors for the actual IF sample rate.
   // We can downsample to the (default_bandwidth_if * 2) * 1.1
   // without loss of information.
   // This will speed up later processing stages.
-  double downsample_target = FmDecoder::default_bandwidth_if * 2.2;
-  unsigned int downsample = std::max(1, int(ifrate / downsample_target));
+  FmDecoder::RatePlan plan = FmDecoder::plan_rates(ifrate, pcmrate);
+  unsigned int downsample = plan.downsample;
+  DiscriminatorEqualizer::get_parameters(ifrate, ifeq_static_gain,
+                                         ifeq_fit_factor);
 
   // Prevent aliasing at very low output sample rates.
   double default_bandwidth_pcm = FmDecoder::default_bandwidth_pcm;
@@ -399,6 +910,11 @@ int main(int argc, char **argv) {
 
   if (!quietmode) {
     fprintf(stderr, "if -> baseband:    %u (downsampled by)\n", downsample);
+    fprintf(stderr, "baseband -> audio: %u/%u (resampled by)%s\n",
+            plan.interpolation, plan.decimation,
+            plan.exact ? "" : " (approximate)");
+    fprintf(stderr, "decoder cost:      ~%.0f MAC per audio frame\n",
+            plan.cost);
     fprintf(stderr, "audio sample rate: %u Hz\n", pcmrate);
     fprintf(stderr, "audio bandwidth:   %.3f kHz\n", bandwidth_pcm * 1.0e-3);
     fprintf(stderr, "deemphasis:        %.1f microseconds\n", deemphasis);
@@ -415,7 +931,66 @@ int main(int argc, char **argv) {
                FmDecoder::default_freq_dev,     // freq_dev
                bandwidth_pcm,                   // bandwidth_pcm
                downsample,                      // downsample
-               pilot_shift);                    // pilot_shift
+               pilot_shift,                     // pilot_shift
+               !rdsfilename.empty(),            // rds
+               afc);                            // afc
+  fm.reserve(block_length);
+
+  // Resume from a saved decoder state.
+  bool state_restored = false;
+  if (!statefilename.empty()) {
+    std::vector<std::uint8_t> state;
+    if (read_state_file(statefilename, state)) {
+      state_restored = fm.restore_state(state.data(), state.size());
+      if (!state_restored) {
+        fprintf(stderr, "WARNING: ignoring decoder state in '%s' (invalid or "
+                        "different settings)\n",
+                statefilename.c_str());
+      } else if (!quietmode) {
+        fprintf(stderr, "decoder state restored from '%s'\n",
+                statefilename.c_str());
+      }
+    }
+  }
+
+  // Open IQ archive.
+  std::unique_ptr<IqArchiveWriter> archive;
+  if (!archivefilename.empty()) {
+    IqArchive::Info info;
+    info.sample_rate = ifrate;
+    info.frequency = tuner_freq;
+    info.station = freq;
+    info.gain = (lnagain == INT_MIN) ? INT32_MIN : rtlsdr.get_tuner_gain();
+    info.decoder_flags = (fm.rds_enabled() ? IqArchive::decoder_rds : 0) |
+                         (afc ? IqArchive::decoder_afc : 0);
+    info.start_time = get_time();
+    archive.reset(new IqArchiveWriter(
+        archivefilename, info,
+        llrint(IqArchiveWriter::default_chunk_seconds * ifrate)));
+    if (!(*archive)) {
+      fprintf(stderr, "ERROR: IQ archive: %s\n", archive->error().c_str());
+      exit(1);
+    }
+    if (!quietmode) {
+      fprintf(stderr, "recording IQ archive to '%s'\n",
+              archivefilename.c_str());
+    }
+  }
+
+  // Start spectrum monitor.
+  std::unique_ptr<SpectrumMonitor> spectrum;
+  if (!spectrumfilename.empty()) {
+    spectrum.reset(new SpectrumMonitor(spectrumfilename, ifrate));
+    if (!(*spectrum)) {
+      fprintf(stderr, "ERROR: spectrum monitor: %s\n",
+              spectrum->error().c_str());
+      exit(1);
+    }
+    if (!quietmode) {
+      fprintf(stderr, "writing IF spectrum to '%s'\n",
+              spectrumfilename.c_str());
+    }
+  }
 
   // Calculate number of samples in audio buffer.
   unsigned int outputbuf_samples = 0;
@@ -454,6 +1029,29 @@ int main(int argc, char **argv) {
     fflush(ppsfile);
   }
 
+  // Open RDS file.
+  if (!rdsfilename.empty()) {
+    if (rdsfilename == "-") {
+      if (!quietmode) {
+        fprintf(stderr, "writing RDS groups to stdout\n");
+      }
+      rdsfile = stdout;
+    } else {
+      if (!quietmode) {
+        fprintf(stderr, "writing RDS groups to '%s'\n", rdsfilename.c_str());
+      }
+      rdsfile = fopen(rdsfilename.c_str(), "w");
+      if (rdsfile == NULL) {
+        fprintf(stderr, "ERROR: can not open '%s' (%s)\n", rdsfilename.c_str(),
+                strerror(errno));
+        exit(1);
+      }
+    }
+    fprintf(rdsfile, "#  sample_index   pi group pty    unix_time block_a "
+                     "block_b block_c block_d ps         rt\n");
+    fflush(rdsfile);
+  }
+
   // Prepare output writer.
   std::unique_ptr<AudioOutput> audio_output;
   switch (outmode) {
@@ -477,19 +1075,34 @@ int main(int argc, char **argv) {
     exit(1);
   }
 
+  // Latency statistics from USB read to audio write.
+  LatencyMonitor latency;
+  double latency_dump_time = get_time();
+
   // If buffering enabled, start background output thread.
   DataBuffer<Sample> output_buffer;
   std::thread output_thread;
   if (outputbuf_samples > 0) {
     const unsigned int nchannel = 2;
-    output_thread = std::thread(write_output_data, audio_output.get(),
-                                &output_buffer, outputbuf_samples * nchannel);
+    output_thread =
+        std::thread(write_output_data, audio_output.get(), &output_buffer,
+                    outputbuf_samples * nchannel, &latency);
   }
 
   SampleVector audiosamples;
   bool inbuf_length_warning = false;
+  std::string retune_line;
+  std::vector<double> retune_freqs;
+  double retune_station = freq;
   bool got_stereo = false;
 
+  // Statistics are updated once per default_block_length IQ samples,
+  // independent of the block length in use.
+  const std::uint64_t stat_interval = RtlSdrSource::default_block_length;
+  std::uint64_t iq_sample_cnt = 0;
+  std::uint64_t stat_sample_cnt = 0;
+  unsigned int stat_cnt = 0;
+
   double block_time = get_time();
 
   // Main loop.
@@ -502,23 +1115,98 @@ int main(int argc, char **argv) {
     }
 
     // Pull next block from source buffer.
-    IQSampleVector iqsamples = source_buffer.pull();
+    double capture_time = 0, queue_time = 0;
+    IQBlock iqsamples = source_buffer.pull(&capture_time, &queue_time);
     if (iqsamples.empty())
       break;
+    latency.record(LatencyMonitor::SOURCE_QUEUE, queue_time);
 
     double prev_block_time = block_time;
     block_time = get_time();
 
+    // Retune to new stations read from stdin. A station within the IF
+    // band, clear of the DC offset, only needs a new decoder offset;
+    // otherwise the source thread retunes the tuner between two blocks.
+    if (retune_stdin) {
+      retune_stdin = poll_frequencies(retune_line, retune_freqs);
+      for (double f : retune_freqs) {
+        double offset = fabs(f - tuner_freq);
+        if (offset >= FmDecoder::default_bandwidth_if &&
+            offset <= 0.5 * ifrate - FmDecoder::default_bandwidth_if) {
+          freq = f;
+          delta_if = tuner_freq - freq;
+          std::uint64_t idx = fm.retune(freq - tuner_freq, true);
+          if (!quietmode) {
+            fprintf(stderr, "\nretuned to %.6f MHz at sample %s\n",
+                    freq * 1.0e-6, std::to_string(idx).c_str());
+          }
+        } else {
+          std::lock_guard<std::mutex> lock(tuner_retune.mutex);
+          tuner_retune.requested = true;
+          tuner_retune.frequency = f + 0.2 * ifrate;
+          retune_station = f;
+        }
+      }
+      retune_freqs.clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(tuner_retune.mutex);
+      if (tuner_retune.applied &&
+          tuner_retune.sample_index <= iq_sample_cnt) {
+        tuner_retune.applied = false;
+        tuner_freq = tuner_retune.frequency;
+        freq = retune_station;
+        delta_if = tuner_freq - freq;
+        std::uint64_t idx = fm.retune(freq - tuner_freq, true);
+        if (!quietmode) {
+          fprintf(stderr,
+                  "\nretuned to %.6f MHz (device tuned for %.6f MHz) at "
+                  "sample %s\n",
+                  freq * 1.0e-6, tuner_freq * 1.0e-6,
+                  std::to_string(idx).c_str());
+        }
+      }
+    }
+
+    // Record IQ samples; a new archive chunk gets a checkpoint of the
+    // decoder state before this block.
+    if (archive && !archive->write(iqsamples, &fm)) {
+      fprintf(stderr, "\nWARNING: IQ archive: %s (recording stopped)\n",
+              archive->error().c_str());
+      archive.reset();
+    }
+
+    // Pass samples to the spectrum monitor (only copies a few blocks
+    // per second and never waits).
+    if (spectrum) {
+      double unix_capture_time =
+          block_time - (get_monotonic_time() - capture_time);
+      spectrum->offer(iqsamples, iq_sample_cnt, unix_capture_time,
+                      tuner_freq);
+    }
+
     // Decode FM signal.
+    double decode_start = get_monotonic_time();
     fm.process(iqsamples, audiosamples);
+    latency.record(LatencyMonitor::DECODE,
+                   get_monotonic_time() - decode_start);
 
     // Set nominal audio volume.
     adjust_gain(audiosamples, 0.5);
 
-    // The minus factor is to show the ppm correction to make and not the one
-    // made
-    ppm_average.feed(((fm.get_tuning_offset() + delta_if) / tuner_freq) *
-                     -1.0e6);
+    std::uint64_t prev_iq_sample_cnt = iq_sample_cnt;
+    iq_sample_cnt += iqsamples.size();
+    stat_sample_cnt += iqsamples.size();
+    bool stat_update = (stat_sample_cnt >= stat_interval);
+    if (stat_update) {
+      stat_sample_cnt = 0;
+      stat_cnt++;
+
+      // The minus factor is to show the ppm correction to make and not the
+      // one made
+      ppm_average.feed(((fm.get_tuning_offset() + delta_if) / tuner_freq) *
+                       -1.0e6);
+    }
 
     // Write PPS markers.
     if (ppsfile != NULL) {
@@ -532,45 +1220,95 @@ int main(int argc, char **argv) {
       }
     }
 
-    // Throw away first block. It is noisy because IF filters
-    // are still starting up.
-    if (block > 0) {
+    // Write RDS groups.
+    if (rdsfile != NULL) {
+      const RdsDecoder &rds = fm.get_rds();
+      for (const RdsDecoder::Group &g : rds.get_groups()) {
+        fprintf(rdsfile,
+                "%15s %04X %4u%c %3u %12.6f    %04X    %04X    %04X    %04X "
+                "\"%s\" \"%s\"\n",
+                std::to_string(g.sample_index).c_str(), g.pi, g.group_type,
+                g.version_b ? 'B' : 'A', g.pty, block_time, g.blocks[0],
+                g.blocks[1], g.blocks[2], g.blocks[3], rds.get_ps().c_str(),
+                rds.get_rt().c_str());
+      }
+      fflush(rdsfile);
+    }
+
+    // Throw away the first default_block_length samples. They are noisy
+    // because IF filters are still starting up (unless the decoder state
+    // was restored).
+    if (state_restored || prev_iq_sample_cnt >= stat_interval) {
       if (outputbuf_samples > 0) {
         // Buffered write.
-        output_buffer.push(move(audiosamples));
+        output_buffer.push(move(audiosamples), capture_time);
       } else {
         // Direct write.
+        double write_start = get_monotonic_time();
         audio_output->write(audiosamples);
+        double write_end = get_monotonic_time();
+        latency.record(LatencyMonitor::AUDIO_WRITE, write_end - write_start);
+        latency.record(LatencyMonitor::END_TO_END, write_end - capture_time);
+        if (!(*audio_output))
+          stop_on_audio_error(audio_output.get());
       }
     }
 
+    // Update latency statistics file.
+    if (!latencyfilename.empty() && block_time - latency_dump_time >= 10.0) {
+      latency_dump_time = block_time;
+      if (!latency.dump_file(latencyfilename)) {
+        fprintf(stderr, "\nWARNING: can not write '%s'\n",
+                latencyfilename.c_str());
+      }
+    }
+
+    // Stop the spectrum monitor after a write error.
+    if (spectrum && stat_update && !(*spectrum)) {
+      fprintf(stderr, "\nWARNING: spectrum monitor: %s (stopped)\n",
+              spectrum->error().c_str());
+      spectrum.reset();
+    }
+
     // Show statistics.
-    if (!quietmode) {
+    if (!quietmode && stat_update) {
 
-      // Estimate D/U ratio, skip first 10 blocks.
+      // Estimate D/U ratio from the spread of the IF level between
+      // intervals, skip first 10 intervals. This uses the RMS level of a
+      // block: its peak level would grow with the block length.
       double if_level = fm.get_if_level();
       double du_ratio = 2;
       if_level_max = std::max(if_level_max, if_level);
       if_level_min = std::min(if_level_min, if_level);
-      if (block > 10) {
+      if (stat_cnt > 10) {
         double ratio = if_level_max / if_level_min;
         du_ratio = (ratio + 1) / (ratio - 1);
       }
 
       fprintf(stderr,
-              "\rblk=%6d:f=%8.4fMHz:ppm=%+6.2f:IF=%+6.2fdBpp:"
+              "\rblk=%6d:f=%8.4fMHz:ppm=%+6.2f:IF=%+6.2fdB:"
               "DU=%6.2fdB:BB=%+5.1fdB",
               block, (tuner_freq + fm.get_tuning_offset()) * 1.0e-6,
               ppm_average.average(), 20 * log10(if_level), 20 * log10(du_ratio),
               20 * log10(fm.get_baseband_level()) + 3.01);
+      if (afc) {
+        fprintf(stderr, ":afc=%+5.1fkHz", fm.get_afc_offset() * 1.0e-3);
+      }
+      const LatencyHistogram &lat = latency.get(LatencyMonitor::END_TO_END);
+      if (lat.count() > 0) {
+        fprintf(stderr, ":lat=%.0f/%.0f/%.0fms", lat.percentile(0.50) * 1.0e3,
+                lat.percentile(0.99) * 1.0e3, lat.max() * 1.0e3);
+      }
       if (outputbuf_samples > 0) {
         const unsigned int nchannel = 2;
         size_t buflen = output_buffer.queued_samples();
         fprintf(stderr, ":buf=%.1fs ", buflen / nchannel / double(pcmrate));
       }
       fflush(stderr);
+    }
 
-      // Show stereo status.
+    // Show stereo status.
+    if (!quietmode) {
       if (fm.stereo_detected() != got_stereo) {
         got_stereo = fm.stereo_detected();
         if (got_stereo) {
@@ -583,6 +1321,21 @@ int main(int argc, char **argv) {
     }
   }
 
+  // Show per-stage processing time.
+  if (StageProfiler::enabled && !quietmode) {
+    const StageProfiler &prof = fm.get_profiler();
+    double total = 0;
+    fprintf(stderr, "\nprocessing time per IF sample:\n");
+    for (int i = 0; i < DecoderStage::COUNT; i++) {
+      double ns = prof.get_ns_per_sample(i);
+      total += ns;
+      fprintf(stderr, "  %-16s %8.3f ns (last window %8.3f ns)\n",
+              DecoderStage::name(i), ns, prof.get_window_ns_per_sample(i));
+    }
+    fprintf(stderr, "  %-16s %8.3f ns (%.1f%% of real time)\n", "total", total,
+            total * ifrate * 1.0e-7);
+  }
+
   // Join background threads.
   source_thread.join();
   if (outputbuf_samples > 0) {
@@ -590,6 +1343,33 @@ int main(int argc, char **argv) {
     output_thread.join();
   }
 
+  // Write final latency statistics.
+  if (!latencyfilename.empty() && !latency.dump_file(latencyfilename)) {
+    fprintf(stderr, "WARNING: can not write '%s'\n", latencyfilename.c_str());
+  }
+
+  // Stop the spectrum monitor.
+  if (spectrum && !quietmode) {
+    fprintf(stderr, "spectrum frames: %s written, %s dropped\n",
+            std::to_string(spectrum->get_frame_count()).c_str(),
+            std::to_string(spectrum->get_drop_count()).c_str());
+  }
+  spectrum.reset();
+
+  // Write the IQ archive index.
+  if (archive && !archive->close()) {
+    fprintf(stderr, "WARNING: IQ archive: %s\n", archive->error().c_str());
+  }
+
+  // Save decoder state for the next run.
+  if (!statefilename.empty()) {
+    std::vector<std::uint8_t> state;
+    fm.save_state(state);
+    if (!write_state_file(statefilename, state)) {
+      fprintf(stderr, "WARNING: can not write '%s'\n", statefilename.c_str());
+    }
+  }
+
   // No cleanup needed; everything handled by destructors.
 
   return 0;
@@ -32,6 +32,7 @@ extern "C" {
 }
 
 #include "AudioOutput.h"
+#include "Kernels.h"
 #include "SoftFM.h"
 
 // class AudioOutput
@@ -40,19 +41,7 @@ extern "C" {
 void AudioOutput::samplesToInt16(const SampleVector &samples,
                                  std::vector<uint8_t> &bytes) {
   bytes.resize(2 * samples.size());
-
-  SampleVector::const_iterator i = samples.begin();
-  SampleVector::const_iterator n = samples.end();
-  std::vector<uint8_t>::iterator k = bytes.begin();
-
-  while (i != n) {
-    Sample s = *(i++);
-    s = std::max(Sample(-1.0), std::min(Sample(1.0), s));
-    long v = lrint(s * 32767);
-    unsigned long u = v;
-    *(k++) = u & 0xff;
-    *(k++) = (u >> 8) & 0xff;
-  }
+  kernels().pcm_s16le(samples.data(), bytes.data(), samples.size());
 }
 
 // class RawAudioOutput
@@ -113,10 +102,18 @@ bool RawAudioOutput::write(const SampleVector &samples) {
 
 // class WavAudioOutput
 
+// Size of the header in front of the audio data.
+static const std::uint64_t wav_header_size = 44;
+
+// Largest audio data size which the 32-bit RIFF sizes can describe,
+// in whole stereo 16-bit frames.
+static const std::uint64_t wav_max_data_size = (0xffffffffu - 36) & ~3u;
+
 // Construct .WAV writer.
 WavAudioOutput::WavAudioOutput(const std::string &filename,
                                unsigned int samplerate)
-    : numberOfChannels(2), sampleRate(samplerate) {
+    : numberOfChannels(2), sampleRate(samplerate), m_data_size(0),
+      m_data_end(0), m_size_error(false) {
   m_stream = fopen(filename.c_str(), "wb");
   if (m_stream == NULL) {
     m_error = "can not open '" + filename + "' (" + strerror(errno) + ")";
@@ -124,9 +121,9 @@ WavAudioOutput::WavAudioOutput(const std::string &filename,
     return;
   }
 
-  // Write initial header with a dummy sample count.
+  // Write initial header with a dummy data size.
   // This will be replaced with the actual header once the WavFile is closed.
-  if (!write_header(0x7fff0000)) {
+  if (!write_header(wav_max_data_size) || fflush(m_stream) != 0) {
     m_error = "can not write to '" + filename + "' (" + strerror(errno) + ")";
     m_zombie = true;
   }
@@ -138,21 +135,15 @@ WavAudioOutput::~WavAudioOutput() {
 
   if (!m_zombie) {
 
-    const unsigned bytesPerSample = 2;
-
-    const long currentPosition = ftell(m_stream);
-
-    assert((currentPosition - 44) % bytesPerSample == 0);
-
-    const unsigned totalNumberOfSamples =
-        (currentPosition - 44) / bytesPerSample;
-
-    assert(totalNumberOfSamples % numberOfChannels == 0);
+    // Whole frames only (a failed write may have stopped halfway).
+    const std::uint64_t frameSize = numberOfChannels * 2;
+    std::uint64_t dataSize = std::max(m_data_size, m_data_end.load());
+    dataSize -= dataSize % frameSize;
 
     // Put header in front
 
     if (fseek(m_stream, 0, SEEK_SET) == 0) {
-      write_header(totalNumberOfSamples);
+      write_header(dataSize);
     }
   }
 
@@ -168,11 +159,15 @@ bool WavAudioOutput::write(const SampleVector &samples) {
   if (m_zombie)
     return false;
 
+  if (!check_size(m_data_size + 2 * samples.size()))
+    return false;
+
   // Convert samples to bytes.
   samplesToInt16(samples, m_bytebuf);
 
   // Write samples to file.
   std::size_t k = fwrite(m_bytebuf.data(), 1, m_bytebuf.size(), m_stream);
+  m_data_size += k;
   if (k != m_bytebuf.size()) {
     m_error = "write failed (";
     m_error += strerror(errno);
@@ -183,8 +178,63 @@ bool WavAudioOutput::write(const SampleVector &samples) {
   return true;
 }
 
+// Write audio data at the specified sample frame.
+bool WavAudioOutput::write_at(std::uint64_t frame,
+                              const SampleVector &samples) {
+  if (m_zombie)
+    return false;
+
+  std::uint64_t end = (frame * numberOfChannels + samples.size()) * 2;
+  if (!check_size(end))
+    return false;
+
+  // Convert samples to bytes (local buffer; this may run concurrently).
+  std::vector<std::uint8_t> bytes(2 * samples.size());
+  kernels().pcm_s16le(samples.data(), bytes.data(), samples.size());
+
+  // Write samples without moving the stream position.
+  int fd = fileno(m_stream);
+  off_t pos = wav_header_size + frame * numberOfChannels * 2;
+  std::size_t p = 0;
+  std::size_t n = bytes.size();
+  while (p < n) {
+    ssize_t k = pwrite(fd, bytes.data() + p, n - p, pos + p);
+    if (k <= 0) {
+      if (k == 0 || errno != EINTR) {
+        std::lock_guard<std::mutex> lock(m_error_mutex);
+        m_error = "write failed (";
+        m_error += strerror(errno);
+        m_error += ")";
+        return false;
+      }
+    } else {
+      p += k;
+    }
+  }
+
+  // Remember the end of the data for the final header.
+  std::uint64_t prev = m_data_end.load();
+  while (prev < end && !m_data_end.compare_exchange_weak(prev, end)) {
+  }
+
+  return true;
+}
+
+// Check that the data fits within the size limit of the header.
+bool WavAudioOutput::check_size(std::uint64_t end) {
+  if (end <= wav_max_data_size)
+    return true;
+  std::lock_guard<std::mutex> lock(m_error_mutex);
+  if (!m_size_error) {
+    m_size_error = true;
+    m_error = "WAV file size limit of 4 GiB reached, "
+              "further audio is not written";
+  }
+  return false;
+}
+
 // (Re)write .WAV header.
-bool WavAudioOutput::write_header(unsigned int nsamples) {
+bool WavAudioOutput::write_header(std::uint64_t data_size) {
   const unsigned bytesPerSample = 2;
   const unsigned bitsPerSample = 16;
 
@@ -193,14 +243,15 @@ bool WavAudioOutput::write_header(unsigned int nsamples) {
     WAVE_FORMAT_IEEE_FLOAT = 0x0003
   };
 
-  assert(nsamples % numberOfChannels == 0);
+  assert(data_size % (numberOfChannels * bytesPerSample) == 0);
+  assert(data_size <= wav_max_data_size);
 
   // synthesize header
 
   uint8_t wavHeader[44];
 
   encode_chunk_id(wavHeader + 0, "RIFF");
-  set_value<uint32_t>(wavHeader + 4, 36 + nsamples * bytesPerSample);
+  set_value<uint32_t>(wavHeader + 4, 36 + data_size);
   encode_chunk_id(wavHeader + 8, "WAVE");
   encode_chunk_id(wavHeader + 12, "fmt ");
   set_value<uint32_t>(wavHeader + 16, 16);
@@ -213,9 +264,9 @@ bool WavAudioOutput::write_header(unsigned int nsamples) {
                       numberOfChannels * bytesPerSample); // block size
   set_value<uint16_t>(wavHeader + 34, bitsPerSample);
   encode_chunk_id(wavHeader + 36, "data");
-  set_value<uint32_t>(wavHeader + 40, nsamples * bytesPerSample);
+  set_value<uint32_t>(wavHeader + 40, data_size);
 
-  return fwrite(wavHeader, 1, 44, m_stream) == 44;
+  return fwrite(wavHeader, 1, wav_header_size, m_stream) == wav_header_size;
 }
 
 void WavAudioOutput::encode_chunk_id(uint8_t *ptr, const char *chunkname) {
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <cmath>
+
+#include "BandScanner.h"
+#include "FmDecode.h"
+
+// Fraction of the sample rate used per tuner step
+// (the edges are attenuated by the anti-aliasing filter).
+static const double usable_fraction = 0.8;
+
+// Half width of the spectrum bins around zero frequency replaced by
+// their neighbours (DC offset of the receiver).
+static const int dc_bins = 2;
+
+// Bandwidth over which the channel power is measured in Hz.
+static const double channel_bandwidth = 150000;
+
+// Percentile of the band spectrum used as noise floor.
+static const double noise_percentile = 0.2;
+
+// Return default settings for the 76 - 108 MHz band.
+BandScanner::Config BandScanner::default_config() {
+  Config config;
+  config.freq_min = 76.0e6;
+  config.freq_max = 108.0e6;
+  config.sample_rate = default_sample_rate;
+  config.fft_size = 2048;
+  config.fft_count = 32;
+  config.channel_spacing = 100000;
+  config.threshold = 10.0;
+  config.pilot_seconds = 0;
+  return config;
+}
+
+BandScanner::BandScanner(const Config &config)
+    : m_config(config), m_fft(config.fft_size),
+      m_bin_width(config.sample_rate / config.fft_size),
+      m_usable(usable_fraction * config.sample_rate), m_noise_floor(0),
+      m_step_count(0) {}
+
+// Scan the band.
+bool BandScanner::scan(const Capture &capture,
+                       std::vector<Station> &stations) {
+  stations.clear();
+  if (!measure_spectrum(capture))
+    return false;
+
+  // Noise floor.
+  std::vector<float> sorted(m_band);
+  std::vector<float>::iterator p =
+      sorted.begin() + std::uint64_t(noise_percentile * (sorted.size() - 1));
+  std::nth_element(sorted.begin(), p, sorted.end());
+  m_noise_floor = 10 * log10(std::max(*p, 1.0e-20f));
+
+  // Channel powers on the raster.
+  const double spacing = m_config.channel_spacing;
+  std::vector<double> freqs, powers;
+  for (double f = ceil(m_config.freq_min / spacing) * spacing;
+       f <= m_config.freq_max + 0.5; f += spacing) {
+    freqs.push_back(f);
+    powers.push_back(band_power(f - 0.5 * channel_bandwidth,
+                                f + 0.5 * channel_bandwidth));
+  }
+
+  // Stations are channels above the threshold which are local maxima
+  // (a strong station also raises the power of its neighbours).
+  for (unsigned int k = 0; k < freqs.size(); k++) {
+    double snr = powers[k] - m_noise_floor;
+    if (snr < m_config.threshold)
+      continue;
+    if ((k > 0 && powers[k - 1] > powers[k]) ||
+        (k + 1 < freqs.size() && powers[k + 1] >= powers[k]))
+      continue;
+
+    Station s;
+    s.frequency = freqs[k];
+    s.power = powers[k];
+    s.snr = snr;
+    s.pilot_checked = false;
+    s.stereo = false;
+    s.pilot_level = 0;
+    stations.push_back(s);
+  }
+
+  if (m_config.pilot_seconds > 0 && !check_pilots(capture, stations))
+    return false;
+
+  std::stable_sort(stations.begin(), stations.end(),
+                   [](const Station &a, const Station &b) {
+                     return a.snr > b.snr;
+                   });
+  return true;
+}
+
+// Measure the band spectrum.
+bool BandScanner::measure_spectrum(const Capture &capture) {
+  // Cover the channel bandwidth of the outermost channels.
+  const double span_min = m_config.freq_min - channel_bandwidth;
+  const double span_max = m_config.freq_max + channel_bandwidth;
+  const unsigned int nbins =
+      (unsigned int)ceil((span_max - span_min) / m_bin_width) + 1;
+  m_band.assign(nbins, -1);
+
+  const unsigned int n = m_config.fft_size;
+  const unsigned int h = n / 2;
+  // A full-scale tone gives 0 dB.
+  const float scale = 1.0f / (m_config.fft_count * float(h) * float(h));
+
+  m_step_count = std::max(1, int(ceil((span_max - span_min) / m_usable)));
+  for (unsigned int step = 0; step < m_step_count; step++) {
+    double center = span_min + (step + 0.5) * m_usable;
+    if (!capture(center, n * m_config.fft_count, m_samples) ||
+        m_samples.size() < n * m_config.fft_count)
+      return false;
+
+    m_power.assign(n, 0);
+    for (unsigned int j = 0; j < m_config.fft_count; j++)
+      m_fft.add_power(m_samples.data() + j * n, m_power, m_fft_buf);
+
+    // Remove the DC offset peak.
+    float dc = 0.5f * (m_power[h - dc_bins - 1] + m_power[h + dc_bins + 1]);
+    for (int i = -dc_bins; i <= dc_bins; i++)
+      m_power[h + i] = dc;
+
+    for (unsigned int i = 0; i < n; i++) {
+      double offset = (double(i) - h) * m_bin_width;
+      if (fabs(offset) > 0.5 * m_usable)
+        continue;
+      long idx = lrint((center + offset - span_min) / m_bin_width);
+      if (idx >= 0 && idx < long(nbins))
+        m_band[idx] = m_power[i] * scale;
+    }
+  }
+
+  // Fill bins missed by rounding at the step edges.
+  for (unsigned int i = 0; i < nbins; i++) {
+    if (m_band[i] < 0)
+      m_band[i] = (i > 0) ? m_band[i - 1] : 0;
+  }
+
+  return true;
+}
+
+// Return the mean power of the band spectrum over [f1, f2].
+double BandScanner::band_power(double f1, double f2) const {
+  const double span_min = m_config.freq_min - channel_bandwidth;
+  long i1 = std::max(0L, lrint((f1 - span_min) / m_bin_width));
+  long i2 = std::min(long(m_band.size()) - 1,
+                     lrint((f2 - span_min) / m_bin_width));
+  double sum = 0;
+  for (long i = i1; i <= i2; i++)
+    sum += m_band[i];
+  return 10 * log10(std::max(sum / std::max(1L, i2 - i1 + 1), 1.0e-20));
+}
+
+// Check the stations for a stereo pilot.
+bool BandScanner::check_pilots(const Capture &capture,
+                               std::vector<Station> &stations) {
+  const double rate = m_config.sample_rate;
+  const double bandwidth_if = FmDecoder::default_bandwidth_if;
+  const unsigned int downsample =
+      FmDecoder::plan_rates(rate, 48000, bandwidth_if).downsample;
+  const unsigned int nsamples = (unsigned int)(m_config.pilot_seconds * rate);
+  const unsigned int block = 65536;
+  double ifeq_static_gain, ifeq_fit_factor;
+  DiscriminatorEqualizer::get_parameters(rate, ifeq_static_gain,
+                                         ifeq_fit_factor);
+
+  std::vector<Station *> todo;
+  for (Station &s : stations)
+    todo.push_back(&s);
+  std::sort(todo.begin(), todo.end(), [](const Station *a, const Station *b) {
+    return a->frequency < b->frequency;
+  });
+
+  SampleVector audio;
+  while (!todo.empty()) {
+    // Put the lowest station a quarter of the sample rate below the
+    // center, and decode all stations which fit in the same capture
+    // (clear of the DC offset).
+    double center = todo.front()->frequency + 0.25 * rate;
+    std::vector<Station *> group, rest;
+    for (Station *s : todo) {
+      double offset = s->frequency - center;
+      if (fabs(offset) >= bandwidth_if &&
+          fabs(offset) <= 0.5 * m_usable - bandwidth_if)
+        group.push_back(s);
+      else
+        rest.push_back(s);
+    }
+    todo.swap(rest);
+
+    if (!capture(center, nsamples, m_samples))
+      return false;
+
+    for (Station *s : group) {
+      FmDecoder fm(rate,                        // sample_rate_if
+                   ifeq_static_gain,            // ifeq_static_gain
+                   ifeq_fit_factor,             // ifeq_fit_factor
+                   s->frequency - center,       // tuning_offset
+                   48000,                       // sample_rate_pcm
+                   0,                           // deemphasis
+                   bandwidth_if,                // bandwidth_if
+                   FmDecoder::default_freq_dev, // freq_dev
+                   15000,                       // bandwidth_pcm
+                   downsample);                 // downsample
+      fm.reserve(block);
+      audio.resize(fm.max_output_size(block));
+      for (unsigned int i = 0; i < m_samples.size(); i += block) {
+        unsigned int n = std::min<unsigned int>(block, m_samples.size() - i);
+        fm.process(m_samples.data() + i, n, audio.data(), audio.size());
+      }
+      s->pilot_checked = true;
+      s->stereo = fm.stereo_detected();
+      s->pilot_level = fm.get_pilot_level();
+    }
+  }
+
+  return true;
+}
+
+// end
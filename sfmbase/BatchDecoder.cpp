@@ -0,0 +1,539 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <limits>
+#include <sys/stat.h>
+#include <thread>
+
+#include "AudioOutput.h"
+#include "BatchDecoder.h"
+#include "FmDecode.h"
+#include "IqFileSource.h"
+
+// Shared state of a file decoded in chunks.
+struct BatchDecoder::ChunkedFile {
+  const Job *job;
+  WavAudioOutput *output;
+  double tuning_offset;
+  std::uint64_t first_frame;  // first audio frame written to the file
+  std::uint64_t end_frame;    // end of the decoded span
+  std::uint64_t chunk_frames; // audio frames per chunk
+  unsigned int num_chunks;
+  std::atomic<std::uint64_t> frames;     // audio frames written
+  std::atomic<std::uint64_t> iq_samples; // IQ samples decoded
+  std::atomic<unsigned int> checkpoints_rejected;
+  std::mutex error_mutex;
+  std::string error;
+
+  // Record the first error.
+  void fail(const std::string &msg) {
+    std::lock_guard<std::mutex> lock(error_mutex);
+    if (error.empty())
+      error = msg;
+  }
+};
+
+// Set nominal audio volume (same as live mode).
+static void scale_audio(SampleVector &audio) {
+  for (Sample &s : audio)
+    s *= 0.5;
+}
+
+// Keep only frames [lo, hi) of a block of audio which starts at frame.
+static void keep_frames(SampleVector &audio, std::uint64_t frame,
+                        std::uint64_t lo, std::uint64_t hi) {
+  audio.resize(2 * (hi - frame));
+  audio.erase(audio.begin(), audio.begin() + 2 * (lo - frame));
+}
+
+// Return elapsed time in seconds since start.
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+BatchDecoder::BatchDecoder(const Config &config)
+    : m_config(config), m_next(0), m_stop_flag(NULL) {}
+
+// Decode all jobs and return one result per job.
+std::vector<BatchDecoder::Result>
+BatchDecoder::run(const std::vector<Job> &jobs,
+                  const std::atomic_bool *stop_flag, Callback done) {
+  m_stop_flag = stop_flag;
+
+  Result notrun;
+  notrun.ok = false;
+  notrun.error = "not decoded";
+  notrun.iq_samples = 0;
+  notrun.audio_samples = 0;
+  notrun.seconds = 0;
+  notrun.worker = 0;
+  notrun.checkpoints_rejected = 0;
+  std::vector<Result> results(jobs.size(), notrun);
+
+  // Split each file over all workers.
+  if (m_config.chunk_seconds > 0) {
+    for (unsigned int i = 0; i < jobs.size() && !stopped(); i++) {
+      auto start = std::chrono::steady_clock::now();
+      decode_chunked(jobs[i], results[i]);
+      results[i].seconds = seconds_since(start);
+      if (done)
+        done(jobs[i], results[i]);
+    }
+    return results;
+  }
+
+  // Start the largest files first to keep the tail of the run short.
+  std::vector<std::uint64_t> sizes(jobs.size(), 0);
+  for (unsigned int i = 0; i < jobs.size(); i++) {
+    struct stat st;
+    if (stat(jobs[i].input.c_str(), &st) == 0)
+      sizes[i] = st.st_size;
+  }
+  std::vector<unsigned int> order(jobs.size());
+  for (unsigned int i = 0; i < jobs.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&sizes](unsigned int a, unsigned int b) {
+                     return sizes[a] > sizes[b];
+                   });
+
+  std::mutex done_mutex;
+  run_tasks(jobs.size(), [&](unsigned int k, unsigned int worker) {
+    unsigned int i = order[k];
+    Result &result = results[i];
+    result.worker = worker;
+
+    auto start = std::chrono::steady_clock::now();
+    decode_file(jobs[i], m_buffers[worker], result);
+    result.seconds = seconds_since(start);
+
+    if (done) {
+      std::lock_guard<std::mutex> lock(done_mutex);
+      done(jobs[i], result);
+    }
+  });
+
+  return results;
+}
+
+// Run tasks on the worker threads.
+void BatchDecoder::run_tasks(
+    unsigned int ntasks,
+    const std::function<void(unsigned int, unsigned int)> &task) {
+  unsigned int nworkers =
+      std::max(1u, std::min(m_config.num_workers, ntasks));
+  if (m_buffers.size() < nworkers)
+    m_buffers.resize(nworkers);
+  m_next.store(0);
+
+  auto worker = [this, ntasks, &task](unsigned int index) {
+    while (!stopped()) {
+      unsigned int k = m_next.fetch_add(1);
+      if (k >= ntasks)
+        break;
+      task(k, index);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned int w = 1; w < nworkers; w++)
+    threads.push_back(std::thread(worker, w));
+  worker(0);
+  for (std::thread &t : threads)
+    t.join();
+}
+
+// Construct a decoder with the configured settings.
+std::unique_ptr<FmDecoder>
+BatchDecoder::make_decoder(double tuning_offset,
+                           std::uint32_t decoder_flags) const {
+  bool rds = (decoder_flags & IqArchive::decoder_rds) != 0;
+  bool afc = (decoder_flags & IqArchive::decoder_afc) != 0;
+  std::unique_ptr<FmDecoder> fm(
+      new FmDecoder(m_config.sample_rate_if,         // sample_rate_if
+                    m_config.ifeq_static_gain,       // ifeq_static_gain
+                    m_config.ifeq_fit_factor,        // ifeq_fit_factor
+                    tuning_offset,                   // tuning_offset
+                    m_config.sample_rate_pcm,        // sample_rate_pcm
+                    m_config.deemphasis,             // deemphasis
+                    FmDecoder::default_bandwidth_if, // bandwidth_if
+                    FmDecoder::default_freq_dev,     // freq_dev
+                    m_config.bandwidth_pcm,          // bandwidth_pcm
+                    m_config.downsample,             // downsample
+                    m_config.pilot_shift,            // pilot_shift
+                    rds,                             // rds
+                    afc));                           // afc
+  fm->reserve(m_config.block_length);
+  return fm;
+}
+
+// Check that a file can be decoded and return its tuning offset.
+bool BatchDecoder::check_input(const IqFileSource &source,
+                               double &tuning_offset,
+                               std::string &error) const {
+  if (!source.is_archive()) {
+    tuning_offset = m_config.tuning_offset;
+    return true;
+  }
+
+  const IqArchive::Info &info = source.get_info();
+  if (info.sample_rate != m_config.sample_rate_if) {
+    error = "recorded at " + std::to_string(llrint(info.sample_rate)) +
+            " Hz, decoding at " +
+            std::to_string(llrint(m_config.sample_rate_if)) + " Hz";
+    return false;
+  }
+
+  double station =
+      (m_config.station_freq > 0) ? m_config.station_freq : info.station;
+  tuning_offset = station - info.frequency;
+  return true;
+}
+
+// Return the number of audio frames discarded at the start of a file.
+std::uint64_t BatchDecoder::warmup_frames() const {
+  return std::uint64_t(std::ceil(warmup_samples * m_config.sample_rate_pcm /
+                                 m_config.sample_rate_if));
+}
+
+// Return the audio frames to decode from each file.
+void BatchDecoder::span_frames(std::uint64_t &begin,
+                               std::uint64_t &end) const {
+  begin = std::max<std::uint64_t>(
+      warmup_frames(), llrint(m_config.span_begin * m_config.sample_rate_pcm));
+  end = std::numeric_limits<std::uint64_t>::max();
+  if (m_config.span_end > 0)
+    end = std::max<std::uint64_t>(
+        begin, llrint(m_config.span_end * m_config.sample_rate_pcm));
+}
+
+// Construct a decoder to produce audio from frame begin on.
+std::unique_ptr<FmDecoder>
+BatchDecoder::start_decoder(IqFileSource &source, double tuning_offset,
+                            std::uint64_t begin, std::uint64_t &frame,
+                            bool &rejected) const {
+  // Enable the decoder options of the recording, since its checkpoints
+  // only restore into a decoder with the same options.
+  std::unique_ptr<FmDecoder> fm =
+      make_decoder(tuning_offset, source.get_info().decoder_flags);
+
+  // Continue from the last checkpoint before frame begin if the file
+  // has one made with the same settings; the decoder then produces the
+  // same audio as the decoder which made the recording.
+  IqArchive::Checkpoint checkpoint;
+  std::uint64_t position = std::uint64_t(
+      begin * (m_config.sample_rate_if / m_config.sample_rate_pcm));
+  rejected = false;
+  if (source.get_checkpoint(position, checkpoint) &&
+      checkpoint.frame <= begin) {
+    if (fm->restore_state(checkpoint.state.data(), checkpoint.state.size())) {
+      frame = checkpoint.frame;
+      if (!source.seek(checkpoint.sample))
+        fm.reset();
+      return fm;
+    }
+    rejected = true;
+  }
+
+  // Otherwise start chunk_overlap seconds early, at an aligned sample.
+  // A decoder started at an aligned sample produces the same sequence of
+  // audio frames as one started at sample 0, minus the frames before
+  // that sample.
+  std::uint64_t period_frames;
+  const std::uint64_t period = align_period(period_frames);
+  double start = (begin - m_config.chunk_overlap * m_config.sample_rate_pcm) *
+                 (m_config.sample_rate_if / m_config.sample_rate_pcm);
+  std::uint64_t start_period =
+      (start > 0) ? std::uint64_t(start) / period : 0;
+  frame = start_period * period_frames;
+  if (!source.seek(start_period * period))
+    fm.reset();
+  return fm;
+}
+
+// Return the IQ sample period at which chunk decoding may start.
+// This is the smallest number of IQ samples which is a whole number of
+// baseband samples and a whole number of audio frames: the audio
+// resampler makes L frames from every M baseband samples.
+std::uint64_t BatchDecoder::align_period(std::uint64_t &frames) const {
+  unsigned int interpolation, decimation;
+  RationalResampler::find_ratio(
+      m_config.sample_rate_if,
+      m_config.sample_rate_pcm * m_config.downsample, interpolation,
+      decimation);
+  frames = interpolation;
+  return std::uint64_t(decimation) * m_config.downsample;
+}
+
+// Decode one file.
+void BatchDecoder::decode_file(const Job &job, Buffers &buf, Result &result) {
+  result.ok = false;
+  result.error.clear();
+
+  if (job.output == job.input) {
+    result.error = "output file would overwrite input";
+    return;
+  }
+
+  IqFileSource source(job.input, m_config.block_length);
+  if (!source) {
+    result.error = source.error();
+    return;
+  }
+
+  double tuning_offset;
+  if (!check_input(source, tuning_offset, result.error))
+    return;
+
+  WavAudioOutput output(job.output, m_config.sample_rate_pcm);
+  if (!output) {
+    result.error = output.error();
+    return;
+  }
+
+  // Frames before begin are thrown away: the first ones are noisy
+  // because IF filters are still starting up.
+  std::uint64_t begin, end, frame;
+  bool rejected;
+  span_frames(begin, end);
+  std::unique_ptr<FmDecoder> fm =
+      start_decoder(source, tuning_offset, begin, frame, rejected);
+  if (!fm) {
+    result.error = source.error();
+    return;
+  }
+  if (rejected)
+    result.checkpoints_rejected++;
+
+  while (frame < end && !stopped()) {
+    if (!source.get_samples(buf.iqsamples))
+      break;
+
+    fm->process(buf.iqsamples, buf.audio);
+    result.iq_samples += buf.iqsamples.size();
+
+    std::uint64_t nframes = buf.audio.size() / 2;
+    std::uint64_t lo = std::max(frame, begin);
+    std::uint64_t hi = std::min(frame + nframes, end);
+    if (lo < hi) {
+      keep_frames(buf.audio, frame, lo, hi);
+      scale_audio(buf.audio);
+      if (!output.write(buf.audio)) {
+        result.error = output.error();
+        return;
+      }
+      result.audio_samples += hi - lo;
+    }
+    frame += nframes;
+  }
+
+  if (!source) {
+    result.error = source.error();
+    return;
+  }
+
+  result.ok = true;
+}
+
+// Decode one file in parallel chunks.
+void BatchDecoder::decode_chunked(const Job &job, Result &result) {
+  result.ok = false;
+  result.error.clear();
+  result.worker = 0;
+
+  if (job.output == job.input) {
+    result.error = "output file would overwrite input";
+    return;
+  }
+
+  std::uint64_t sample_count;
+  double tuning_offset;
+  {
+    IqFileSource source(job.input, 1);
+    if (!source) {
+      result.error = source.error();
+      return;
+    }
+    if (!check_input(source, tuning_offset, result.error))
+      return;
+    sample_count = source.get_sample_count();
+  }
+  if (sample_count == 0) {
+    result.error = "empty or not a regular file";
+    return;
+  }
+
+  WavAudioOutput output(job.output, m_config.sample_rate_pcm);
+  if (!output) {
+    result.error = output.error();
+    return;
+  }
+
+  ChunkedFile file;
+  file.job = &job;
+  file.output = &output;
+  file.tuning_offset = tuning_offset;
+  span_frames(file.first_frame, file.end_frame);
+  file.chunk_frames = std::max<std::uint64_t>(
+      1, llrint(m_config.chunk_seconds * m_config.sample_rate_pcm));
+  file.frames.store(0);
+  file.iq_samples.store(0);
+  file.checkpoints_rejected.store(0);
+
+  std::uint64_t total_frames = std::min(
+      file.end_frame, std::uint64_t(sample_count * m_config.sample_rate_pcm /
+                                    m_config.sample_rate_if));
+  file.num_chunks = 1;
+  if (total_frames > file.first_frame + file.chunk_frames) {
+    file.num_chunks =
+        (total_frames - file.first_frame + file.chunk_frames - 1) /
+        file.chunk_frames;
+  }
+
+  run_tasks(file.num_chunks, [this, &file](unsigned int chunk,
+                                           unsigned int worker) {
+    decode_chunk(file, chunk, m_buffers[worker]);
+  });
+
+  if (stopped())
+    file.fail("interrupted");
+  if (!file.error.empty()) {
+    result.error = file.error;
+    return;
+  }
+  if (!output) {
+    result.error = output.error();
+    return;
+  }
+
+  result.iq_samples = file.iq_samples.load();
+  result.audio_samples = file.frames.load();
+  result.checkpoints_rejected = file.checkpoints_rejected.load();
+  result.ok = true;
+}
+
+// Decode one chunk of a file decoded in chunks.
+void BatchDecoder::decode_chunk(ChunkedFile &file, unsigned int chunk,
+                                Buffers &buf) {
+  // Audio frames [begin, end) of this chunk, counted from the start of
+  // the file. The last chunk runs to the end of the span.
+  std::uint64_t begin = file.first_frame + chunk * file.chunk_frames;
+  std::uint64_t end = (chunk + 1 < file.num_chunks)
+                          ? begin + file.chunk_frames
+                          : file.end_frame;
+
+  IqFileSource source(file.job->input, m_config.block_length);
+  std::uint64_t frame = 0;
+  bool rejected = false;
+  std::unique_ptr<FmDecoder> fm;
+  if (source)
+    fm = start_decoder(source, file.tuning_offset, begin, frame, rejected);
+  if (!fm) {
+    file.fail(source.error());
+    return;
+  }
+  if (rejected)
+    file.checkpoints_rejected.fetch_add(1);
+
+  while (frame < end && !stopped()) {
+    if (!source.get_samples(buf.iqsamples))
+      break;
+
+    fm->process(buf.iqsamples, buf.audio);
+    file.iq_samples.fetch_add(buf.iqsamples.size());
+
+    // Keep the frames which belong to this chunk.
+    std::uint64_t nframes = buf.audio.size() / 2;
+    std::uint64_t lo = std::max(frame, begin);
+    std::uint64_t hi = std::min(frame + nframes, end);
+    if (lo < hi) {
+      keep_frames(buf.audio, frame, lo, hi);
+      scale_audio(buf.audio);
+      if (!file.output->write_at(lo - file.first_frame, buf.audio)) {
+        file.fail(file.output->error());
+        return;
+      }
+      file.frames.fetch_add(hi - lo);
+    }
+    frame += nframes;
+  }
+
+  if (!source)
+    file.fail(source.error());
+}
+
+// Expand path to a list of IQ files.
+bool BatchDecoder::list_inputs(const std::string &path,
+                               std::vector<std::string> &files,
+                               std::string &error) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    error = "can not access '" + path + "' (" + strerror(errno) + ")";
+    return false;
+  }
+
+  if (S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(path.c_str());
+    if (dir == NULL) {
+      error = "can not open directory '" + path + "' (" + strerror(errno) +
+              ")";
+      return false;
+    }
+    std::vector<std::string> names;
+    while (struct dirent *ent = readdir(dir)) {
+      if (ent->d_name[0] == '.')
+        continue;
+      std::string name = path + "/" + ent->d_name;
+      struct stat fst;
+      if (stat(name.c_str(), &fst) == 0 && S_ISREG(fst.st_mode))
+        names.push_back(name);
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+    files.insert(files.end(), names.begin(), names.end());
+    return true;
+  }
+
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == NULL) {
+    error = "can not open '" + path + "' (" + strerror(errno) + ")";
+    return false;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), f) != NULL) {
+    std::string name(line);
+    name.erase(name.find_last_not_of(" \t\r\n") + 1);
+    if (name.empty() || name[0] == '#')
+      continue;
+    files.push_back(name);
+  }
+  fclose(f);
+  return true;
+}
+
+// Return output file name for input.
+std::string BatchDecoder::output_name(const std::string &input,
+                                      const std::string &outdir) {
+  std::string::size_type slash = input.rfind('/');
+  std::string dir =
+      (slash == std::string::npos) ? "" : input.substr(0, slash + 1);
+  std::string base =
+      (slash == std::string::npos) ? input : input.substr(slash + 1);
+
+  std::string::size_type dot = base.rfind('.');
+  if (dot != std::string::npos && dot > 0)
+    base.erase(dot);
+
+  if (!outdir.empty())
+    dir = outdir + "/";
+
+  return dir + base + ".wav";
+}
+
+// end
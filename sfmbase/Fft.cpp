@@ -0,0 +1,68 @@
+#include <cassert>
+#include <cmath>
+#include <utility>
+
+#include "Fft.h"
+
+// Prepare transforms of length size.
+Fft::Fft(unsigned int size)
+    : m_size(size), m_bitrev(size), m_twiddle(size / 2), m_window(size) {
+  assert(size >= 2 && (size & (size - 1)) == 0);
+
+  unsigned int bits = 0;
+  while ((1u << bits) < size)
+    bits++;
+  for (unsigned int i = 0; i < size; i++) {
+    unsigned int r = 0;
+    for (unsigned int b = 0; b < bits; b++)
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    m_bitrev[i] = r;
+  }
+
+  for (unsigned int i = 0; i < size / 2; i++) {
+    double phi = -2.0 * M_PI * i / size;
+    m_twiddle[i] = IQSample(cos(phi), sin(phi));
+  }
+
+  for (unsigned int i = 0; i < size; i++)
+    m_window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / size);
+}
+
+// Transform in place.
+void Fft::forward(IQSample *data) const {
+  for (unsigned int i = 0; i < m_size; i++) {
+    unsigned int r = m_bitrev[i];
+    if (r > i)
+      std::swap(data[i], data[r]);
+  }
+
+  // Butterflies; the twiddle stride halves with each stage.
+  for (unsigned int half = 1, stride = m_size / 2; half < m_size;
+       half *= 2, stride /= 2) {
+    for (unsigned int k = 0; k < m_size; k += 2 * half) {
+      for (unsigned int j = 0; j < half; j++) {
+        IQSample t = m_twiddle[j * stride] * data[k + j + half];
+        data[k + j + half] = data[k + j] - t;
+        data[k + j] += t;
+      }
+    }
+  }
+}
+
+// Add the windowed power spectrum of one block.
+void Fft::add_power(const IQSample *samples, std::vector<float> &power,
+                    IQSampleVector &buf) const {
+  buf.resize(m_size);
+  power.resize(m_size, 0);
+  for (unsigned int i = 0; i < m_size; i++)
+    buf[i] = samples[i] * m_window[i];
+
+  forward(buf.data());
+
+  // Swap halves so that bin size/2 is zero frequency.
+  unsigned int h = m_size / 2;
+  for (unsigned int i = 0; i < m_size; i++)
+    power[i] += std::norm(buf[(i + h) & (m_size - 1)]);
+}
+
+// end
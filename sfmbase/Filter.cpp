@@ -22,69 +22,85 @@
 #include <cstdint>
 
 #include "Filter.h"
+#include "Kernels.h"
 
-// Prepare Lanczos FIR filter coefficients.
-template <class T>
-static void make_lanczos_coeff(unsigned int filter_order, double cutoff,
-                               std::vector<T> &coeff) {
-  coeff.resize(filter_order + 1);
+// Shortest dot product worth folding; below this the reversed loads and
+// the loop tail cost more than the saved multiplications.
+static const unsigned int min_folded_dot_taps = 96;
 
-  // Prepare Lanczos FIR filter.
-  //   t[i]     =  (i - order/2)
-  //   coeff[i] =  Sinc(2 * cutoff * t[i]) * Sinc(t[i] / (order/2 + 1))
-  //   coeff    /= sum(coeff)
-
-  double ysum = 0.0;
-
-  // Calculate filter kernel.
-  for (int i = 0; i <= (int)filter_order; i++) {
-    int t2 = 2 * i - filter_order;
-
-    double y;
-    if (t2 == 0) {
-      y = 1.0;
-    } else {
-      double x1 = cutoff * t2;
-      double x2 = t2 / double(filter_order + 2);
-      y = (sin(M_PI * x1) / M_PI / x1) * (sin(M_PI * x2) / M_PI / x2);
-    }
-
-    coeff[i] = y;
-    ysum += y;
-  }
-
-  // Apply correction factor to ensure unit gain at DC.
-  for (unsigned i = 0; i <= filter_order; i++) {
-    coeff[i] /= ysum;
+// Return true if the n coefficients at c are symmetric.
+template <class T> static bool is_symmetric(const T *c, unsigned int n) {
+  for (unsigned int j = 0; j < n / 2; j++) {
+    if (c[j] != c[n - 1 - j])
+      return false;
   }
+  return true;
 }
 
 // class FineTuner
 
 // Construct finetuner.
 FineTuner::FineTuner(unsigned int table_size, int freq_shift)
-    : m_index(0), m_table(table_size) {
+    : m_index(0), m_shift(freq_shift), m_phase(0), m_table_i(table_size),
+      m_table_q(table_size) {
+  make_tables();
+}
+
+// Change the frequency shift.
+void FineTuner::set_freq_shift(int freq_shift) {
+  // Keep the phase of the next sample, so that the signal has no phase
+  // step (which would give a click in the demodulated audio).
+  int64_t table_size = m_table_i.size();
+  int64_t k = ((int64_t(m_shift) - freq_shift) * m_index) % table_size;
+  m_phase = fmod(m_phase + 2.0 * M_PI * double(k) / double(table_size),
+                 2.0 * M_PI);
+  m_shift = freq_shift;
+  make_tables();
+}
+
+// Fill the tables for the current shift and phase.
+void FineTuner::make_tables() {
+  unsigned int table_size = m_table_i.size();
   double phase_step = 2.0 * M_PI / double(table_size);
   for (unsigned int i = 0; i < table_size; i++) {
-    double phi = (((int64_t)freq_shift * i) % table_size) * phase_step;
-    double pcos = cos(phi);
-    double psin = sin(phi);
-    m_table[i] = IQSample(pcos, psin);
+    double phi = m_phase + (((int64_t)m_shift * i) % table_size) * phase_step;
+    m_table_i[i] = cos(phi);
+    m_table_q[i] = sin(phi);
   }
+  m_table_shift = m_shift;
+  m_table_phase = m_phase;
 }
 
 // Process samples.
-void FineTuner::process(const IQSampleVector &samples_in,
-                        IQSampleVector &samples_out) {
-  unsigned int tblidx = m_index;
-  unsigned int tblsiz = m_table.size();
+void FineTuner::process(const IQBlock &samples_in, IQBlock &samples_out) {
   unsigned int n = samples_in.size();
-
   samples_out.resize(n);
+  process(samples_in.i.data(), samples_in.q.data(), n, samples_out.i.data(),
+          samples_out.q.data());
+}
 
-  for (unsigned int i = 0; i < n; i++) {
-    samples_out[i] = samples_in[i] * m_table[tblidx];
-    tblidx++;
+// Process samples from separate I/Q arrays.
+void FineTuner::process(const IQSample::value_type *in_i,
+                        const IQSample::value_type *in_q, unsigned int n,
+                        IQSample::value_type *out_i,
+                        IQSample::value_type *out_q) {
+  // A restored state may need new tables.
+  if (m_shift != m_table_shift || m_phase != m_table_phase)
+    make_tables();
+
+  unsigned int tblidx = m_index;
+  unsigned int tblsiz = m_table_i.size();
+
+  // Process up to the end of the table at a time,
+  // so that the kernel runs over contiguous arrays.
+  const KernelTable &kern = kernels();
+  unsigned int i = 0;
+  while (i < n) {
+    unsigned int len = std::min(n - i, tblsiz - tblidx);
+    kern.mix(in_i + i, in_q + i, m_table_i.data() + tblidx,
+             m_table_q.data() + tblidx, out_i + i, out_q + i, len);
+    i += len;
+    tblidx += len;
     if (tblidx == tblsiz)
       tblidx = 0;
   }
@@ -92,82 +108,174 @@ void FineTuner::process(const IQSampleVector &samples_in,
   m_index = tblidx;
 }
 
+// Process samples in-place.
+void FineTuner::process_inplace(IQBlock &samples) {
+  process(samples.i.data(), samples.q.data(), samples.size(),
+          samples.i.data(), samples.q.data());
+}
+
+// Save oscillator frequency and phase.
+void FineTuner::save_state(StateWriter &w) const {
+  w.put(m_index);
+  w.put(m_shift);
+  w.put(m_phase);
+}
+
+// Restore oscillator frequency and phase (the tables are filled when
+// the next samples are processed).
+void FineTuner::restore_state(StateReader &r) {
+  int table_size = m_table_i.size();
+  r.get(m_index, 0u, unsigned(table_size - 1));
+  r.get(m_shift, -table_size, table_size);
+  r.get(m_phase, -2.0 * M_PI, 2.0 * M_PI);
+}
+
 // class LowPassFilterFirIQ
 
 // Construct low-pass filter.
-LowPassFilterFirIQ::LowPassFilterFirIQ(unsigned int filter_order, double cutoff)
-    : m_state(filter_order) {
-  make_lanczos_coeff(filter_order, cutoff, m_coeff);
+LowPassFilterFirIQ::LowPassFilterFirIQ(const LowPassSpec &spec) {
+  std::vector<double> coeff;
+  design_lowpass(spec, coeff);
+  m_coeff.assign(coeff.begin(), coeff.end());
+
+  // Select the kernel once: short symmetric filters have a kernel built
+  // for their exact length.
+  const KernelTable &kern = kernels();
+  bool symmetric = is_symmetric(m_coeff.data(), m_coeff.size());
+  m_fir = symmetric ? kern.fir_sym_fixed(m_coeff.size()) : NULL;
+  if (m_fir == NULL)
+    m_fir = symmetric ? kern.fir_sym : kern.fir;
+  m_history_i = History(m_coeff.size() - 1);
+  m_history_q = History(m_coeff.size() - 1);
 }
 
 // Process samples.
-void LowPassFilterFirIQ::process(const IQSampleVector &samples_in,
-                                 IQSampleVector &samples_out) {
-  unsigned int order = m_state.size();
+void LowPassFilterFirIQ::process(const IQBlock &samples_in,
+                                 IQBlock &samples_out) {
   unsigned int n = samples_in.size();
-
   samples_out.resize(n);
+  process(samples_in.i.data(), samples_in.q.data(), n, samples_out.i.data(),
+          samples_out.q.data());
+}
 
-  if (n == 0)
-    return;
+// Process samples from separate I/Q arrays.
+void LowPassFilterFirIQ::process(const IQSample::value_type *in_i,
+                                 const IQSample::value_type *in_q,
+                                 unsigned int n, IQSample::value_type *out_i,
+                                 IQSample::value_type *out_q) {
+  // The coefficients are real, so I and Q are filtered independently.
+  filter_plane(in_i, n, m_history_i, out_i);
+  filter_plane(in_q, n, m_history_q, out_q);
+}
+
+// Filter one plane.
+void LowPassFilterFirIQ::filter_plane(const IQSample::value_type *samples_in,
+                                      unsigned int n, History &history,
+                                      IQSample::value_type *samples_out) {
+  unsigned int ntaps = m_coeff.size();
 
   // NOTE: We use m_coeff the wrong way around because it is slightly
   // faster to scan forward through the array. The result is still correct
-  // because the coefficients are symmetric.
-
-  // The first few samples need data from m_state.
-  unsigned int i = 0;
-  for (; i < n && i < order; i++) {
-    IQSample y = 0;
-    for (unsigned int j = 0; j < order - i; j++)
-      y += m_state[i + j] * m_coeff[j];
-    for (unsigned int j = order - i; j <= order; j++)
-      y += samples_in[i - order + j] * m_coeff[j];
-    samples_out[i] = y;
-  }
+  // because the coefficients are symmetric, which also lets the folded
+  // kernels add mirrored input pairs and do half the multiplications.
+
+  // The first outputs read the staged history, the rest the input itself.
+  history.begin(samples_in, n);
+  unsigned int m = history.staged();
+  m_fir(history.window(0), m_coeff.data(), ntaps, samples_out, m);
+  m_fir(history.window(m), m_coeff.data(), ntaps, samples_out + m, n - m);
+  history.end();
+}
 
-  // Remaining samples only need data from samples_in.
-  for (; i < n; i++) {
-    IQSample y = 0;
-    IQSampleVector::const_iterator inp = samples_in.begin() + i - order;
-    for (unsigned int j = 0; j <= order; j++)
-      y += inp[j] * m_coeff[j];
-    samples_out[i] = y;
-  }
+// Save filter history.
+void LowPassFilterFirIQ::save_state(StateWriter &w) const {
+  m_history_i.save_state(w);
+  m_history_q.save_state(w);
+}
 
-  // Update m_state.
-  if (n < order) {
-    copy(m_state.begin() + n, m_state.end(), m_state.begin());
-    copy(samples_in.begin(), samples_in.end(), m_state.end() - n);
-  } else {
-    copy(samples_in.end() - order, samples_in.end(), m_state.begin());
-  }
+// Restore filter history.
+void LowPassFilterFirIQ::restore_state(StateReader &r) {
+  m_history_i.restore_state(r);
+  m_history_q.restore_state(r);
 }
 
 // class DownsampleFilter
 
 // Construct low-pass filter with optional downsampling.
-DownsampleFilter::DownsampleFilter(unsigned int filter_order, double cutoff,
-                                   double downsample, bool integer_factor)
+DownsampleFilter::DownsampleFilter(const LowPassSpec &spec, double downsample,
+                                   bool integer_factor)
     : m_downsample(downsample),
       m_downsample_int(integer_factor ? lrint(downsample) : 0), m_pos_int(0),
-      m_pos_frac(0), m_state(filter_order) {
+      m_in_cnt(0), m_out_cnt(0) {
   assert(downsample >= 1);
-  assert(filter_order > 1);
+
+  SampleVector coeff;
+  design_lowpass(spec, coeff);
+  m_order = coeff.size();
+  m_history = FirHistory<Sample>(m_order);
+  assert(m_order > 1);
 
   // Force the first coefficient to zero and append an extra zero at the
-  // end of the array. This ensures we can always obtain (filter_order+1)
+  // end of the array. This ensures we can always obtain (m_order+1)
   // coefficients by linear interpolation between adjacent array elements.
-  make_lanczos_coeff(filter_order - 1, cutoff, m_coeff);
-  m_coeff.insert(m_coeff.begin(), 0);
-  m_coeff.push_back(0);
+  coeff.insert(coeff.begin(), 0);
+  coeff.push_back(0);
+
+  // Store the coefficients in reverse order, so that each output sample
+  // is a forward dot product over the input history:
+  //   m_coeff_rev[k] = coeff[m_order + 1 - k]
+  m_coeff_rev.assign(coeff.rbegin(), coeff.rend());
+  m_symmetric = m_order >= min_folded_dot_taps &&
+                is_symmetric(m_coeff_rev.data() + 1, m_order);
+
+  // Short filters with an integer factor have a kernel built for their
+  // exact length.
+  m_decimate =
+      (m_downsample_int != 0) ? kernels().decimate_fixed(m_order) : NULL;
+}
+
+// Return the maximum number of output samples for n input samples.
+unsigned int DownsampleFilter::max_output_size(unsigned int n) const {
+  if (m_downsample_int != 0) {
+    unsigned int p = m_pos_int;
+    unsigned int pstep = m_downsample_int;
+    return (p < n) ? (n - p + pstep - 1) / pstep : 0;
+  } else {
+    return int(2 + n / m_downsample);
+  }
 }
 
 // Process samples.
 void DownsampleFilter::process(const SampleVector &samples_in,
-                               SampleVector &samples_out) {
-  unsigned int order = m_state.size();
+                               SampleVector &samples_out, SampleStats *stats) {
   unsigned int n = samples_in.size();
+  unsigned int n_out = max_output_size(n);
+  samples_out.resize(n_out);
+  samples_out.resize(
+      process(samples_in.data(), n, samples_out.data(), n_out, stats));
+}
+
+// Process samples from an array.
+unsigned int DownsampleFilter::process(const Sample *samples_in,
+                                       unsigned int n, Sample *samples_out,
+                                       unsigned int out_capacity,
+                                       SampleStats *stats) {
+  const KernelTable &kern = kernels();
+  unsigned int order = m_order;
+  unsigned int n_out = max_output_size(n);
+
+  assert(out_capacity >= n_out);
+  (void)out_capacity;
+
+  // The filter input x is the last order input samples followed by the
+  // new input (input sample p of this block is x[order + p]);
+  // m_history.window(p) points to x[p].
+  m_history.begin(samples_in, n);
+
+  // Output level, accumulated while filtering (it costs little at the
+  // output rate).
+  SampleStats level;
+  unsigned int i = 0;
 
   // Use integer downsample factor algorithm
   // if the downsample factor is explicitly an integer.
@@ -175,33 +283,40 @@ void DownsampleFilter::process(const SampleVector &samples_in,
   if (m_downsample_int != 0) {
 
     // Integer downsample factor, no linear interpolation.
-    // This is relatively simple.
+    // y = sum(coeff[j] * in[p - j], j = 1 .. order)
 
     unsigned int p = m_pos_int;
     unsigned int pstep = m_downsample_int;
 
-    samples_out.resize((n - p + pstep - 1) / pstep);
-
-    // The first few samples need data from m_state.
-    unsigned int i = 0;
-    for (; p < n && p < order; p += pstep, i++) {
-      Sample y = 0;
-      for (unsigned int j = 1; j <= p; j++)
-        y += samples_in[p - j] * m_coeff[j];
-      for (unsigned int j = p + 1; j <= order; j++)
-        y += m_state[order + p - j] * m_coeff[j];
-      samples_out[i] = y;
-    }
-
-    // Remaining samples only need data from samples_in.
-    for (; p < n; p += pstep, i++) {
-      Sample y = 0;
-      for (unsigned int j = 1; j <= order; j++)
-        y += samples_in[p - j] * m_coeff[j];
-      samples_out[i] = y;
+    if (m_decimate != NULL) {
+      // Outputs whose window starts in the staged history,
+      // then the outputs which read the input directly.
+      unsigned int staged = m_history.staged();
+      unsigned int n1 =
+          (p < staged) ? std::min(n_out, (staged - p + pstep - 1) / pstep) : 0;
+      if (n1 > 0) {
+        m_decimate(m_history.window(p), m_coeff_rev.data() + 1, order, pstep,
+                   samples_out, n1, level);
+      }
+      if (n_out > n1) {
+        m_decimate(m_history.window(p + n1 * pstep), m_coeff_rev.data() + 1,
+                   order, pstep, samples_out + n1, n_out - n1, level);
+      }
+      i = n_out;
+      p += n_out * pstep;
+    } else {
+      Sample (*dot)(const Sample *, const Sample *, unsigned int) =
+          m_symmetric ? kern.dot_sym : kern.dot;
+      for (; p < n; p += pstep, i++) {
+        Sample y = dot(m_history.window(p), m_coeff_rev.data() + 1, order);
+        samples_out[i] = y;
+        level.sum += y;
+        level.sumsq += y * y;
+      }
+      level.count = i;
     }
 
-    assert(i == samples_out.size());
+    assert(i == n_out);
 
     // Update index of start position in text sample block.
     m_pos_int = p - n;
@@ -209,54 +324,232 @@ void DownsampleFilter::process(const SampleVector &samples_in,
   } else {
 
     // Fractional downsample factor via linear interpolation of
-    // the FIR coefficient table. This is complicated.
+    // the FIR coefficient table.
+    // y = sum((coeff[j] * k0 + coeff[j + 1] * k1) * in[p - j], j = 0 .. order)
 
-    // Estimate number of output samples we can produce in this run.
-    Sample p = m_pos_frac;
     Sample pstep = m_downsample;
-    unsigned int n_out = int(2 + n / pstep);
-
-    samples_out.resize(n_out);
 
     // Produce output samples.
-    unsigned int i = 0;
-    Sample pf = p;
+    // The position of each output sample is computed from the absolute
+    // output and input sample counts, so that the result does not depend
+    // on how the input stream is split into blocks.
+    // (Subtracting the integer input count from the position is exact.)
+    Sample pf = Sample(m_out_cnt) * pstep - Sample(m_in_cnt);
     unsigned int pi = int(pf);
     while (pi < n) {
       Sample k1 = pf - pi;
       Sample k0 = 1 - k1;
 
-      Sample y = 0;
-      for (unsigned int j = 0; j <= order; j++) {
-        Sample k = m_coeff[j] * k0 + m_coeff[j + 1] * k1;
-        Sample s = (j <= pi) ? samples_in[pi - j] : m_state[order + pi - j];
-        y += k * s;
-      }
+      const Sample *x = m_history.window(pi);
+      Sample y0 = kern.dot(x, m_coeff_rev.data() + 1, order + 1);
+      Sample y1 = kern.dot(x, m_coeff_rev.data(), order + 1);
+      Sample y = k0 * y0 + k1 * y1;
       samples_out[i] = y;
+      level.sum += y;
+      level.sumsq += y * y;
 
       i++;
-      pf = p + i * pstep;
+      pf = Sample(m_out_cnt + i) * pstep - Sample(m_in_cnt);
       pi = int(pf);
     }
 
-    // We may overestimate the number of samples by 1 or 2.
+    // max_output_size() may overestimate the number of samples by 1 or 2.
     assert(i <= n_out && i + 2 >= n_out);
-    samples_out.resize(i);
 
-    // Update fractional index of start position in text sample block.
-    // Limit to 0 to avoid catastrophic results of rounding errors.
-    m_pos_frac = pf - n;
-    if (m_pos_frac < 0)
-      m_pos_frac = 0;
+    // Update absolute sample counts.
+    m_out_cnt += i;
+    m_in_cnt += n;
+    level.count = i;
   }
+  if (stats != NULL)
+    *stats = level;
 
-  // Update m_state.
-  if (n < order) {
-    copy(m_state.begin() + n, m_state.end(), m_state.begin());
-    copy(samples_in.begin(), samples_in.end(), m_state.end() - n);
-  } else {
-    copy(samples_in.end() - order, samples_in.end(), m_state.begin());
+  // Keep the last order input samples for the next block.
+  m_history.end();
+
+  return i;
+}
+
+// Clear filter history and resampling position.
+void DownsampleFilter::reset() {
+  m_pos_int = 0;
+  m_in_cnt = 0;
+  m_out_cnt = 0;
+  m_history.reset();
+}
+
+// Save filter history and resampling position.
+void DownsampleFilter::save_state(StateWriter &w) const {
+  w.put(m_pos_int);
+  w.put(m_in_cnt);
+  w.put(m_out_cnt);
+  m_history.save_state(w);
+}
+
+// Restore filter history and resampling position.
+void DownsampleFilter::restore_state(StateReader &r) {
+  // The next output lies less than one step after the last input sample.
+  r.get(m_pos_int, 0u, std::max(1u, m_downsample_int) - 1);
+  std::uint64_t in_cnt = 0, out_cnt = 0;
+  r.read(in_cnt);
+  r.read(out_cnt);
+  Sample pf = Sample(out_cnt) * m_downsample - Sample(in_cnt);
+  r.require(m_downsample_int != 0 || (pf >= 0 && pf <= m_downsample));
+  if (r.storing()) {
+    m_in_cnt = in_cnt;
+    m_out_cnt = out_cnt;
+  }
+  m_history.restore_state(r);
+}
+
+// class RationalResampler
+
+// Return greatest common divisor.
+static std::uint64_t gcd(std::uint64_t a, std::uint64_t b) {
+  while (b != 0) {
+    std::uint64_t t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Find the resampling ratio L/M.
+bool RationalResampler::find_ratio(double rate_in, double rate_out,
+                                   unsigned int &interpolation,
+                                   unsigned int &decimation) {
+  assert(rate_in > 0 && rate_out > 0);
+
+  if (rate_in == floor(rate_in) && rate_out == floor(rate_out) &&
+      rate_in < 1.0e15 && rate_out < 1.0e15) {
+    std::uint64_t a = std::uint64_t(rate_out);
+    std::uint64_t b = std::uint64_t(rate_in);
+    std::uint64_t g = gcd(a, b);
+    if (a / g <= max_phases && b / g <= UINT32_MAX) {
+      interpolation = a / g;
+      decimation = b / g;
+      return true;
+    }
+  }
+
+  // Closest fraction with at most max_phases phases.
+  double ratio = rate_in / rate_out;
+  double best_err = -1;
+  for (unsigned int l = 1; l <= max_phases; l++) {
+    double m = std::max(1.0, floor(l * ratio + 0.5));
+    double err = fabs(m / l - ratio);
+    if (best_err < 0 || err < best_err) {
+      best_err = err;
+      interpolation = l;
+      decimation = (unsigned int)std::min(m, double(UINT32_MAX));
+    }
   }
+  return false;
+}
+
+// Construct resampler.
+RationalResampler::RationalResampler(double rate_in, double rate_out,
+                                     const LowPassSpec &spec)
+    : m_pos(0) {
+  find_ratio(rate_in, rate_out, m_interpolation, m_decimation);
+
+  // Design the prototype filter at L times the input rate, padded with
+  // zeros to a multiple of L taps, and split it into L phases of m_order
+  // taps:
+  //   phase p uses coeff[p + j * L], j = 0 .. m_order - 1
+  const unsigned int l = m_interpolation;
+  LowPassSpec prototype = spec;
+  prototype.passband /= l;
+  prototype.stopband /= l;
+  std::vector<double> coeff;
+  design_lowpass(prototype, coeff);
+  m_order = std::max<std::size_t>(2, (coeff.size() + l - 1) / l);
+  coeff.resize(std::size_t(l) * m_order, 0);
+  m_history = FirHistory<Sample>(m_order);
+
+  // Store each phase in reverse order, so that each output sample is a
+  // forward dot product over the input history.
+  m_coeff_rev.resize(std::size_t(l) * m_order);
+  m_symmetric = m_order >= min_folded_dot_taps;
+  for (unsigned int p = 0; p < l; p++) {
+    for (unsigned int j = 0; j < m_order; j++) {
+      m_coeff_rev[p * m_order + m_order - 1 - j] = coeff[p + j * l] * l;
+    }
+    m_symmetric = m_symmetric &&
+                  is_symmetric(m_coeff_rev.data() + p * m_order, m_order);
+  }
+}
+
+// Return the maximum number of output samples for n input samples.
+unsigned int RationalResampler::max_output_size(unsigned int n) const {
+  std::uint64_t end = std::uint64_t(n) * m_interpolation;
+  return (m_pos < end) ? (end - m_pos + m_decimation - 1) / m_decimation : 0;
+}
+
+// Process samples.
+void RationalResampler::process(const SampleVector &samples_in,
+                                SampleVector &samples_out) {
+  unsigned int n = samples_in.size();
+  unsigned int n_out = max_output_size(n);
+  samples_out.resize(n_out);
+  samples_out.resize(
+      process(samples_in.data(), n, samples_out.data(), n_out));
+}
+
+// Process samples from an array.
+unsigned int RationalResampler::process(const Sample *samples_in,
+                                        unsigned int n, Sample *samples_out,
+                                        unsigned int out_capacity) {
+  const KernelTable &kern = kernels();
+  const unsigned int order = m_order;
+  const unsigned int l = m_interpolation;
+  unsigned int n_out = max_output_size(n);
+
+  assert(out_capacity >= n_out);
+  (void)out_capacity;
+
+  // The filter input x is the last order input samples followed by the
+  // new input (input sample q of this block is x[order + q]);
+  // m_history.window(q) points to x[q].
+  m_history.begin(samples_in, n);
+
+  // Output sample at position t (in 1/L input samples) uses phase t % L
+  // and the order input samples before sample t / L.
+  // y = sum(coeff[t % L + j * L] * in[t / L - 1 - j], j = 0 .. order - 1)
+  std::uint64_t pos = m_pos;
+  const std::uint64_t end = std::uint64_t(n) * l;
+  Sample (*dot)(const Sample *, const Sample *, unsigned int) =
+      m_symmetric ? kern.dot_sym : kern.dot;
+  unsigned int i = 0;
+  for (; pos < end; pos += m_decimation, i++) {
+    unsigned int q = pos / l;
+    unsigned int p = pos % l;
+    samples_out[i] = dot(m_history.window(q),
+                         m_coeff_rev.data() + std::size_t(p) * order, order);
+  }
+
+  assert(i == n_out);
+  (void)n_out;
+
+  // Update position relative to the next block.
+  m_pos = pos - end;
+
+  // Keep the last order input samples for the next block.
+  m_history.end();
+
+  return i;
+}
+
+// Save filter history and resampling position.
+void RationalResampler::save_state(StateWriter &w) const {
+  w.put(m_pos);
+  m_history.save_state(w);
+}
+
+// Restore filter history and resampling position.
+void RationalResampler::restore_state(StateReader &r) {
+  r.get(m_pos, std::uint64_t(0), std::uint64_t(m_decimation - 1));
+  m_history.restore_state(r);
 }
 
 // class LowPassFilterRC
@@ -272,6 +565,13 @@ LowPassFilterRC::LowPassFilterRC(double timeconst)
 // Process samples.
 void LowPassFilterRC::process(const SampleVector &samples_in,
                               SampleVector &samples_out) {
+  samples_out.resize(samples_in.size());
+  process(samples_in.data(), samples_in.size(), samples_out.data());
+}
+
+// Process samples from an array.
+void LowPassFilterRC::process(const Sample *samples_in, unsigned int n,
+                              Sample *samples_out) {
   /*
    * Continuous domain:
    *   H(s) = 1 / (1 - s * timeconst)
@@ -279,9 +579,6 @@ void LowPassFilterRC::process(const SampleVector &samples_in,
    * Discrete domain:
    *   H(z) = (1 - exp(-1/timeconst)) / (1 - exp(-1/timeconst) / z)
    */
-  unsigned int n = samples_in.size();
-  samples_out.resize(n);
-
   Sample y = m_y0_1;
 
   for (unsigned int i = 0; i < n; i++) {
@@ -296,20 +593,19 @@ void LowPassFilterRC::process(const SampleVector &samples_in,
 // Process interleaved samples.
 void LowPassFilterRC::process_interleaved(const SampleVector &samples_in,
                                           SampleVector &samples_out) {
-  /*
-   * Continuous domain:
-   *   H(s) = 1 / (1 - s * timeconst)
-   *
-   * Discrete domain:
-   *   H(z) = (1 - exp(-1/timeconst)) / (1 - exp(-1/timeconst) / z)
-   */
-  unsigned int n = samples_in.size();
-  samples_out.resize(n);
+  samples_out.resize(samples_in.size());
+  process_interleaved(samples_in.data(), samples_in.size(),
+                      samples_out.data());
+}
 
+// Process interleaved samples from an array.
+void LowPassFilterRC::process_interleaved(const Sample *samples_in,
+                                          unsigned int n,
+                                          Sample *samples_out) {
   Sample y0 = m_y0_1;
   Sample y1 = m_y1_1;
 
-  for (unsigned int i = 0; i < n - 1; i += 2) {
+  for (unsigned int i = 0; i + 1 < n; i += 2) {
     Sample x0 = samples_in[i];
     y0 = m_b0 * x0 - m_a1 * y0;
     samples_out[i] = y0;
@@ -325,38 +621,24 @@ void LowPassFilterRC::process_interleaved(const SampleVector &samples_in,
 
 // Process samples in-place.
 void LowPassFilterRC::process_inplace(SampleVector &samples) {
-  unsigned int n = samples.size();
-
-  Sample y = m_y0_1;
-
-  for (unsigned int i = 0; i < n; i++) {
-    Sample x = samples[i];
-    y = m_b0 * x - m_a1 * y;
-    samples[i] = y;
-  }
-
-  m_y0_1 = y;
+  process(samples.data(), samples.size(), samples.data());
 }
 
 // Process interleaved samples in-place.
 void LowPassFilterRC::process_interleaved_inplace(SampleVector &samples) {
-  unsigned int n = samples.size();
-
-  Sample y0 = m_y0_1;
-  Sample y1 = m_y1_1;
-
-  for (unsigned int i = 0; i < n - 1; i += 2) {
-    Sample x0 = samples[i];
-    y0 = m_b0 * x0 - m_a1 * y0;
-    samples[i] = y0;
+  process_interleaved(samples.data(), samples.size(), samples.data());
+}
 
-    Sample x1 = samples[i + 1];
-    y1 = m_b0 * x1 - m_a1 * y1;
-    samples[i + 1] = y1;
-  }
+// Save filter state.
+void LowPassFilterRC::save_state(StateWriter &w) const {
+  w.put(m_y0_1);
+  w.put(m_y1_1);
+}
 
-  m_y0_1 = y0;
-  m_y1_1 = y1;
+// Restore filter state.
+void LowPassFilterRC::restore_state(StateReader &r) {
+  r.get(m_y0_1);
+  r.get(m_y1_1);
 }
 
 // class LowPassFilterIir
@@ -402,10 +684,13 @@ LowPassFilterIir::LowPassFilterIir(double cutoff) : y1(0), y2(0), y3(0), y4(0) {
 // Process samples.
 void LowPassFilterIir::process(const SampleVector &samples_in,
                                SampleVector &samples_out) {
-  unsigned int n = samples_in.size();
-
-  samples_out.resize(n);
+  samples_out.resize(samples_in.size());
+  process(samples_in.data(), samples_in.size(), samples_out.data());
+}
 
+// Process samples from an array.
+void LowPassFilterIir::process(const Sample *samples_in, unsigned int n,
+                               Sample *samples_out) {
   for (unsigned int i = 0; i < n; i++) {
     Sample x = samples_in[i];
     Sample y = b0 * x - a1 * y1 - a2 * y2 - a3 * y3 - a4 * y4;
@@ -417,6 +702,27 @@ void LowPassFilterIir::process(const SampleVector &samples_in,
   }
 }
 
+// Process samples in-place.
+void LowPassFilterIir::process_inplace(SampleVector &samples) {
+  process(samples.data(), samples.size(), samples.data());
+}
+
+// Save filter state.
+void LowPassFilterIir::save_state(StateWriter &w) const {
+  w.put(y1);
+  w.put(y2);
+  w.put(y3);
+  w.put(y4);
+}
+
+// Restore filter state.
+void LowPassFilterIir::restore_state(StateReader &r) {
+  r.get(y1);
+  r.get(y2);
+  r.get(y3);
+  r.get(y4);
+}
+
 // class HighPassFilterIir
 
 // Construct 2nd order high-pass IIR filter.
@@ -460,10 +766,13 @@ HighPassFilterIir::HighPassFilterIir(double cutoff)
 // Process samples.
 void HighPassFilterIir::process(const SampleVector &samples_in,
                                 SampleVector &samples_out) {
-  unsigned int n = samples_in.size();
-
-  samples_out.resize(n);
+  samples_out.resize(samples_in.size());
+  process(samples_in.data(), samples_in.size(), samples_out.data());
+}
 
+// Process samples from an array.
+void HighPassFilterIir::process(const Sample *samples_in, unsigned int n,
+                                Sample *samples_out) {
   for (unsigned int i = 0; i < n; i++) {
     Sample x = samples_in[i];
     Sample y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
@@ -477,17 +786,23 @@ void HighPassFilterIir::process(const SampleVector &samples_in,
 
 // Process samples in-place.
 void HighPassFilterIir::process_inplace(SampleVector &samples) {
-  unsigned int n = samples.size();
+  process(samples.data(), samples.size(), samples.data());
+}
 
-  for (unsigned int i = 0; i < n; i++) {
-    Sample x = samples[i];
-    Sample y = b0 * x + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
-    x2 = x1;
-    x1 = x;
-    y2 = y1;
-    y1 = y;
-    samples[i] = y;
-  }
+// Save filter state.
+void HighPassFilterIir::save_state(StateWriter &w) const {
+  w.put(x1);
+  w.put(x2);
+  w.put(y1);
+  w.put(y2);
+}
+
+// Restore filter state.
+void HighPassFilterIir::restore_state(StateReader &r) {
+  r.get(x1);
+  r.get(x2);
+  r.get(y1);
+  r.get(y2);
 }
 
 // end
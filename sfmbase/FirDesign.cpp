@@ -0,0 +1,345 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <tuple>
+
+#include "FirDesign.h"
+
+// Dense grid points per cosine term in the exchange algorithm.
+static const unsigned int grid_density = 16;
+
+// Maximum number of exchange iterations.
+static const unsigned int max_iterations = 40;
+
+// Longest filter designed with the exchange algorithm.
+static const unsigned int max_equiripple_taps = 511;
+
+// Return the linear passband deviation allowed by spec.
+static double passband_deviation(const LowPassSpec &spec) {
+  return 1.0 - pow(10.0, -spec.ripple / 20.0);
+}
+
+// Return the linear stopband gain allowed by spec.
+static double stopband_deviation(const LowPassSpec &spec) {
+  return pow(10.0, -spec.attenuation / 20.0);
+}
+
+// Estimate the length of an equiripple low-pass filter
+// (Herrmann, Rabiner and Chan, 1973).
+static double equiripple_taps(double dp, double ds, double df) {
+  double l1 = log10(dp);
+  double l2 = log10(ds);
+  double d = (5.309e-3 * l1 * l1 + 7.114e-2 * l1 - 4.761e-1) * l2 -
+             (2.66e-3 * l1 * l1 + 5.941e-1 * l1 + 4.278e-1);
+  double f = 11.01217 + 0.51244 * (l1 - l2);
+  return d / df - f * df + 1;
+}
+
+// Return the attenuation in dB of a Kaiser window design for spec
+// (the window gives equal passband and stopband deviation). Kaiser's
+// length formula is slightly optimistic, so add a margin of 1 dB.
+static double kaiser_attenuation(const LowPassSpec &spec) {
+  return 1.0 - 20.0 * log10(std::min(passband_deviation(spec),
+                                     stopband_deviation(spec)));
+}
+
+// Return the length of a Kaiser window design for spec (Kaiser, 1974).
+static unsigned int kaiser_taps(const LowPassSpec &spec) {
+  double a = kaiser_attenuation(spec);
+  double df = spec.stopband - spec.passband;
+  double d = (a > 21) ? (a - 7.95) / 14.36 : 0.9222;
+  return (unsigned int)ceil(d / df) + 1;
+}
+
+// Modified Bessel function of the first kind, order 0.
+static double bessel_i0(double x) {
+  double sum = 1, term = 1;
+  for (int k = 1; k < 64 && term > 1.0e-12 * sum; k++) {
+    double t = x / (2 * k);
+    term *= t * t;
+    sum += term;
+  }
+  return sum;
+}
+
+// Design a low-pass filter as a Kaiser-windowed sinc.
+static void design_kaiser_lowpass(const LowPassSpec &spec,
+                                  std::vector<double> &coeff) {
+  double a = kaiser_attenuation(spec);
+  double beta = (a > 50)    ? 0.1102 * (a - 8.7)
+                : (a >= 21) ? 0.5842 * pow(a - 21, 0.4) + 0.07886 * (a - 21)
+                            : 0;
+  unsigned int ntaps = kaiser_taps(spec);
+  double fc = 0.5 * (spec.passband + spec.stopband);
+  double half = 0.5 * (ntaps - 1);
+
+  // Compute the first half and mirror it, so that the coefficients are
+  // exactly symmetric.
+  coeff.resize(ntaps);
+  for (unsigned int i = 0; 2 * i < ntaps; i++) {
+    double t = i - half;
+    double y = 2 * fc;
+    if (t != 0)
+      y = sin(2 * M_PI * fc * t) / (M_PI * t);
+    double u = (half > 0) ? t / half : 0;
+    coeff[i] = y * bessel_i0(beta * sqrt(std::max(0.0, 1 - u * u))) /
+               bessel_i0(beta);
+    coeff[ntaps - 1 - i] = coeff[i];
+  }
+}
+
+// Add the grid points of one band [lo, hi] with desired response des
+// and error weight wt.
+static void add_band(double lo, double hi, double des, double wt, double delf,
+                     std::vector<double> &grid, std::vector<double> &d,
+                     std::vector<double> &w) {
+  unsigned int n = std::max(1, int(ceil((hi - lo) / delf)));
+  for (unsigned int i = 0; i <= n; i++) {
+    grid.push_back((i == n) ? hi : lo + i * (hi - lo) / n);
+    d.push_back(des);
+    w.push_back(wt);
+  }
+}
+
+// Evaluate the interpolating polynomial at frequency f (barycentric form).
+static double eval_response(double f, const std::vector<double> &ad,
+                            const std::vector<double> &x,
+                            const std::vector<double> &y) {
+  double xc = cos(2 * M_PI * f);
+  double num = 0, den = 0;
+  for (unsigned int i = 0; i < x.size(); i++) {
+    double c = xc - x[i];
+    if (fabs(c) < 1.0e-7)
+      return y[i];
+    c = ad[i] / c;
+    den += c;
+    num += c * y[i];
+  }
+  return num / den;
+}
+
+// Find the local extrema of the error function, keep them alternating in
+// sign and drop the smallest ones at either end until r + 1 remain.
+static bool find_extrema(unsigned int r, const std::vector<double> &e,
+                         std::vector<unsigned int> &ext) {
+  const unsigned int n = e.size();
+  std::vector<unsigned int> found;
+
+  for (unsigned int i = 0; i < n; i++) {
+    double prev = (i > 0) ? e[i - 1] : 0;
+    double next = (i + 1 < n) ? e[i + 1] : 0;
+    bool peak = e[i] > 0 && e[i] >= prev && (i + 1 == n || e[i] > next);
+    bool dip = e[i] < 0 && e[i] <= prev && (i + 1 == n || e[i] < next);
+    if (!(peak || dip))
+      continue;
+
+    // Of adjacent extrema with the same sign, keep the larger one.
+    if (!found.empty() && (e[found.back()] > 0) == (e[i] > 0)) {
+      if (fabs(e[i]) > fabs(e[found.back()]))
+        found.back() = i;
+    } else {
+      found.push_back(i);
+    }
+  }
+
+  if (found.size() < r + 1)
+    return false;
+
+  unsigned int first = 0, last = found.size();
+  while (last - first > r + 1) {
+    if (fabs(e[found[first]]) < fabs(e[found[last - 1]]))
+      first++;
+    else
+      last--;
+  }
+  ext.assign(found.begin() + first, found.begin() + last);
+  return true;
+}
+
+// Design an equiripple low-pass filter (Parks-McClellan).
+bool design_equiripple_lowpass(unsigned int ntaps, double passband,
+                               double stopband, double weight,
+                               std::vector<double> &coeff, double &deviation) {
+  assert(ntaps >= 3);
+  assert(passband > 0 && passband < stopband && stopband <= 0.5);
+
+  // The amplitude response is a sum of r cosine terms; a filter with an
+  // even number of taps has an extra factor cos(pi * f), which is taken
+  // out of the desired response and put into the weight.
+  const bool odd = (ntaps % 2) != 0;
+  const unsigned int r = (ntaps + 1) / 2;
+  const double delf = 0.5 / (grid_density * r);
+
+  std::vector<double> grid, d, w;
+  add_band(0, passband, 1, 1, delf, grid, d, w);
+  double top = odd ? 0.5 : 0.5 - delf;
+  add_band(std::min(stopband, top), top, 0, weight, delf, grid, d, w);
+  const unsigned int gridsize = grid.size();
+  if (!odd) {
+    for (unsigned int i = 0; i < gridsize; i++) {
+      double c = cos(M_PI * grid[i]);
+      d[i] /= c;
+      w[i] *= c;
+    }
+  }
+
+  // Start with extremal frequencies evenly spread over the grid.
+  std::vector<unsigned int> ext(r + 1);
+  for (unsigned int i = 0; i <= r; i++)
+    ext[i] = (unsigned int)((double(i) * (gridsize - 1)) / r);
+
+  std::vector<double> x(r + 1), y(r + 1), ad(r + 1), e(gridsize);
+  bool converged = false;
+  for (unsigned int iter = 0; iter < max_iterations && !converged; iter++) {
+    for (unsigned int i = 0; i <= r; i++)
+      x[i] = cos(2 * M_PI * grid[ext[i]]);
+
+    // Barycentric weights; the products are taken in a stride and
+    // scaled by 2 to stay within floating point range.
+    const unsigned int stride = (r - 1) / 15 + 1;
+    for (unsigned int i = 0; i <= r; i++) {
+      double den = 1;
+      for (unsigned int j = 0; j < stride; j++) {
+        for (unsigned int k = j; k <= r; k += stride) {
+          if (k != i)
+            den *= 2 * (x[i] - x[k]);
+        }
+      }
+      if (fabs(den) < 1.0e-5)
+        den = 1.0e-5;
+      ad[i] = 1 / den;
+    }
+
+    // Deviation of the best approximation on the current extremal set.
+    double num = 0, den = 0, sign = 1;
+    for (unsigned int i = 0; i <= r; i++) {
+      num += ad[i] * d[ext[i]];
+      den += sign * ad[i] / w[ext[i]];
+      sign = -sign;
+    }
+    double delta = num / den;
+    sign = 1;
+    for (unsigned int i = 0; i <= r; i++) {
+      y[i] = d[ext[i]] - sign * delta / w[ext[i]];
+      sign = -sign;
+    }
+
+    for (unsigned int i = 0; i < gridsize; i++)
+      e[i] = w[i] * (d[i] - eval_response(grid[i], ad, x, y));
+
+    if (!find_extrema(r, e, ext))
+      break;
+
+    double emin = fabs(e[ext[0]]), emax = emin;
+    for (unsigned int i = 1; i <= r; i++) {
+      emin = std::min(emin, fabs(e[ext[i]]));
+      emax = std::max(emax, fabs(e[ext[i]]));
+    }
+    converged = (emax - emin) <= 1.0e-4 * emax;
+  }
+
+  deviation = 0;
+  for (unsigned int i = 0; i < gridsize; i++)
+    deviation = std::max(deviation, fabs(e[i]));
+
+  // Sample the amplitude response at f = k / ntaps and transform back
+  // to the (symmetric) impulse response.
+  const double mid = 0.5 * (ntaps - 1);
+  const unsigned int kmax = odd ? r - 1 : ntaps / 2 - 1;
+  std::vector<double> a(kmax + 1);
+  for (unsigned int k = 0; k <= kmax; k++) {
+    double f = double(k) / ntaps;
+    a[k] = eval_response(f, ad, x, y) * (odd ? 1 : cos(M_PI * f));
+  }
+  coeff.resize(ntaps);
+  for (unsigned int n = 0; 2 * n < ntaps; n++) {
+    double v = a[0];
+    for (unsigned int k = 1; k <= kmax; k++)
+      v += 2 * a[k] * cos(2 * M_PI * (n - mid) * k / ntaps);
+    coeff[n] = v / ntaps;
+    coeff[ntaps - 1 - n] = coeff[n];
+  }
+
+  return converged;
+}
+
+// Design a low-pass filter which meets spec with the fewest taps.
+static void design_lowpass_uncached(const LowPassSpec &spec,
+                                    std::vector<double> &coeff) {
+
+  const double dp = passband_deviation(spec);
+  const double ds = stopband_deviation(spec);
+  double estimate =
+      equiripple_taps(dp, ds, spec.stopband - spec.passband);
+  if (estimate > max_equiripple_taps) {
+    design_kaiser_lowpass(spec, coeff);
+    return;
+  }
+
+  // The passband error is weighted 1, so a design meets spec when its
+  // deviation is at most dp.
+  std::vector<double> trial;
+  auto meets = [&](unsigned int ntaps) {
+    double deviation;
+    return design_equiripple_lowpass(ntaps, spec.passband, spec.stopband,
+                                     dp / ds, trial, deviation) &&
+           deviation <= dp;
+  };
+
+  // Start from the estimate and search for the shortest design; an even
+  // length may fail where the next shorter odd length still meets spec.
+  unsigned int ntaps = std::max(3, int(ceil(estimate)));
+  while (!meets(ntaps)) {
+    if (++ntaps > max_equiripple_taps) {
+      design_kaiser_lowpass(spec, coeff);
+      return;
+    }
+  }
+  coeff = trial;
+  while (ntaps > 3) {
+    if (meets(ntaps - 1)) {
+      ntaps -= 1;
+    } else if (ntaps > 4 && meets(ntaps - 2)) {
+      ntaps -= 2;
+    } else {
+      break;
+    }
+    coeff = trial;
+  }
+}
+
+// Design a low-pass filter which meets spec with the fewest taps.
+void design_lowpass(const LowPassSpec &spec, std::vector<double> &coeff) {
+  assert(spec.passband > 0 && spec.passband < spec.stopband &&
+         spec.stopband <= 0.5);
+
+  // Every decoder of a configuration designs the same filters, so each
+  // spec is designed once and cached (the length follows from the spec).
+  typedef std::tuple<double, double, double, double> Key;
+  static std::mutex mutex;
+  static std::map<Key, std::vector<double>> cache;
+
+  Key key(spec.passband, spec.stopband, spec.ripple, spec.attenuation);
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<Key, std::vector<double>>::iterator it = cache.find(key);
+  if (it == cache.end()) {
+    std::vector<double> designed;
+    design_lowpass_uncached(spec, designed);
+    it = cache.insert(std::make_pair(key, designed)).first;
+  }
+  coeff = it->second;
+}
+
+// Estimate the number of taps design_lowpass() needs for spec.
+unsigned int estimate_lowpass_taps(const LowPassSpec &spec) {
+  double estimate =
+      equiripple_taps(passband_deviation(spec), stopband_deviation(spec),
+                      spec.stopband - spec.passband);
+  if (estimate > max_equiripple_taps)
+    return kaiser_taps(spec);
+  return std::max(3, int(ceil(estimate)));
+}
+
+// end
@@ -1,74 +1,241 @@
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <map>
+#include <mutex>
+#include <utility>
 
 #include "FmDecode.h"
+#include "Kernels.h"
 #include "fastatan2.h"
 
-// Compute peak level over a small prefix of the specified sample vector.
-static IQSample::value_type peak_level_approx(const IQSampleVector &samples) {
-  unsigned int n = samples.size();
-  n = (n + 63) / 64;
-
-  IQSample::value_type peak_level = 0;
-  for (unsigned int i = 0; i < n; i++) {
-    const IQSample &s = samples[i];
-    IQSample::value_type re = s.real(), im = s.imag();
-    peak_level = std::max(peak_level, re * re + im * im);
-  }
-
-  return sqrt(peak_level);
-}
+// Identification of decoder state snapshots ("SFMS", format version).
+static const std::uint32_t state_magic = 0x534d4653;
+static const std::uint32_t state_version = 7;
 
 // class PhaseDiscriminator
 
 // Construct phase discriminator.
 PhaseDiscriminator::PhaseDiscriminator(double max_freq_dev)
-    : m_freq_scale_factor(1.0 / (max_freq_dev * 2.0 * M_PI)) {}
+    : m_freq_scale_factor(1.0 / (max_freq_dev * 2.0 * M_PI)),
+      m_peak_level(0), m_rms_level(0) {}
 
 // Process samples.
-void PhaseDiscriminator::process(const IQSampleVector &samples_in,
+void PhaseDiscriminator::process(const IQBlock &samples_in,
                                  SampleVector &samples_out) {
-  unsigned int n = samples_in.size();
-  IQSample s0 = m_last1_sample;
-
-  samples_out.resize(n);
+  samples_out.resize(samples_in.size());
+  process(samples_in.i.data(), samples_in.q.data(), samples_in.size(),
+          samples_out.data());
+}
 
-  for (unsigned int i = 0; i < n; i++) {
-    IQSample s1(samples_in[i]);
-    IQSample d(conj(s0) * s1);
-    Sample w = fastatan2(d.imag(), d.real());
-    samples_out[i] = w * m_freq_scale_factor;
-    s0 = s1;
-  }
+// Process samples from separate I/Q arrays.
+void PhaseDiscriminator::process(const IQSample::value_type *si,
+                                 const IQSample::value_type *sq,
+                                 unsigned int n, Sample *samples_out) {
+  if (n == 0)
+    return;
+
+  // The first sample pairs with the last sample of the previous block.
+  // It goes through the kernel as well, so that it is computed exactly
+  // as it would be inside a block and the output does not depend on
+  // where the blocks are split.
+  const KernelTable &kern = kernels();
+  float edge_i[2] = {m_last1_sample.real(), si[0]};
+  float edge_q[2] = {m_last1_sample.imag(), sq[0]};
+  float edge_power;
+  kern.phase_disc(edge_i, edge_q, m_freq_scale_factor, samples_out, 1,
+                  edge_power);
+
+  // The remaining samples pair with their predecessor in this block;
+  // the kernel also finds the peak and total power of all but the last
+  // sample.
+  float power;
+  float peak = kern.phase_disc(si, sq, m_freq_scale_factor, samples_out + 1,
+                               n - 1, power);
 
   m_last2_sample = m_last1_sample;
-  m_last1_sample = s0;
+  m_last1_sample = IQSample(si[n - 1], sq[n - 1]);
+  float last = std::norm(m_last1_sample);
+  m_peak_level = sqrt(std::max(peak, last));
+  m_rms_level = sqrt((power + last) / n);
+}
+
+// Save previous samples.
+void PhaseDiscriminator::save_state(StateWriter &w) const {
+  w.put(m_last1_sample);
+  w.put(m_last2_sample);
+}
+
+// Restore previous samples.
+void PhaseDiscriminator::restore_state(StateReader &r) {
+  r.get(m_last1_sample);
+  r.get(m_last2_sample);
 }
 
 // class DiscriminatorEqualizer
 
 // Construct equalizer for phase discriminator.
-// TODO: value optimized for 960kHz sampling rate
 DiscriminatorEqualizer::DiscriminatorEqualizer(double ifeq_static_gain,
                                                double ifeq_fit_factor)
     : m_static_gain(ifeq_static_gain), m_fit_factor(ifeq_fit_factor),
       m_last1_sample(0.0) {}
 
 void DiscriminatorEqualizer::process(const SampleVector &samples_in,
-                                     SampleVector &samples_out) {
-  unsigned int n = samples_in.size();
+                                     SampleVector &samples_out,
+                                     SampleStats *stats) {
+  samples_out.resize(samples_in.size());
+  process(samples_in.data(), samples_in.size(), samples_out.data(), stats);
+}
+
+void DiscriminatorEqualizer::process(const Sample *samples_in, unsigned int n,
+                                     Sample *samples_out, SampleStats *stats) {
   Sample s0 = m_last1_sample;
-  samples_out.resize(n);
 
-  for (unsigned int i = 0; i < n; i++) {
-    Sample s1 = samples_in[i];
-    Sample mov1 = (s0 + s1) / 2.0;
-    samples_out[i] = m_static_gain * s1 - m_fit_factor * mov1;
-    s0 = s1;
+  if (stats == NULL) {
+    for (unsigned int i = 0; i < n; i++) {
+      Sample s1 = samples_in[i];
+      Sample mov1 = (s0 + s1) / 2.0;
+      samples_out[i] = m_static_gain * s1 - m_fit_factor * mov1;
+      s0 = s1;
+    }
+  } else {
+    // Same, and measure the output level in the same pass.
+    Sample sum = 0, sumsq = 0;
+    for (unsigned int i = 0; i < n; i++) {
+      Sample s1 = samples_in[i];
+      Sample mov1 = (s0 + s1) / 2.0;
+      Sample y = m_static_gain * s1 - m_fit_factor * mov1;
+      samples_out[i] = y;
+      sum += y;
+      sumsq += y * y;
+      s0 = s1;
+    }
+    stats->sum = sum;
+    stats->sumsq = sumsq;
+    stats->count = n;
   }
+
   m_last1_sample = s0;
 }
 
+// Process samples in-place.
+void DiscriminatorEqualizer::process_inplace(SampleVector &samples,
+                                             SampleStats *stats) {
+  process(samples.data(), samples.size(), samples.data(), stats);
+}
+
+// Save previous sample.
+void DiscriminatorEqualizer::save_state(StateWriter &w) const {
+  w.put(m_last1_sample);
+}
+
+// Restore previous sample.
+void DiscriminatorEqualizer::restore_state(StateReader &r) {
+  r.get(m_last1_sample);
+}
+
+// Return the squared log ratio error of the equalizer parameters
+// (see python-scripts/sincfilter-minimize.py).
+static double ifeq_fit_error(double nyquist, double static_gain,
+                             double fit_factor) {
+  // Keep at least -0.1 dB of gain at zero frequency.
+  if (static_gain - fit_factor < pow(10.0, -0.05))
+    return 1.0e8;
+
+  double sqsum = 0;
+  for (int freq = 50; freq <= 57000; freq += 50) {
+    double theta = 2 * M_PI * freq / nyquist;
+    // Zero-order hold aperture effect, and the response of the static
+    // gain minus the 2-tap moving average.
+    double compensate = (0.5 * theta) / sin(0.5 * theta);
+    double fitlevel = static_gain - fit_factor * cos(0.5 * theta);
+    double logratio = log10(compensate / fitlevel);
+    sqsum += logratio * logratio;
+  }
+  return sqsum;
+}
+
+// Fit the equalizer parameters with the Nelder-Mead method.
+static std::pair<double, double> ifeq_fit(double sample_rate_if) {
+  const double nyquist = 0.5 * sample_rate_if;
+  double x[3][2] = {{1.2, 0.2}, {1.26, 0.2}, {1.2, 0.21}};
+  double f[3];
+  for (int i = 0; i < 3; i++)
+    f[i] = ifeq_fit_error(nyquist, x[i][0], x[i][1]);
+
+  for (int iter = 0; iter < 1000; iter++) {
+    // Order the vertices from best to worst.
+    for (int i = 0; i < 2; i++) {
+      for (int j = 2; j > i; j--) {
+        if (f[j] < f[j - 1]) {
+          std::swap(f[j], f[j - 1]);
+          std::swap(x[j][0], x[j - 1][0]);
+          std::swap(x[j][1], x[j - 1][1]);
+        }
+      }
+    }
+    if (fabs(x[2][0] - x[0][0]) + fabs(x[2][1] - x[0][1]) < 1.0e-10)
+      break;
+
+    // Reflect the worst vertex through the centroid of the others,
+    // then expand, contract or shrink.
+    double c[2], xr[2], xn[2];
+    for (int k = 0; k < 2; k++) {
+      c[k] = 0.5 * (x[0][k] + x[1][k]);
+      xr[k] = 2 * c[k] - x[2][k];
+    }
+    double fr = ifeq_fit_error(nyquist, xr[0], xr[1]);
+    if (fr < f[0]) {
+      for (int k = 0; k < 2; k++)
+        xn[k] = 3 * c[k] - 2 * x[2][k];
+      double fe = ifeq_fit_error(nyquist, xn[0], xn[1]);
+      if (fe < fr) {
+        x[2][0] = xn[0], x[2][1] = xn[1], f[2] = fe;
+      } else {
+        x[2][0] = xr[0], x[2][1] = xr[1], f[2] = fr;
+      }
+    } else if (fr < f[1]) {
+      x[2][0] = xr[0], x[2][1] = xr[1], f[2] = fr;
+    } else {
+      for (int k = 0; k < 2; k++)
+        xn[k] = 0.5 * (c[k] + x[2][k]);
+      double fc = ifeq_fit_error(nyquist, xn[0], xn[1]);
+      if (fc < f[2]) {
+        x[2][0] = xn[0], x[2][1] = xn[1], f[2] = fc;
+      } else {
+        for (int i = 1; i < 3; i++) {
+          x[i][0] = 0.5 * (x[0][0] + x[i][0]);
+          x[i][1] = 0.5 * (x[0][1] + x[i][1]);
+          f[i] = ifeq_fit_error(nyquist, x[i][0], x[i][1]);
+        }
+      }
+    }
+  }
+
+  return std::make_pair(x[0][0], x[0][1]);
+}
+
+// Return the equalizer parameters for an IF sample rate.
+void DiscriminatorEqualizer::get_parameters(double sample_rate_if,
+                                            double &static_gain,
+                                            double &fit_factor) {
+  // The rates used by softfm start with the published values
+  // (see NOTES-jj1bdx.md), so their output does not change.
+  static std::mutex mutex;
+  static std::map<double, std::pair<double, double>> cache = {
+      {240000, {1.47112063, 0.48567701}}, {960000, {1.3412962, 0.34135089}}};
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<double, std::pair<double, double>>::iterator it =
+      cache.find(sample_rate_if);
+  if (it == cache.end())
+    it = cache.insert(std::make_pair(sample_rate_if,
+                                     ifeq_fit(sample_rate_if)))
+             .first;
+  static_gain = it->second.first;
+  fit_factor = it->second.second;
+}
+
 // class PilotPhaseLock
 
 // Construct phase-locked loop.
@@ -88,10 +255,15 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth,
   m_maxfreq = (freq + bandwidth) * 2.0 * M_PI;
 
   // Set valid signal threshold.
+  // The pilot level is measured over windows of 1 / bandwidth samples,
+  // and the lock status is updated at the end of each window.
   m_minsignal = minsignal;
+  m_level_window = std::max(1, int(1.0 / bandwidth));
+  m_level_cnt = 0;
   m_lock_delay = int(20.0 / bandwidth);
   m_lock_cnt = 0;
-  m_pilot_level = 0;
+  m_pilot_level = 1000.0;
+  m_pilot_level_last = 0;
 
   // Create 2nd order filter for I/Q representation of phase error.
   // Filter has two poles, unit DC gain.
@@ -111,7 +283,8 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth,
   // These integrators form the two remaining poles, both at z = 1.
 
   // Initialize frequency and phase.
-  m_freq = freq * 2.0 * M_PI;
+  m_center_freq = freq * 2.0 * M_PI;
+  m_freq = m_center_freq;
   m_phase = 0;
 
   m_phasor_i1 = 0;
@@ -129,16 +302,26 @@ PilotPhaseLock::PilotPhaseLock(double freq, double bandwidth,
 // Process samples and generate the 38kHz locked tone;
 // remove remained locked 19kHz tone from samples_in if locked.
 void PilotPhaseLock::process(SampleVector &samples_in,
-                             SampleVector &samples_out, bool pilot_shift) {
+                             SampleVector &samples_out, bool pilot_shift,
+                             IQSampleVector *pilot_phasor) {
   unsigned int n = samples_in.size();
 
   samples_out.resize(n);
+  if (pilot_phasor != NULL)
+    pilot_phasor->resize(n);
+
+  process(samples_in.data(), n, samples_out.data(), pilot_shift,
+          (pilot_phasor != NULL) ? pilot_phasor->data() : NULL);
+}
+
+// Process samples from an array.
+void PilotPhaseLock::process(Sample *samples_in, unsigned int n,
+                             Sample *samples_out, bool pilot_shift,
+                             IQSample *pilot_phasor) {
 
   bool was_locked = (m_lock_cnt >= m_lock_delay);
   m_pps_events.clear();
-
-  if (n > 0)
-    m_pilot_level = 1000.0;
+  m_lock_changes.clear();
 
   for (unsigned int i = 0; i < n; i++) {
 
@@ -146,6 +329,10 @@ void PilotPhaseLock::process(SampleVector &samples_in,
     Sample psin = sin(m_phase);
     Sample pcos = cos(m_phase);
 
+    // Export locked phasor for the RDS subcarrier.
+    if (pilot_phasor != NULL)
+      pilot_phasor[i] = IQSample(pcos, psin);
+
     // Generate double-frequency output.
     if (pilot_shift) {
       // Use cos(2*x) to shift phase for pi/4 (90 degrees)
@@ -210,44 +397,225 @@ void PilotPhaseLock::process(SampleVector &samples_in,
     if (was_locked) {
       samples_in[i] -= psin * m_pilot_level * 2.0;
     }
-  }
 
-  // Update lock status.
-  if (2 * m_pilot_level > m_minsignal) {
-    if (m_lock_cnt < m_lock_delay)
-      m_lock_cnt += n;
-  } else {
-    m_lock_cnt = 0;
-  }
+    // Update lock status at the end of each level window.
+    if (++m_level_cnt == m_level_window) {
+      if (2 * m_pilot_level > m_minsignal) {
+        if (m_lock_cnt < m_lock_delay)
+          m_lock_cnt += m_level_window;
+      } else {
+        m_lock_cnt = 0;
+      }
+
+      // Reset PPS counter when pilot not locked.
+      bool now_locked = (m_lock_cnt >= m_lock_delay);
+      if (!now_locked) {
+        m_pilot_periods = 0;
+        m_pps_cnt = 0;
+      }
+      if (now_locked != was_locked) {
+        m_lock_changes.push_back(m_sample_cnt + i + 1);
+        was_locked = now_locked;
+      }
 
-  // Drop PPS events when pilot not locked.
-  if (m_lock_cnt < m_lock_delay) {
-    m_pilot_periods = 0;
-    m_pps_cnt = 0;
-    m_pps_events.clear();
+      m_pilot_level_last = m_pilot_level;
+      m_pilot_level = 1000.0;
+      m_level_cnt = 0;
+    }
   }
 
   // Update sample counter.
   m_sample_cnt += n;
 }
 
+// Drop the lock and restart acquisition.
+void PilotPhaseLock::reset() {
+  m_freq = m_center_freq;
+  m_phasor_i1 = 0;
+  m_phasor_i2 = 0;
+  m_phasor_q1 = 0;
+  m_phasor_q2 = 0;
+  m_loopfilter_x1 = 0;
+  m_pilot_level = 1000.0;
+  m_pilot_level_last = 0;
+  m_level_cnt = 0;
+  m_lock_cnt = 0;
+  m_pilot_periods = 0;
+  m_pps_cnt = 0;
+}
+
+// Save loop, level and lock detector state.
+void PilotPhaseLock::save_state(StateWriter &w) const {
+  w.put(m_phasor_i1);
+  w.put(m_phasor_i2);
+  w.put(m_phasor_q1);
+  w.put(m_phasor_q2);
+  w.put(m_loopfilter_x1);
+  w.put(m_freq);
+  w.put(m_phase);
+  w.put(m_pilot_level);
+  w.put(m_pilot_level_last);
+  w.put(m_level_cnt);
+  w.put(m_lock_cnt);
+  w.put(m_pilot_periods);
+  w.put(m_pps_cnt);
+  w.put(m_sample_cnt);
+}
+
+// Restore loop, level and lock detector state.
+void PilotPhaseLock::restore_state(StateReader &r) {
+  r.get(m_phasor_i1);
+  r.get(m_phasor_i2);
+  r.get(m_phasor_q1);
+  r.get(m_phasor_q2);
+  r.get(m_loopfilter_x1);
+  r.get(m_freq, m_minfreq, m_maxfreq);
+  r.get(m_phase, Sample(0), Sample(2.0 * M_PI));
+  r.get(m_pilot_level);
+  r.get(m_pilot_level_last);
+  r.get(m_level_cnt, 0, m_level_window - 1);
+  r.get(m_lock_cnt, 0, m_lock_delay + m_level_window - 1);
+  r.get(m_pilot_periods, 0, pilot_frequency - 1);
+  r.get(m_pps_cnt);
+  r.get(m_sample_cnt);
+}
+
 // class FmDecoder
 
+// Return the number of baseband samples per audio sample, as used by the
+// audio resamplers.
+static double pcm_step(double sample_rate_if, double sample_rate_pcm,
+                       unsigned int downsample) {
+  unsigned int interpolation, decimation;
+  RationalResampler::find_ratio(sample_rate_if, sample_rate_pcm * downsample,
+                                interpolation, decimation);
+  return double(decimation) / double(interpolation);
+}
+
+// Highest baseband frequency the decoder uses: the stereo subband and
+// the RDS subcarrier (57 kHz +- 2.4 kHz).
+static const double baseband_bandwidth = 60000;
+
+// Return a filter specification for edges in Hz at the given sample rate;
+// the stopband edge is limited to the Nyquist frequency.
+static LowPassSpec filter_spec(double sample_rate, double passband,
+                               double stopband, double ripple,
+                               double attenuation) {
+  LowPassSpec spec;
+  spec.stopband = std::min(0.5, stopband / sample_rate);
+  spec.passband = std::min(passband / sample_rate, 0.9 * spec.stopband);
+  spec.ripple = ripple;
+  spec.attenuation = attenuation;
+  return spec;
+}
+
+// Offset of the IF stopband edge from the IF bandwidth. With the default
+// bandwidth the stopband starts at 196 kHz, so a station on the adjacent
+// channel 200 kHz away is suppressed.
+static const double if_stopband_offset = 100000;
+
+// IF filter: flat within 0.1 dB over the inner half of the IF bandwidth,
+// 55 dB down from the adjacent channel on. (Passband ripple turns into
+// crosstalk between the stereo channels.)
+static LowPassSpec if_filter_spec(double sample_rate_if,
+                                  double bandwidth_if) {
+  return filter_spec(sample_rate_if, 0.5 * bandwidth_if,
+                     bandwidth_if + if_stopband_offset, 0.1, 55);
+}
+
+// Baseband decimation filter: flat within 0.1 dB up to the RDS subcarrier,
+// 50 dB down where signals alias into that band.
+static LowPassSpec baseband_filter_spec(double sample_rate_if,
+                                        unsigned int downsample) {
+  return filter_spec(sample_rate_if, baseband_bandwidth,
+                     sample_rate_if / downsample - baseband_bandwidth, 0.1,
+                     50);
+}
+
+// Audio filter: flat within 0.1 dB over 90% of the audio bandwidth,
+// 60 dB down at the pilot and where signals alias into the audio band.
+static LowPassSpec audio_filter_spec(double sample_rate_baseband,
+                                     double sample_rate_pcm,
+                                     double bandwidth_pcm) {
+  double stopband = sample_rate_pcm - bandwidth_pcm;
+  if (bandwidth_pcm < FmDecoder::pilot_freq)
+    stopband = std::min(stopband, FmDecoder::pilot_freq);
+  return filter_spec(sample_rate_baseband, 0.9 * bandwidth_pcm, stopband, 0.1,
+                     60);
+}
+
+// Approximate multiply-accumulates per sample for plan_rates(), besides
+// the filters: fine tuner, discriminator and equalizer per IF sample;
+// level, pilot PLL and stereo demodulation per baseband sample.
+static const double if_sample_cost = 14;
+static const double baseband_sample_cost = 24;
+
+// Choose the decimation from IF to baseband rate.
+FmDecoder::RatePlan FmDecoder::plan_rates(double sample_rate_if,
+                                          double sample_rate_pcm,
+                                          double bandwidth_if) {
+  unsigned int max_downsample =
+      std::max(1, int(sample_rate_if / (2.2 * bandwidth_if)));
+  double if_taps = estimate_lowpass_taps(
+      if_filter_spec(sample_rate_if, bandwidth_if));
+  double bandwidth_pcm =
+      std::min(default_bandwidth_pcm, 0.45 * sample_rate_pcm);
+
+  RatePlan best = RatePlan();
+  for (unsigned int d = 1; d <= max_downsample; d++) {
+    RatePlan plan;
+    plan.downsample = d;
+    plan.exact = RationalResampler::find_ratio(
+        sample_rate_if, sample_rate_pcm * d, plan.interpolation,
+        plan.decimation);
+
+    // IF filter (I and Q) per IF sample, baseband decimation filter per
+    // baseband sample, and mono and stereo audio resamplers (taps of one
+    // polyphase branch) per audio frame.
+    double rate_baseband = sample_rate_if / d;
+    double cost = (if_sample_cost + 2 * if_taps) * sample_rate_if +
+                  baseband_sample_cost * rate_baseband;
+    if (d > 1) {
+      cost += estimate_lowpass_taps(baseband_filter_spec(sample_rate_if, d)) *
+              rate_baseband;
+    }
+    LowPassSpec audio =
+        audio_filter_spec(rate_baseband, sample_rate_pcm, bandwidth_pcm);
+    audio.passband /= plan.interpolation;
+    audio.stopband /= plan.interpolation;
+    double audio_taps =
+        ceil(double(estimate_lowpass_taps(audio)) / plan.interpolation);
+    plan.cost = cost / sample_rate_pcm + 2 * audio_taps;
+
+    if (d == 1 || (plan.exact && !best.exact) ||
+        (plan.exact == best.exact && plan.cost < best.cost))
+      best = plan;
+  }
+  return best;
+}
+
 FmDecoder::FmDecoder(double sample_rate_if, double ifeq_static_gain,
                      double ifeq_fit_factor, double tuning_offset,
                      double sample_rate_pcm, double deemphasis,
                      double bandwidth_if, double freq_dev, double bandwidth_pcm,
-                     unsigned int downsample, bool pilot_shift)
+                     unsigned int downsample, bool pilot_shift, bool rds,
+                     bool afc)
 
     // Initialize member fields
     : m_sample_rate_if(sample_rate_if),
       m_sample_rate_baseband(sample_rate_if / downsample),
-      m_tuning_table_size(finetuner_table_size),
-      m_tuning_shift(lrint(-double(finetuner_table_size) * tuning_offset /
+      m_pcm_step(pcm_step(sample_rate_if, sample_rate_pcm, downsample)),
+      m_tuning_table_size(afc ? afc_table_size : finetuner_table_size),
+      m_tuning_shift(lrint(-double(m_tuning_table_size) * tuning_offset /
                            sample_rate_if)),
       m_freq_dev(freq_dev), m_downsample(downsample),
-      m_pilot_shift(pilot_shift), m_stereo_detected(false), m_if_level(0),
-      m_baseband_mean(0), m_baseband_level(0)
+      m_pilot_shift(pilot_shift), m_rds_enabled(rds), m_afc_enabled(afc),
+      m_afc_shift(0),
+      m_stereo_detected(false), m_stereo_output(false), m_pcm_cnt(0),
+      m_if_cnt(0),
+      m_if_level(0), m_if_peak_level(0), m_baseband_mean(0), m_baseband_level(0),
+      m_buf_capacity(0), m_buf_baseband_capacity(0), m_buf_pcm_capacity(0),
+      m_buf_ping(), m_buf_pong(), m_buf_mono(NULL), m_buf_pilot_phasor(NULL)
 
       // Construct FineTuner
       ,
@@ -255,7 +623,7 @@ FmDecoder::FmDecoder(double sample_rate_if, double ifeq_static_gain,
 
       // Construct LowPassFilterFirIQ
       ,
-      m_iffilter(10, bandwidth_if / sample_rate_if)
+      m_iffilter(if_filter_spec(sample_rate_if, bandwidth_if))
 
       // Construct PhaseDiscriminator
       ,
@@ -267,7 +635,8 @@ FmDecoder::FmDecoder(double sample_rate_if, double ifeq_static_gain,
 
       // Construct DownsampleFilter for baseband
       ,
-      m_resample_baseband(8 * downsample, 0.4 / downsample, downsample, true)
+      m_resample_baseband(baseband_filter_spec(sample_rate_if, downsample),
+                          downsample, true)
 
       // Construct PilotPhaseLock
       ,
@@ -275,19 +644,21 @@ FmDecoder::FmDecoder(double sample_rate_if, double ifeq_static_gain,
                  50 / m_sample_rate_baseband,         // bandwidth
                  0.01)                                // minsignal (was 0.04)
 
-      // Construct DownsampleFilter for mono channel
+      // Construct RationalResampler for mono channel
       ,
-      m_resample_mono(int(m_sample_rate_baseband / 1000.0),     // filter_order
-                      bandwidth_pcm / m_sample_rate_baseband,   // cutoff
-                      m_sample_rate_baseband / sample_rate_pcm, // downsample
-                      false) // integer_factor
+      m_resample_mono(sample_rate_if,               // rate_in
+                      sample_rate_pcm * downsample, // rate_out
+                      audio_filter_spec(m_sample_rate_baseband,
+                                        sample_rate_pcm,
+                                        bandwidth_pcm)) // spec
 
-      // Construct DownsampleFilter for stereo channel
+      // Construct RationalResampler for stereo channel
       ,
-      m_resample_stereo(int(m_sample_rate_baseband / 1000.0),   // filter_order
-                        bandwidth_pcm / m_sample_rate_baseband, // cutoff
-                        m_sample_rate_baseband / sample_rate_pcm, // downsample
-                        false) // integer_factor
+      m_resample_stereo(sample_rate_if,               // rate_in
+                        sample_rate_pcm * downsample, // rate_out
+                        audio_filter_spec(m_sample_rate_baseband,
+                                          sample_rate_pcm,
+                                          bandwidth_pcm)) // spec
 
       // Construct HighPassFilterIir
       ,
@@ -296,88 +667,220 @@ FmDecoder::FmDecoder(double sample_rate_if, double ifeq_static_gain,
 
       // Construct LowPassFilterRC
       ,
-      m_deemph_mono(
-          (deemphasis == 0) ? 1.0 : (deemphasis * sample_rate_pcm * 1.0e-6)),
-      m_deemph_stereo(
-          (deemphasis == 0) ? 1.0 : (deemphasis * sample_rate_pcm * 1.0e-6))
+      m_deemph((deemphasis == 0) ? 1.0
+                                 : (deemphasis * sample_rate_pcm * 1.0e-6))
+
+      // Construct RdsDecoder
+      ,
+      m_rds(m_sample_rate_baseband)
+
+      // Construct StageProfiler with a window of one second
+      ,
+      m_profiler(std::uint64_t(sample_rate_if))
 
 {
   // nothing more to do
 }
 
+// Return the maximum number of audio samples for n IQ samples.
+unsigned int FmDecoder::max_output_size(unsigned int n) const {
+  unsigned int n_baseband =
+      (m_downsample > 1) ? m_resample_baseband.max_output_size(n) : n;
+  return 2 * m_resample_mono.max_output_size(n_baseband);
+}
+
+// Allocate the working buffers for blocks of up to n IQ samples.
+void FmDecoder::reserve(unsigned int n) {
+  if (n <= m_buf_capacity)
+    return;
+
+  // Measure the layout, then allocate and carve it.
+  // (m_buf_capacity stays 0 if the allocation fails.)
+  m_buf_capacity = 0;
+  m_arena.clear();
+  carve_buffers(n);
+  m_arena.allocate(m_arena.size());
+  carve_buffers(n);
+  m_buf_capacity = n;
+}
+
+// Carve the working buffers for blocks of n IQ samples.
+// The baseband and audio lengths are bounded independently of the
+// resampling positions, so the layout holds for every block.
+void FmDecoder::carve_buffers(unsigned int n) {
+  m_buf_baseband_capacity = (m_downsample > 1) ? n / m_downsample + 2 : n;
+  m_buf_pcm_capacity =
+      std::uint64_t(m_buf_baseband_capacity) *
+          m_resample_mono.get_interpolation() /
+          m_resample_mono.get_decimation() +
+      1;
+
+  // Each of the two stage buffers holds n IQ samples as I/Q planes, or
+  // a real signal of up to n IF, baseband or audio samples.
+  std::size_t plane = BufferArena::padded(n * sizeof(IQSample::value_type));
+  std::size_t len =
+      std::max(n, std::max(m_buf_baseband_capacity, m_buf_pcm_capacity));
+  std::size_t size = std::max(2 * plane, len * sizeof(Sample));
+  StageBuffer *bufs[2] = {&m_buf_ping, &m_buf_pong};
+  for (StageBuffer *buf : bufs) {
+    char *p = m_arena.take<char>(size);
+    buf->i = reinterpret_cast<IQSample::value_type *>(p);
+    buf->q = (p != NULL) ? reinterpret_cast<IQSample::value_type *>(p + plane)
+                         : NULL;
+    buf->x = reinterpret_cast<Sample *>(p);
+  }
+  m_buf_mono = m_arena.take<Sample>(m_buf_pcm_capacity);
+  m_buf_pilot_phasor =
+      m_rds_enabled ? m_arena.take<IQSample>(m_buf_baseband_capacity) : NULL;
+}
+
 void FmDecoder::process(const IQSampleVector &samples_in, SampleVector &audio) {
+  unsigned int n = samples_in.size();
+  audio.resize(max_output_size(n));
+  audio.resize(process(samples_in.data(), n, audio.data(), audio.size()));
+}
+
+void FmDecoder::process(const IQBlock &samples_in, SampleVector &audio) {
+  unsigned int n = samples_in.size();
+  audio.resize(max_output_size(n));
+  audio.resize(process(samples_in.i.data(), samples_in.q.data(), n,
+                       audio.data(), audio.size()));
+}
+
+unsigned int FmDecoder::process(const IQSample *samples_in, unsigned int n,
+                                Sample *audio, unsigned int out_capacity) {
+  // Convert to separate I/Q planes for the front-end kernels.
+  // (The fine tuner then runs in place on them.)
+  reserve(n);
+  kernels().deinterleave(
+      reinterpret_cast<const IQSample::value_type *>(samples_in),
+      m_buf_ping.i, m_buf_ping.q, n);
+  return process(m_buf_ping.i, m_buf_ping.q, n, audio, out_capacity);
+}
+
+unsigned int FmDecoder::process(const IQSample::value_type *in_i,
+                                const IQSample::value_type *in_q,
+                                unsigned int n, Sample *audio,
+                                unsigned int out_capacity) {
+
+  reserve(n);
+  m_profiler.begin_block(n);
+
+  // The stages run in place where they can and otherwise alternate
+  // between the two stage buffers, so a block only occupies two buffers
+  // of the IF block size (plus the much shorter audio and RDS buffers).
+  StageBuffer *cur = &m_buf_ping;
+  StageBuffer *other = &m_buf_pong;
 
   // Fine tuning.
-  m_finetuner.process(samples_in, m_buf_iftuned);
+  m_finetuner.process(in_i, in_q, n, cur->i, cur->q);
+  m_profiler.mark(DecoderStage::FINETUNER);
   // Low pass filter to isolate station.
-  m_iffilter.process(m_buf_iftuned, m_buf_iffiltered);
-  // Measure IF peak level.
-  m_if_level = peak_level_approx(m_buf_iffiltered);
-  // Extract carrier frequency.
-  m_phasedisc.process(m_buf_iffiltered, m_buf_baseband_raw);
+  m_iffilter.process(cur->i, cur->q, n, other->i, other->q);
+  std::swap(cur, other);
+  m_profiler.mark(DecoderStage::IF_FILTER);
+  // Extract carrier frequency, and measure the IF level on the way.
+  m_phasedisc.process(cur->i, cur->q, n, other->x);
+  std::swap(cur, other);
+  if (n > 0) {
+    m_if_level = m_phasedisc.get_rms_level();
+    m_if_peak_level = m_phasedisc.get_peak_level();
+  }
+  m_profiler.mark(DecoderStage::PHASE_DISC);
   // Compensate 0th-hold aperture effect
   // by applying the equalizer to the discriminator output.
-  m_disceq.process(m_buf_baseband_raw, m_buf_baseband);
+  // The stage which produces the final baseband signal also measures
+  // its level.
+  SampleStats stats;
+  m_disceq.process(cur->x, n, cur->x, (m_downsample > 1) ? NULL : &stats);
+  m_profiler.mark(DecoderStage::DISC_EQ);
 
   // Downsample baseband signal to reduce processing.
+  unsigned int n_baseband = n;
   if (m_downsample > 1) {
-    SampleVector tmp(move(m_buf_baseband));
-    m_resample_baseband.process(tmp, m_buf_baseband);
+    n_baseband = m_resample_baseband.process(
+        cur->x, n, other->x, m_buf_baseband_capacity, &stats);
+    std::swap(cur, other);
   }
-
-  // Measure baseband level.
-  double baseband_mean, baseband_rms;
-  samples_mean_rms(m_buf_baseband, baseband_mean, baseband_rms);
-  m_baseband_mean = 0.95 * m_baseband_mean + 0.05 * baseband_mean;
-  m_baseband_level = 0.95 * m_baseband_level + 0.05 * baseband_rms;
+  m_profiler.mark(DecoderStage::RESAMPLE_BASEBAND);
+  Sample *baseband = cur->x;
+  Sample *rawstereo = other->x;
+
+  // Update baseband level.
+  // Average with a time constant of 1 second regardless of block length.
+  if (n_baseband > 0) {
+    double alpha = 1.0 - exp(-double(n_baseband) / m_sample_rate_baseband);
+    m_baseband_mean += alpha * (stats.mean() - m_baseband_mean);
+    m_baseband_level += alpha * (stats.rms() - m_baseband_level);
+    if (m_afc_enabled)
+      update_afc();
+  }
+  m_profiler.mark(DecoderStage::BASEBAND_LEVEL);
 
   // Lock on stereo pilot,
   // and remove locked 19kHz tone from the composite signal.
-  m_pilotpll.process(m_buf_baseband, m_buf_rawstereo, m_pilot_shift);
+  m_pilotpll.process(baseband, n_baseband, rawstereo, m_pilot_shift,
+                     m_buf_pilot_phasor);
   m_stereo_detected = m_pilotpll.locked();
+  m_profiler.mark(DecoderStage::PILOT_PLL);
+
+  // Decode RDS on the 57kHz subcarrier.
+  if (m_rds_enabled) {
+    m_rds.process(baseband, n_baseband, m_buf_pilot_phasor,
+                  m_stereo_detected);
+  }
+  m_profiler.mark(DecoderStage::RDS);
 
   // Extract mono audio signal.
-  m_resample_mono.process(m_buf_baseband, m_buf_mono);
+  unsigned int n_mono = m_resample_mono.process(baseband, n_baseband,
+                                                m_buf_mono, m_buf_pcm_capacity);
   // DC blocking
-  m_dcblock_mono.process_inplace(m_buf_mono);
+  m_dcblock_mono.process(m_buf_mono, n_mono, m_buf_mono);
+  m_profiler.mark(DecoderStage::RESAMPLE_MONO);
 
-  // Demodulate stereo signal.
-  demod_stereo(m_buf_baseband, m_buf_rawstereo);
+  // Demodulate stereo signal (in place).
+  demod_stereo(baseband, n_baseband, rawstereo);
+  m_profiler.mark(DecoderStage::DEMOD_STEREO);
 
   // Extract audio and downsample.
   // NOTE: This MUST be done even if no stereo signal is detected yet,
   // because the downsamplers for mono and stereo signal must be
   // kept in sync.
-  m_resample_stereo.process(m_buf_rawstereo, m_buf_stereo);
+  // (The baseband signal is no longer needed, so its buffer receives
+  // the stereo audio.)
+  Sample *stereo = baseband;
+  unsigned int n_stereo = m_resample_stereo.process(
+      rawstereo, n_baseband, stereo, m_buf_pcm_capacity);
+  assert(n_stereo == n_mono);
+  (void)n_stereo;
   // DC blocking
-  m_dcblock_stereo.process_inplace(m_buf_stereo);
+  m_dcblock_stereo.process(stereo, n_mono, stereo);
+  m_profiler.mark(DecoderStage::RESAMPLE_STEREO);
 
-  if (m_stereo_detected) {
-    if (m_pilot_shift) {
-      // Duplicate L-R shifted output in left/right channels.
-      mono_to_left_right(m_buf_stereo, audio);
-    } else {
-      // Extract left/right channels from (L+R) / (L-R) signals.
-      stereo_to_left_right(m_buf_mono, m_buf_stereo, audio);
-    }
-    // Stereo deemphasis to L and R
-    m_deemph_stereo.process_interleaved_inplace(audio);
-  } else {
-    if (m_pilot_shift) {
-      // Fill zero output in left/right channels.
-      zero_to_left_right(m_buf_stereo, audio);
-    } else {
-      // Mono deemphasis
-      m_deemph_mono.process_inplace(m_buf_mono);
-      // Duplicate mono signal in left/right channels.
-      mono_to_left_right(m_buf_mono, audio);
-    }
+  // Convert pilot lock changes to PCM sample indices.
+  for (std::uint64_t idx : m_pilotpll.get_lock_changes()) {
+    m_pcm_lock_changes.push_back(std::uint64_t(ceil(idx / m_pcm_step)));
   }
+
+  // Extract left/right channels.
+  unsigned int n_audio = 2 * n_mono;
+  assert(n_audio <= out_capacity);
+  (void)out_capacity;
+  make_left_right(m_buf_mono, stereo, n_mono, audio);
+
+  // Deemphasis of L and R.
+  m_deemph.process_interleaved(audio, n_audio, audio);
+  m_profiler.mark(DecoderStage::AUDIO_OUTPUT);
+
+  m_if_cnt += n;
+  m_profiler.end_block();
+
+  return n_audio;
 }
 
 // Demodulate stereo L-R signal.
-void FmDecoder::demod_stereo(const SampleVector &samples_baseband,
-                             SampleVector &samples_rawstereo) {
+void FmDecoder::demod_stereo(const Sample *samples_baseband, unsigned int n,
+                             Sample *samples_rawstereo) {
   // Multiply the baseband signal with the double-frequency pilot
   // and multiply by 2.00 to get the full amplitude.
   // Note: F4EXB claims the multiplication constant
@@ -387,21 +890,118 @@ void FmDecoder::demod_stereo(const SampleVector &samples_baseband,
   //  https://github.com/f4exb/ngsoftfm/issues/3#issuecomment-453958956
   //  for the details)
 
-  unsigned int n = samples_baseband.size();
-  assert(n == samples_rawstereo.size());
-
   for (unsigned int i = 0; i < n; i++) {
     samples_rawstereo[i] *= 2.00 * samples_baseband[i];
   }
 }
 
-// Duplicate mono signal in left/right channels.
-void FmDecoder::mono_to_left_right(const SampleVector &samples_mono,
-                                   SampleVector &audio) {
-  unsigned int n = samples_mono.size();
+// Change the frequency offset of the station.
+std::uint64_t FmDecoder::retune(double tuning_offset, bool new_station) {
+  m_tuning_shift =
+      lrint(-double(m_tuning_table_size) * tuning_offset / m_sample_rate_if);
+  m_finetuner.set_freq_shift(m_tuning_shift + m_afc_shift);
+
+  if (new_station) {
+    // Switch the output to mono where the new station starts, after any
+    // pending lock changes of the previous station.
+    if (m_pilotpll.locked()) {
+      m_pcm_lock_changes.push_back(std::uint64_t(
+          ceil(m_pilotpll.get_sample_count() / m_pcm_step)));
+    }
+    m_pilotpll.reset();
+    m_stereo_detected = false;
+    m_baseband_mean = 0;
+    if (m_rds_enabled)
+      m_rds.reset();
+  }
 
-  audio.resize(2 * n);
-  for (unsigned int i = 0; i < n; i++) {
+  return m_if_cnt;
+}
+
+// Return the largest fine tuner correction of the AFC in table steps.
+int FmDecoder::afc_max_shift() const {
+  if (!m_afc_enabled)
+    return 0;
+  return int(afc_range * m_tuning_table_size / m_sample_rate_if);
+}
+
+// Re-centre the fine tuner on the measured carrier offset.
+void FmDecoder::update_afc() {
+  // The carrier offset is averaged over about 1 second; retune only when
+  // it is off by most of a tuner step, so noise does not toggle the
+  // tuner between two steps.
+  double target =
+      -m_tuning_table_size * get_tuning_offset() / m_sample_rate_if;
+  int shift = m_tuning_shift + m_afc_shift;
+  if (fabs(target - shift) < 0.75)
+    return;
+
+  int range = afc_max_shift();
+  int afc_shift = std::min(range, std::max(-range, int(lrint(target)) -
+                                                       m_tuning_shift));
+  if (afc_shift == m_afc_shift)
+    return;
+
+  // The step in carrier frequency is known exactly, so remove it from
+  // the offset estimate instead of waiting for the average to follow.
+  double step = -(afc_shift - m_afc_shift) * m_sample_rate_if /
+                double(m_tuning_table_size);
+  m_baseband_mean -= step / m_freq_dev;
+  m_afc_shift = afc_shift;
+  m_finetuner.set_freq_shift(m_tuning_shift + m_afc_shift);
+}
+
+// Build interleaved left/right output.
+void FmDecoder::make_left_right(const Sample *samples_mono,
+                                const Sample *samples_stereo, unsigned int n,
+                                Sample *audio) {
+  unsigned int i = 0;
+  while (i < n) {
+    // Find the end of the segment with constant stereo status.
+    unsigned int end = n;
+    bool toggle = false;
+    if (!m_pcm_lock_changes.empty()) {
+      std::uint64_t k = m_pcm_lock_changes.front();
+      if (k < m_pcm_cnt + n) {
+        end = (k > m_pcm_cnt + i) ? (unsigned int)(k - m_pcm_cnt) : i;
+        toggle = true;
+      }
+    }
+
+    if (m_stereo_output) {
+      if (m_pilot_shift) {
+        // Duplicate L-R shifted output in left/right channels.
+        mono_to_left_right(samples_stereo, audio, i, end);
+      } else {
+        // Extract left/right channels from (L+R) / (L-R) signals.
+        stereo_to_left_right(samples_mono, samples_stereo, audio, i,
+                             end);
+      }
+    } else {
+      if (m_pilot_shift) {
+        // Fill zero output in left/right channels.
+        zero_to_left_right(audio, i, end);
+      } else {
+        // Duplicate mono signal in left/right channels.
+        mono_to_left_right(samples_mono, audio, i, end);
+      }
+    }
+
+    if (toggle) {
+      m_stereo_output = !m_stereo_output;
+      m_pcm_lock_changes.pop_front();
+    }
+    i = end;
+  }
+
+  m_pcm_cnt += n;
+}
+
+// Duplicate mono signal in left/right channels.
+void FmDecoder::mono_to_left_right(const Sample *samples_mono,
+                                   Sample *audio, unsigned int begin,
+                                   unsigned int end) {
+  for (unsigned int i = begin; i < end; i++) {
     Sample m = samples_mono[i];
     audio[2 * i] = m;
     audio[2 * i + 1] = m;
@@ -409,14 +1009,11 @@ void FmDecoder::mono_to_left_right(const SampleVector &samples_mono,
 }
 
 // Extract left/right channels from (L+R) / (L-R) signals.
-void FmDecoder::stereo_to_left_right(const SampleVector &samples_mono,
-                                     const SampleVector &samples_stereo,
-                                     SampleVector &audio) {
-  unsigned int n = samples_mono.size();
-  assert(n == samples_stereo.size());
-
-  audio.resize(2 * n);
-  for (unsigned int i = 0; i < n; i++) {
+void FmDecoder::stereo_to_left_right(const Sample *samples_mono,
+                                     const Sample *samples_stereo,
+                                     Sample *audio, unsigned int begin,
+                                     unsigned int end) {
+  for (unsigned int i = begin; i < end; i++) {
     Sample m = samples_mono[i];
     Sample s = samples_stereo[i];
     audio[2 * i] = m + s;
@@ -425,16 +1022,106 @@ void FmDecoder::stereo_to_left_right(const SampleVector &samples_mono,
 }
 
 // Fill zero signal in left/right channels.
-// (samples_mono used for the size determination only)
-void FmDecoder::zero_to_left_right(const SampleVector &samples_mono,
-                                   SampleVector &audio) {
-  unsigned int n = samples_mono.size();
-
-  audio.resize(2 * n);
-  for (unsigned int i = 0; i < n; i++) {
+void FmDecoder::zero_to_left_right(Sample *audio, unsigned int begin,
+                                   unsigned int end) {
+  for (unsigned int i = begin; i < end; i++) {
     audio[2 * i] = 0.0;
     audio[2 * i + 1] = 0.0;
   }
 }
 
+// Save the complete decoder state.
+void FmDecoder::save_state(std::vector<std::uint8_t> &data) const {
+  data.clear();
+  StateWriter w(data);
+
+  // Header and the parameters which determine the state layout.
+  w.put(state_magic);
+  w.put(state_version);
+  w.put(m_sample_rate_if);
+  w.put(m_pcm_step);
+  w.put(m_tuning_table_size);
+  w.put(m_tuning_shift);
+  w.put(m_downsample);
+  w.put(m_rds_enabled);
+  w.put(m_afc_enabled);
+
+  w.put(m_afc_shift);
+  w.put(m_stereo_detected);
+  w.put(m_stereo_output);
+  w.put(m_pcm_cnt);
+  w.put(m_pcm_lock_changes);
+  w.put(m_if_cnt);
+  w.put(m_if_level);
+  w.put(m_if_peak_level);
+  w.put(m_baseband_mean);
+  w.put(m_baseband_level);
+
+  m_finetuner.save_state(w);
+  m_iffilter.save_state(w);
+  m_phasedisc.save_state(w);
+  m_disceq.save_state(w);
+  m_resample_baseband.save_state(w);
+  m_pilotpll.save_state(w);
+  m_resample_mono.save_state(w);
+  m_resample_stereo.save_state(w);
+  m_dcblock_mono.save_state(w);
+  m_dcblock_stereo.save_state(w);
+  m_deemph.save_state(w);
+  if (m_rds_enabled)
+    m_rds.save_state(w);
+}
+
+// Restore the complete decoder state.
+bool FmDecoder::restore_state(const std::uint8_t *data, std::size_t size) {
+  // Validate the whole snapshot first, so that a bad one leaves the
+  // decoder unchanged.
+  StateReader check(data, size, true);
+  read_state(check);
+  if (!check.ok() || !check.at_end())
+    return false;
+
+  StateReader r(data, size, false);
+  read_state(r);
+  return r.ok();
+}
+
+// Read the decoder state (or only check it).
+void FmDecoder::read_state(StateReader &r) {
+  r.expect(state_magic);
+  r.expect(state_version);
+  r.expect(m_sample_rate_if);
+  r.expect(m_pcm_step);
+  r.expect(m_tuning_table_size);
+  r.expect(m_tuning_shift);
+  r.expect(m_downsample);
+  r.expect(m_rds_enabled);
+  r.expect(m_afc_enabled);
+
+  r.get(m_afc_shift, -afc_max_shift(), afc_max_shift());
+  r.get(m_stereo_detected);
+  r.get(m_stereo_output);
+  r.get(m_pcm_cnt);
+  r.get(m_pcm_lock_changes);
+  r.get(m_if_cnt);
+  r.get(m_if_level);
+  r.get(m_if_peak_level);
+  r.get(m_baseband_mean);
+  r.get(m_baseband_level);
+
+  m_finetuner.restore_state(r);
+  m_iffilter.restore_state(r);
+  m_phasedisc.restore_state(r);
+  m_disceq.restore_state(r);
+  m_resample_baseband.restore_state(r);
+  m_pilotpll.restore_state(r);
+  m_resample_mono.restore_state(r);
+  m_resample_stereo.restore_state(r);
+  m_dcblock_mono.restore_state(r);
+  m_dcblock_stereo.restore_state(r);
+  m_deemph.restore_state(r);
+  if (m_rds_enabled)
+    m_rds.restore_state(r);
+}
+
 // end
@@ -0,0 +1,185 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include "DecoderState.h"
+#include "FmDecode.h"
+#include "IqArchive.h"
+
+// Convert a sample back to the unsigned 8-bit value of the device
+// (exact inverse of the conversion in RtlSdrSource).
+static inline std::uint8_t to_u8(IQSample::value_type v) {
+  long u = lrintf(v * 128.0f) + 128;
+  return std::uint8_t(std::min(255L, std::max(0L, u)));
+}
+
+// class IqArchiveWriter
+
+// Create archive file and write the header.
+IqArchiveWriter::IqArchiveWriter(const std::string &filename,
+                                 const IqArchive::Info &info,
+                                 std::uint64_t chunk_samples)
+    : m_file(NULL), m_chunk_samples(std::max<std::uint64_t>(1, chunk_samples)),
+      m_sample_count(0), m_frame_base(0), m_have_frame_base(false),
+      m_chunk_open(false) {
+  m_file = fopen(filename.c_str(), "wb");
+  if (m_file == NULL) {
+    m_error = "can not open '" + filename + "' (" + strerror(errno) + ")";
+    return;
+  }
+
+  std::vector<std::uint8_t> header;
+  StateWriter w(header);
+  for (char c : IqArchive::file_magic)
+    w.put(c);
+  w.put(IqArchive::version);
+  w.put(IqArchive::format_u8);
+  w.put(info.sample_rate);
+  w.put(info.frequency);
+  w.put(info.station);
+  w.put(info.gain);
+  w.put(info.decoder_flags);
+  w.put(info.start_time);
+  write_bytes(header.data(), header.size());
+}
+
+// Finish and close the archive.
+IqArchiveWriter::~IqArchiveWriter() { close(); }
+
+// Write n bytes.
+bool IqArchiveWriter::write_bytes(const void *data, std::size_t n) {
+  if (fwrite(data, 1, n, m_file) != n) {
+    m_error = std::string("write error (") + strerror(errno) + ")";
+    return false;
+  }
+  return true;
+}
+
+// Start a new chunk with an optional decoder checkpoint.
+bool IqArchiveWriter::begin_chunk(const FmDecoder *decoder) {
+  m_state.clear();
+  std::uint64_t frame = 0;
+  if (decoder != NULL) {
+    if (!m_have_frame_base && m_sample_count == 0) {
+      m_frame_base = decoder->get_pcm_count();
+      m_have_frame_base = true;
+    }
+    if (m_have_frame_base) {
+      decoder->save_state(m_state);
+      frame = decoder->get_pcm_count() - m_frame_base;
+    }
+  }
+
+  IndexEntry entry;
+  entry.first_sample = m_sample_count;
+  entry.offset = ftello(m_file);
+  entry.nsamples = 0;
+  entry.state_size = m_state.size();
+
+  // The sample count is written again when the chunk ends; a reader of
+  // an unfinished archive takes the last chunk up to the end of the file.
+  std::vector<std::uint8_t> header;
+  StateWriter w(header);
+  w.put(IqArchive::chunk_magic);
+  w.put(entry.state_size);
+  w.put(entry.first_sample);
+  w.put(entry.nsamples);
+  w.put(std::uint32_t(0)); // reserved
+  w.put(frame);
+  if (!write_bytes(header.data(), header.size()) ||
+      !write_bytes(m_state.data(), m_state.size()))
+    return false;
+
+  m_index.push_back(entry);
+  m_chunk_open = true;
+  return true;
+}
+
+// Write the final sample count of the current chunk.
+bool IqArchiveWriter::end_chunk() {
+  m_chunk_open = false;
+  const IndexEntry &entry = m_index.back();
+  off_t end = ftello(m_file);
+
+  // Sample count follows the magic, state size and first sample.
+  if (fseeko(m_file, off_t(entry.offset + 16), SEEK_SET) != 0 ||
+      !write_bytes(&entry.nsamples, sizeof(entry.nsamples)) ||
+      fseeko(m_file, end, SEEK_SET) != 0) {
+    if (m_error.empty())
+      m_error = std::string("seek failed (") + strerror(errno) + ")";
+    return false;
+  }
+  return true;
+}
+
+// Append a block of IQ samples.
+bool IqArchiveWriter::write(const IQBlock &samples,
+                            const FmDecoder *decoder) {
+  if (!(*this))
+    return false;
+  if (samples.empty())
+    return true;
+
+  // Start a new chunk once the current one is long enough, so chunks
+  // always begin at a block boundary where the decoder state is known.
+  if (m_chunk_open &&
+      (m_index.back().nsamples >= m_chunk_samples ||
+       m_index.back().nsamples + samples.size() > UINT32_MAX)) {
+    if (!end_chunk())
+      return false;
+  }
+  if (!m_chunk_open && !begin_chunk(decoder))
+    return false;
+
+  // Interleave the planes back into the device format.
+  unsigned int n = samples.size();
+  m_buf.resize(2 * n);
+  for (unsigned int k = 0; k < n; k++) {
+    m_buf[2 * k] = to_u8(samples.i[k]);
+    m_buf[2 * k + 1] = to_u8(samples.q[k]);
+  }
+  if (!write_bytes(m_buf.data(), m_buf.size()))
+    return false;
+
+  m_index.back().nsamples += n;
+  m_sample_count += n;
+  return true;
+}
+
+// Write the index and close the file.
+bool IqArchiveWriter::close() {
+  if (m_file == NULL)
+    return m_error.empty();
+
+  bool ok = m_error.empty();
+  if (ok && m_chunk_open)
+    ok = end_chunk();
+
+  if (ok) {
+    std::vector<std::uint8_t> tail;
+    StateWriter w(tail);
+    std::uint64_t index_offset = ftello(m_file);
+    for (const IndexEntry &e : m_index) {
+      w.put(e.first_sample);
+      w.put(e.offset);
+      w.put(e.nsamples);
+      w.put(e.state_size);
+    }
+    w.put(index_offset);
+    w.put(std::uint32_t(m_index.size()));
+    w.put(IqArchive::trailer_magic);
+    ok = write_bytes(tail.data(), tail.size());
+  }
+
+  if (fclose(m_file) != 0 && ok) {
+    m_error = std::string("write error (") + strerror(errno) + ")";
+    ok = false;
+  }
+  m_file = NULL;
+  return ok;
+}
+
+// end
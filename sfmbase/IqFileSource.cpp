@@ -0,0 +1,291 @@
+#define _FILE_OFFSET_BITS 64
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+#include "DecoderState.h"
+#include "IqFileSource.h"
+#include "Kernels.h"
+
+// Open IQ file.
+IqFileSource::IqFileSource(const std::string &filename,
+                           unsigned int block_length)
+    : m_file(NULL), m_block_length(std::max(1u, block_length)),
+      m_sample_count(0), m_position(0), m_buf(2 * m_block_length),
+      m_archive(false), m_info(), m_chunk(0) {
+  m_file = fopen(filename.c_str(), "rb");
+  if (m_file == NULL) {
+    m_error = "can not open '" + filename + "' (" + strerror(errno) + ")";
+    return;
+  }
+
+  struct stat st;
+  if (fstat(fileno(m_file), &st) != 0 || !S_ISREG(st.st_mode))
+    return;
+  m_sample_count = std::uint64_t(st.st_size) / 2;
+
+  // Recognize IQ archives by their magic.
+  char magic[sizeof(IqArchive::file_magic)];
+  if (fread(magic, 1, sizeof(magic), m_file) == sizeof(magic) &&
+      memcmp(magic, IqArchive::file_magic, sizeof(magic)) == 0) {
+    m_archive = true;
+    if (!open_archive(st.st_size))
+      return;
+  }
+  seek(0);
+}
+
+// Close IQ file.
+IqFileSource::~IqFileSource() {
+  if (m_file)
+    fclose(m_file);
+}
+
+// Read n bytes at file offset.
+bool IqFileSource::read_at(std::uint64_t offset, void *data, std::size_t n) {
+  if (fseeko(m_file, off_t(offset), SEEK_SET) != 0 ||
+      fread(data, 1, n, m_file) != n) {
+    m_error = std::string("read error (") +
+              (ferror(m_file) ? strerror(errno) : "unexpected end of file") +
+              ")";
+    return false;
+  }
+  return true;
+}
+
+// Read the archive header and index.
+bool IqFileSource::open_archive(std::uint64_t file_size) {
+  std::uint8_t header[IqArchive::header_size];
+  if (!read_at(0, header, sizeof(header)))
+    return false;
+
+  StateReader r(header, sizeof(header), false);
+  for (char c : IqArchive::file_magic)
+    r.expect(c);
+  r.expect(IqArchive::version);
+  r.expect(IqArchive::format_u8);
+  r.get(m_info.sample_rate);
+  r.get(m_info.frequency);
+  r.get(m_info.station);
+  r.get(m_info.gain);
+  r.get(m_info.decoder_flags); // reserved (zero) in older archives
+  r.get(m_info.start_time);
+  if (!r.ok()) {
+    m_error = "unsupported IQ archive version";
+    return false;
+  }
+
+  // Use the index if the archive was finished properly.
+  bool indexed = false;
+  std::uint8_t trailer[IqArchive::trailer_size];
+  if (file_size >= IqArchive::header_size + IqArchive::trailer_size &&
+      read_at(file_size - sizeof(trailer), trailer, sizeof(trailer))) {
+    std::uint64_t index_offset = 0;
+    std::uint32_t count = 0;
+    StateReader t(trailer, sizeof(trailer), false);
+    t.get(index_offset);
+    t.get(count);
+    t.expect(IqArchive::trailer_magic);
+    if (t.ok() && index_offset >= IqArchive::header_size &&
+        index_offset + std::uint64_t(count) * IqArchive::index_entry_size +
+                IqArchive::trailer_size ==
+            file_size) {
+      std::vector<std::uint8_t> index(count * IqArchive::index_entry_size);
+      indexed = read_at(index_offset, index.data(), index.size());
+      StateReader x(index.data(), index.size(), false);
+      std::uint64_t next_sample = 0;
+      for (std::uint32_t k = 0; k < count && indexed; k++) {
+        Chunk c;
+        x.get(c.first_sample);
+        x.get(c.offset);
+        x.get(c.nsamples);
+        x.get(c.state_size);
+        indexed = x.ok() && c.first_sample == next_sample &&
+                  c.offset + IqArchive::chunk_header_size + c.state_size +
+                          2 * std::uint64_t(c.nsamples) <=
+                      index_offset;
+        m_chunks.push_back(c);
+        next_sample += c.nsamples;
+      }
+    }
+  }
+  m_error.clear();
+
+  if (!indexed && !scan_archive(file_size))
+    return false;
+
+  m_sample_count = 0;
+  if (!m_chunks.empty())
+    m_sample_count = m_chunks.back().first_sample + m_chunks.back().nsamples;
+  return true;
+}
+
+// Rebuild the index of an unfinished archive.
+bool IqFileSource::scan_archive(std::uint64_t file_size) {
+  m_chunks.clear();
+  std::uint64_t offset = IqArchive::header_size;
+  std::uint64_t next_sample = 0;
+
+  while (offset + IqArchive::chunk_header_size <= file_size) {
+    std::uint8_t header[IqArchive::chunk_header_size];
+    if (!read_at(offset, header, sizeof(header)))
+      return false;
+
+    Chunk c;
+    c.offset = offset;
+    StateReader r(header, sizeof(header), false);
+    r.expect(IqArchive::chunk_magic);
+    r.get(c.state_size);
+    r.get(c.first_sample);
+    r.get(c.nsamples);
+    std::uint64_t data = offset + sizeof(header) + c.state_size;
+    if (!r.ok() || c.first_sample != next_sample || data > file_size)
+      break;
+
+    // The last chunk of an unfinished archive has no sample count.
+    std::uint64_t avail = (file_size - data) / 2;
+    if (c.nsamples == 0 || c.nsamples > avail)
+      c.nsamples = std::min<std::uint64_t>(avail, UINT32_MAX);
+
+    m_chunks.push_back(c);
+    offset = data + 2 * std::uint64_t(c.nsamples);
+    next_sample += c.nsamples;
+  }
+
+  return true;
+}
+
+// Return the index of the chunk holding a sample.
+unsigned int IqFileSource::find_chunk(std::uint64_t position) const {
+  unsigned int lo = 0, hi = m_chunks.size();
+  while (hi - lo > 1) {
+    unsigned int mid = (lo + hi) / 2;
+    if (m_chunks[mid].first_sample <= position)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Return the file offset of a sample.
+std::uint64_t IqFileSource::sample_offset(std::uint64_t position) const {
+  if (!m_archive)
+    return 2 * position;
+  if (m_chunks.empty())
+    return IqArchive::header_size;
+  const Chunk &c = m_chunks[find_chunk(position)];
+  return c.offset + IqArchive::chunk_header_size + c.state_size +
+         2 * (position - c.first_sample);
+}
+
+// Continue reading at the specified sample index.
+bool IqFileSource::seek(std::uint64_t position) {
+  if (!m_file)
+    return false;
+
+  if (fseeko(m_file, off_t(sample_offset(position)), SEEK_SET) != 0) {
+    m_error = std::string("seek failed (") + strerror(errno) + ")";
+    return false;
+  }
+
+  m_position = position;
+  m_chunk = find_chunk(position);
+  return true;
+}
+
+// Read the last decoder checkpoint at or before a sample.
+bool IqFileSource::get_checkpoint(std::uint64_t position,
+                                  IqArchive::Checkpoint &checkpoint) {
+  if (!m_archive || m_chunks.empty())
+    return false;
+
+  int k = find_chunk(position);
+  while (k >= 0 && m_chunks[k].state_size == 0)
+    k--;
+  if (k < 0)
+    return false;
+
+  const Chunk &c = m_chunks[k];
+  std::uint8_t header[IqArchive::chunk_header_size];
+  checkpoint.sample = c.first_sample;
+  checkpoint.state.resize(c.state_size);
+  bool ok = read_at(c.offset, header, sizeof(header)) &&
+            read_at(c.offset + sizeof(header), checkpoint.state.data(),
+                    c.state_size);
+  if (ok) {
+    // The first audio frame is the last field of the chunk header.
+    std::memcpy(&checkpoint.frame,
+                header + sizeof(header) - sizeof(checkpoint.frame),
+                sizeof(checkpoint.frame));
+  }
+
+  // Continue reading where we were.
+  return seek(m_position) && ok;
+}
+
+// Read raw bytes of the next block.
+unsigned int IqFileSource::read_block() {
+  if (!m_file)
+    return 0;
+
+  // Archive chunks are read up to their end, then reading continues
+  // with the next chunk.
+  unsigned int n = 0;
+  while (n < m_block_length) {
+    std::uint64_t want = m_block_length - n;
+    if (m_archive) {
+      if (m_chunk >= m_chunks.size())
+        break;
+      const Chunk &c = m_chunks[m_chunk];
+      std::uint64_t left = c.first_sample + c.nsamples - m_position;
+      if (left == 0) {
+        m_chunk++;
+        if (m_chunk < m_chunks.size() && !seek(m_position))
+          return 0;
+        continue;
+      }
+      want = std::min(want, left);
+    }
+
+    size_t n_read = fread(m_buf.data() + 2 * n, 2, want, m_file);
+    if (n_read < want && ferror(m_file)) {
+      m_error = std::string("read error (") + strerror(errno) + ")";
+      return 0;
+    }
+    n += n_read;
+    m_position += n_read;
+    if (n_read < want)
+      break;
+  }
+
+  return n;
+}
+
+// Read the next block into separate I/Q planes.
+bool IqFileSource::get_samples(IQBlock &samples) {
+  unsigned int n = read_block();
+  samples.resize(n);
+  if (n == 0)
+    return false;
+
+  kernels().u8_to_planes(m_buf.data(), samples.i.data(), samples.q.data(), n);
+  return true;
+}
+
+// Read the next block into interleaved IQ samples.
+bool IqFileSource::get_samples(IQSampleVector &samples) {
+  unsigned int n = read_block();
+  samples.resize(n);
+  if (n == 0)
+    return false;
+
+  kernels().u8_to_float(
+      m_buf.data(), reinterpret_cast<IQSample::value_type *>(samples.data()),
+      2 * n);
+  return true;
+}
+
+// end
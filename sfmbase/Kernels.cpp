@@ -0,0 +1,106 @@
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "Kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SOFTFM_KERNELS_X86
+#endif
+
+extern const KernelTable kernels_generic;
+#ifdef SOFTFM_KERNELS_X86
+extern const KernelTable kernels_sse2;
+extern const KernelTable kernels_avx2;
+extern const KernelTable kernels_avx512;
+#endif
+
+static std::atomic<const KernelTable *> current_kernels(NULL);
+
+// Return all variants built into this binary, best first.
+std::vector<const KernelTable *> all_kernels() {
+  std::vector<const KernelTable *> v;
+#ifdef SOFTFM_KERNELS_X86
+  v.push_back(&kernels_avx512);
+  v.push_back(&kernels_avx2);
+  v.push_back(&kernels_sse2);
+#endif
+  v.push_back(&kernels_generic);
+  return v;
+}
+
+// Return true if the CPU can run the specified variant.
+bool kernels_supported(const KernelTable &k) {
+#ifdef SOFTFM_KERNELS_X86
+  __builtin_cpu_init();
+  if (&k == &kernels_avx512) {
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl");
+  }
+  if (&k == &kernels_avx2) {
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }
+  if (&k == &kernels_sse2) {
+    return __builtin_cpu_supports("sse2");
+  }
+#endif
+  return true;
+}
+
+// Return the kernel variant in use.
+const KernelTable &kernels() {
+  const KernelTable *k = current_kernels.load(std::memory_order_acquire);
+  if (k == NULL) {
+    // Select the best supported variant.
+    // (concurrent first calls all store the same value)
+    for (const KernelTable *t : all_kernels()) {
+      if (kernels_supported(*t)) {
+        k = t;
+        break;
+      }
+    }
+    current_kernels.store(k, std::memory_order_release);
+  }
+  return *k;
+}
+
+// Use the named variant instead of the automatically selected one.
+bool force_kernels(const std::string &name) {
+  for (const KernelTable *t : all_kernels()) {
+    if (name == t->name) {
+      if (!kernels_supported(*t))
+        return false;
+      current_kernels.store(t, std::memory_order_release);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Return a list of the detected CPU features.
+std::string cpu_features() {
+  std::string s;
+#ifdef SOFTFM_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    s += " sse2";
+  if (__builtin_cpu_supports("sse4.1"))
+    s += " sse4.1";
+  if (__builtin_cpu_supports("avx"))
+    s += " avx";
+  if (__builtin_cpu_supports("avx2"))
+    s += " avx2";
+  if (__builtin_cpu_supports("fma"))
+    s += " fma";
+  if (__builtin_cpu_supports("avx512f"))
+    s += " avx512f";
+  if (__builtin_cpu_supports("avx512bw"))
+    s += " avx512bw";
+  if (__builtin_cpu_supports("avx512vl"))
+    s += " avx512vl";
+#endif
+  return s.empty() ? std::string("(none detected)") : s.substr(1);
+}
+
+// end
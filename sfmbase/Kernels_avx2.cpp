@@ -0,0 +1,12 @@
+// Kernel variant built with -mavx2 -mfma (x86 only, see CMakeLists.txt).
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "KernelsImpl.h"
+
+extern const KernelTable kernels_avx2;
+const KernelTable kernels_avx2 = SOFTFM_KERNEL_TABLE("avx2");
+
+#endif
+
+// end
@@ -0,0 +1,13 @@
+// Kernel variant built with -mavx512f -mavx512bw -mavx512vl
+// (x86 only, see CMakeLists.txt).
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "KernelsImpl.h"
+
+extern const KernelTable kernels_avx512;
+const KernelTable kernels_avx512 = SOFTFM_KERNEL_TABLE("avx512");
+
+#endif
+
+// end
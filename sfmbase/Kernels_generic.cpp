@@ -0,0 +1,8 @@
+// Kernel variant built with the default compiler flags.
+
+#include "KernelsImpl.h"
+
+extern const KernelTable kernels_generic;
+const KernelTable kernels_generic = SOFTFM_KERNEL_TABLE("generic");
+
+// end
@@ -0,0 +1,12 @@
+// Kernel variant built with -msse2 (x86 only, see CMakeLists.txt).
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include "KernelsImpl.h"
+
+extern const KernelTable kernels_sse2;
+const KernelTable kernels_sse2 = SOFTFM_KERNEL_TABLE("sse2");
+
+#endif
+
+// end
@@ -0,0 +1,103 @@
+#include <cstdio>
+#include <string>
+
+#include "LatencyMonitor.h"
+
+// class LatencyHistogram
+
+LatencyHistogram::LatencyHistogram() : m_count(0), m_max_ns(0) {
+  for (unsigned int i = 0; i < num_buckets; i++)
+    m_buckets[i].store(0);
+}
+
+// Map a value in ns to its bucket.
+// Values below 8 ns get one bucket each; above that, every power of two
+// is split into 8 buckets.
+unsigned int LatencyHistogram::bucket_index(std::uint64_t ns) {
+  if (ns < 8)
+    return ns;
+  unsigned int msb = 63 - __builtin_clzll(ns);
+  unsigned int idx = (msb - 2) * 8 + ((ns >> (msb - 3)) & 7);
+  return (idx < num_buckets) ? idx : num_buckets - 1;
+}
+
+// Return the (exclusive) upper bound in ns of a bucket.
+std::uint64_t LatencyHistogram::bucket_upper(unsigned int idx) {
+  if (idx < 8)
+    return idx + 1;
+  unsigned int msb = idx / 8 + 2;
+  std::uint64_t sub = idx % 8;
+  return (8 + sub + 1) << (msb - 3);
+}
+
+// Record a latency value in seconds.
+void LatencyHistogram::record(double seconds) {
+  std::uint64_t ns = (seconds > 0) ? std::uint64_t(seconds * 1.0e9) : 0;
+
+  m_buckets[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+
+  std::uint64_t prev = m_max_ns.load(std::memory_order_relaxed);
+  while (ns > prev && !m_max_ns.compare_exchange_weak(prev, ns)) {
+  }
+}
+
+// Return the latency below which the fraction p of values falls.
+double LatencyHistogram::percentile(double p) const {
+  std::uint64_t n = m_count.load();
+  if (n == 0)
+    return 0;
+
+  std::uint64_t target = std::uint64_t(p * n + 0.5);
+  if (target < 1)
+    target = 1;
+
+  std::uint64_t cum = 0;
+  for (unsigned int i = 0; i < num_buckets; i++) {
+    cum += m_buckets[i].load(std::memory_order_relaxed);
+    if (cum >= target) {
+      // Do not report more than the actual maximum.
+      std::uint64_t upper = bucket_upper(i);
+      std::uint64_t mx = m_max_ns.load();
+      return ((upper < mx) ? upper : mx) * 1.0e-9;
+    }
+  }
+
+  return max();
+}
+
+// class LatencyMonitor
+
+// Return short printable name of a hop.
+const char *LatencyMonitor::hop_name(int hop) {
+  static const char *const names[NUM_HOPS] = {
+      "source_queue", "decode", "output_queue", "audio_write", "end_to_end"};
+  return (hop >= 0 && hop < NUM_HOPS) ? names[hop] : "?";
+}
+
+// Write percentiles of all hops in a machine-readable text format.
+void LatencyMonitor::dump(std::FILE *fp) const {
+  fprintf(fp, "#hop              count     p50_ms     p90_ms     p99_ms"
+              "     max_ms\n");
+  for (int i = 0; i < NUM_HOPS; i++) {
+    const LatencyHistogram &h = m_hist[i];
+    fprintf(fp, "%-12s %10llu %10.3f %10.3f %10.3f %10.3f\n", hop_name(i),
+            (unsigned long long)h.count(), h.percentile(0.50) * 1.0e3,
+            h.percentile(0.90) * 1.0e3, h.percentile(0.99) * 1.0e3,
+            h.max() * 1.0e3);
+  }
+}
+
+// Atomically replace the specified file with a new dump.
+bool LatencyMonitor::dump_file(const std::string &filename) const {
+  std::string tmpname = filename + ".tmp";
+  std::FILE *fp = std::fopen(tmpname.c_str(), "w");
+  if (fp == NULL)
+    return false;
+  dump(fp);
+  if (std::fclose(fp) != 0)
+    return false;
+  return std::rename(tmpname.c_str(), filename.c_str()) == 0;
+}
+
+// end
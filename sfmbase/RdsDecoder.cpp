@@ -0,0 +1,435 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "RdsDecoder.h"
+
+// Target sample rate after the first decimation (about 8 samples per bit).
+static const double rds_target_rate = 9500;
+
+// Half bandwidth of the RDS signal around the subcarrier.
+static const double rds_bandwidth = 2400;
+
+// Return the specification of the subcarrier filter: flat within 1 dB
+// up to 1.5 kHz, where most of the biphase symbol energy lies, and 40 dB
+// down at twice the signal bandwidth.
+static LowPassSpec rds_filter_spec(double sample_rate) {
+  LowPassSpec spec;
+  spec.passband = 1500 / sample_rate;
+  spec.stopband = 2 * rds_bandwidth / sample_rate;
+  spec.ripple = 1.0;
+  spec.attenuation = 40;
+  return spec;
+}
+
+// Offset words of the RDS blocks: A, B, C, C', D.
+static const std::uint16_t rds_offset_words[5] = {0x0FC, 0x198, 0x168, 0x350,
+                                                  0x1B4};
+
+// Block position for each offset word.
+static const unsigned int rds_offset_pos[5] = {0, 1, 2, 2, 3};
+
+// Compute the syndrome of a 26-bit RDS block.
+// The generator polynomial is x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1.
+// For a valid block, the remainder equals the offset word.
+static std::uint16_t rds_syndrome(std::uint32_t block) {
+  std::uint32_t reg = block;
+  for (int i = 25; i >= 10; i--) {
+    if (reg & (1u << i))
+      reg ^= 0x5B9u << (i - 10);
+  }
+  return reg & 0x3FF;
+}
+
+// Return the offset word index matching the syndrome, or -1.
+static int rds_offset_index(std::uint16_t syndrome) {
+  for (int i = 0; i < 5; i++) {
+    if (syndrome == rds_offset_words[i])
+      return i;
+  }
+  return -1;
+}
+
+// Map an RDS character to printable ASCII.
+// The radiotext end marker (carriage return) is kept as is.
+static char rds_char(unsigned int c) {
+  if (c == 0x0D)
+    return '\r';
+  return (c >= 0x20 && c < 0x7F) ? char(c) : ' ';
+}
+
+// class RdsDecoder
+
+// Construct RDS decoder.
+RdsDecoder::RdsDecoder(double sample_rate)
+    : m_downsample(std::max(1, int(sample_rate / rds_target_rate))),
+      m_sample_rate_rds(sample_rate / m_downsample),
+      m_clock_step(bit_rate / m_sample_rate_rds),
+      m_resample_i(rds_filter_spec(sample_rate), m_downsample, true),
+      m_resample_q(rds_filter_spec(sample_rate), m_downsample, true),
+      m_carrier_acc(0), m_carrier_rot(1),
+      m_symbol_hist(std::max(2, int(lrint(m_sample_rate_rds / bit_rate))), 0),
+      m_symbol_pos(0), m_clock_phase(0), m_clock_best(0), m_clock_done(false),
+      m_prev_symbol(0), m_pi(0), m_pty(0), m_rt_ab(-1), m_pilot_locked(false),
+      m_sample_cnt(0), m_symbol_sample_index(0) {
+  std::fill(m_clock_energy, m_clock_energy + clock_bins, 0);
+  std::fill(m_ps, m_ps + sizeof(m_ps), ' ');
+  std::fill(m_rt, m_rt + sizeof(m_rt), ' ');
+  reset_sync();
+}
+
+// Process baseband samples.
+void RdsDecoder::process(const SampleVector &samples_in,
+                         const IQSampleVector &pilot_phasor,
+                         bool pilot_locked) {
+  process(samples_in.data(), samples_in.size(), pilot_phasor.data(),
+          pilot_locked && pilot_phasor.size() == samples_in.size());
+}
+
+// Process baseband samples from arrays.
+void RdsDecoder::process(const Sample *samples_in, unsigned int n,
+                         const IQSample *pilot_phasor, bool pilot_locked) {
+  m_groups.clear();
+
+  // Without a locked pilot there is no usable carrier.
+  if (!pilot_locked) {
+    if (m_synced)
+      reset_sync();
+    m_pilot_locked = false;
+    m_sample_cnt += n;
+    return;
+  }
+
+  // The subcarrier filters hold samples from before the pilot was lost;
+  // restart them, with the first decimated sample at this block.
+  if (!m_pilot_locked) {
+    m_resample_i.reset();
+    m_resample_q.reset();
+    m_pilot_locked = true;
+    m_symbol_sample_index = m_sample_cnt;
+  }
+  m_sample_cnt += n;
+
+  m_buf_mix_i.resize(n);
+  m_buf_mix_q.resize(n);
+
+  // Mix the 57 kHz subcarrier down to zero frequency.
+  // The carrier is the cube of the locked 19 kHz pilot phasor.
+  for (unsigned int i = 0; i < n; i++) {
+    IQSample p = pilot_phasor[i];
+    IQSample p3 = p * p * p;
+    Sample x = samples_in[i];
+    m_buf_mix_i[i] = x * p3.real();
+    m_buf_mix_q[i] = -x * p3.imag();
+  }
+
+  // Low-pass filter and decimate to a few kHz.
+  m_resample_i.process(m_buf_mix_i, m_buf_rds_i);
+  m_resample_q.process(m_buf_mix_q, m_buf_rds_q);
+
+  unsigned int m = std::min(m_buf_rds_i.size(), m_buf_rds_q.size());
+  for (unsigned int i = 0; i < m; i++) {
+    process_symbol_sample(IQSample(m_buf_rds_i[i], m_buf_rds_q[i]));
+    m_symbol_sample_index += m_downsample;
+  }
+}
+
+// Return radiotext (up to 64 characters).
+std::string RdsDecoder::get_rt() const {
+  char rt[sizeof(m_rt) + 1];
+  get_rt(rt);
+  return std::string(rt);
+}
+
+// Copy programme service name.
+void RdsDecoder::get_ps(char *ps) const {
+  std::memcpy(ps, m_ps, sizeof(m_ps));
+  ps[sizeof(m_ps)] = '\0';
+}
+
+// Copy radiotext without trailing spaces.
+void RdsDecoder::get_rt(char *rt) const {
+  unsigned int len = 0;
+  while (len < sizeof(m_rt) && m_rt[len] != '\r')
+    len++;
+  while (len > 0 && m_rt[len - 1] == ' ')
+    len--;
+  std::memcpy(rt, m_rt, len);
+  rt[len] = '\0';
+}
+
+// Drop synchronization and programme information.
+void RdsDecoder::reset() {
+  reset_sync();
+  m_carrier_acc = 0;
+  m_carrier_rot = 1;
+  m_pi = 0;
+  m_pty = 0;
+  std::fill(m_ps, m_ps + sizeof(m_ps), ' ');
+  std::fill(m_rt, m_rt + sizeof(m_rt), ' ');
+  m_rt_ab = -1;
+  m_pilot_locked = false;
+}
+
+// Save demodulator, sync and programme state.
+void RdsDecoder::save_state(StateWriter &w) const {
+  m_resample_i.save_state(w);
+  m_resample_q.save_state(w);
+  w.put(m_carrier_acc);
+  w.put(m_carrier_rot);
+  w.put(m_symbol_hist);
+  w.put(m_symbol_pos);
+  w.put(m_clock_phase);
+  w.put(m_clock_energy);
+  w.put(m_clock_best);
+  w.put(m_clock_done);
+  w.put(m_prev_symbol);
+  w.put(m_shift_reg);
+  w.put(m_bit_cnt);
+  w.put(m_synced);
+  w.put(m_last_offset);
+  w.put(m_last_offset_bit);
+  w.put(m_block_pos);
+  w.put(m_block_bits);
+  w.put(m_block_errors);
+  w.put(m_block_cnt);
+  w.put(m_blocks);
+  w.put(m_blocks_valid);
+  w.put(m_pi);
+  w.put(m_pty);
+  w.put(m_ps);
+  w.put(m_rt);
+  w.put(m_rt_ab);
+  w.put(m_pilot_locked);
+  w.put(m_sample_cnt);
+  w.put(m_symbol_sample_index);
+}
+
+// Restore demodulator, sync and programme state.
+void RdsDecoder::restore_state(StateReader &r) {
+  m_resample_i.restore_state(r);
+  m_resample_q.restore_state(r);
+  r.get(m_carrier_acc);
+  r.get(m_carrier_rot);
+  r.get(m_symbol_hist);
+  r.get(m_symbol_pos, 0u, unsigned(m_symbol_hist.size() - 1));
+  r.get(m_clock_phase, 0.0, 1.0);
+  r.get(m_clock_energy);
+  r.get(m_clock_best, 0u, clock_bins - 1);
+  r.get(m_clock_done);
+  r.get(m_prev_symbol, 0u, 1u);
+  r.get(m_shift_reg, std::uint32_t(0), std::uint32_t(0x3FFFFFF));
+  r.get(m_bit_cnt);
+  r.get(m_synced);
+  r.get(m_last_offset, -1, 4);
+  r.get(m_last_offset_bit);
+  r.get(m_block_pos, 0u, 3u);
+  r.get(m_block_bits, 0u, 25u);
+  r.get(m_block_errors, 0u, 50u);
+  r.get(m_block_cnt, 0u, 49u);
+  r.get(m_blocks);
+  for (bool &valid : m_blocks_valid)
+    r.get(valid);
+  r.get(m_pi);
+  r.get(m_pty, 0u, 31u);
+  get_chars(r, m_ps, sizeof(m_ps));
+  get_chars(r, m_rt, sizeof(m_rt));
+  r.get(m_rt_ab, -1, 1);
+  r.get(m_pilot_locked);
+  r.get(m_sample_cnt);
+  r.get(m_symbol_sample_index);
+}
+
+// Read n characters which rds_char() could have produced.
+void RdsDecoder::get_chars(StateReader &r, char *s, unsigned int n) {
+  for (unsigned int i = 0; i < n; i++) {
+    char c = ' ';
+    r.read(c);
+    r.require(c == rds_char((unsigned char)c));
+    if (r.storing())
+      s[i] = c;
+  }
+}
+
+// Process one demodulated RDS sample at the decimated rate.
+void RdsDecoder::process_symbol_sample(IQSample z) {
+  // Track the carrier phase offset with a squaring estimator
+  // (BPSK modulation is removed by squaring).
+  const IQSample::value_type alpha = 0.002;
+  m_carrier_acc = (1 - alpha) * m_carrier_acc + alpha * z * z;
+
+  // Rotate the sample onto the real axis.
+  Sample r = (z * m_carrier_rot).real();
+
+  // Biphase matched filter: difference between the older and newer
+  // half of one bit period.
+  unsigned int len = m_symbol_hist.size();
+  m_symbol_pos = (m_symbol_pos + 1 == len) ? 0 : m_symbol_pos + 1;
+  m_symbol_hist[m_symbol_pos] = r;
+  Sample y = 0;
+  unsigned int k = m_symbol_pos;
+  for (unsigned int j = 0; j < len; j++) {
+    y += (j < len / 2) ? -m_symbol_hist[k] : m_symbol_hist[k];
+    k = (k == 0) ? len - 1 : k - 1;
+  }
+
+  // Advance bit clock.
+  m_clock_phase += m_clock_step;
+  if (m_clock_phase >= 1.0) {
+    m_clock_phase -= 1.0;
+    m_clock_done = false;
+
+    // Pick the clock phase with the highest matched filter energy,
+    // with some hysteresis to avoid jitter between adjacent bins.
+    unsigned int best = m_clock_best;
+    for (unsigned int b = 0; b < clock_bins; b++) {
+      if (m_clock_energy[b] > 1.2 * m_clock_energy[best])
+        best = b;
+      m_clock_energy[b] *= 0.99;
+    }
+    m_clock_best = best;
+
+    // Update carrier rotation once per bit.
+    // The square root is ambiguous by 180 degrees. Take the root nearest
+    // to the previous rotation, so that the rotation does not flip when
+    // the squared carrier lies near the branch cut (RDS in quadrature
+    // with the pilot harmonic).
+    IQSample::value_type a = std::abs(m_carrier_acc);
+    if (a > 0) {
+      IQSample rot = std::conj(std::sqrt(m_carrier_acc / a));
+      if (std::real(rot * std::conj(m_carrier_rot)) < 0)
+        rot = -rot;
+      m_carrier_rot = rot;
+    }
+  }
+
+  unsigned int bin = std::min(unsigned(m_clock_phase * clock_bins),
+                              clock_bins - 1);
+  m_clock_energy[bin] += y * y;
+
+  // Take one symbol decision per bit period.
+  if (bin == m_clock_best && !m_clock_done) {
+    m_clock_done = true;
+    unsigned int symbol = (y > 0) ? 1 : 0;
+    process_bit(symbol ^ m_prev_symbol);
+    m_prev_symbol = symbol;
+  }
+}
+
+// Process one differentially decoded data bit.
+void RdsDecoder::process_bit(unsigned int bit) {
+  m_shift_reg = ((m_shift_reg << 1) | bit) & 0x3FFFFFF;
+  m_bit_cnt++;
+
+  if (!m_synced) {
+    // Search for two valid blocks in sequence, 26 bits apart.
+    int offset = rds_offset_index(rds_syndrome(m_shift_reg));
+    if (offset < 0)
+      return;
+
+    unsigned int pos = rds_offset_pos[offset];
+    if (m_last_offset >= 0 && m_bit_cnt - m_last_offset_bit == 26 &&
+        pos == (rds_offset_pos[m_last_offset] + 1) % 4) {
+      m_synced = true;
+      m_block_bits = 0;
+      m_block_errors = 0;
+      m_block_cnt = 0;
+      std::fill(m_blocks_valid, m_blocks_valid + 4, false);
+      m_blocks[pos] = m_shift_reg >> 10;
+      m_blocks_valid[pos] = true;
+      m_block_pos = (pos + 1) % 4;
+    }
+    m_last_offset = offset;
+    m_last_offset_bit = m_bit_cnt;
+    return;
+  }
+
+  if (++m_block_bits < 26)
+    return;
+  m_block_bits = 0;
+
+  // Check the block against the expected offset word.
+  // Block C may carry either offset C or C'.
+  unsigned int pos = m_block_pos;
+  int offset = rds_offset_index(rds_syndrome(m_shift_reg));
+  bool valid = offset >= 0 && rds_offset_pos[offset] == pos;
+  m_blocks[pos] = m_shift_reg >> 10;
+  m_blocks_valid[pos] = valid;
+  if (!valid)
+    m_block_errors++;
+
+  if (pos == 3) {
+    if (m_blocks_valid[0] && m_blocks_valid[1] && m_blocks_valid[2] &&
+        m_blocks_valid[3]) {
+      decode_group(m_blocks);
+    }
+    std::fill(m_blocks_valid, m_blocks_valid + 4, false);
+  }
+  m_block_pos = (pos + 1) % 4;
+
+  // Drop synchronization when too many blocks are bad.
+  if (++m_block_cnt == 50) {
+    bool lost = m_block_errors > 25;
+    m_block_cnt = 0;
+    m_block_errors = 0;
+    if (lost)
+      reset_sync();
+  }
+}
+
+// Decode the contents of a complete group.
+void RdsDecoder::decode_group(const std::uint16_t *blocks) {
+  Group g;
+  g.sample_index = m_symbol_sample_index;
+  g.pi = blocks[0];
+  g.group_type = blocks[1] >> 12;
+  g.version_b = (blocks[1] >> 11) & 1;
+  g.tp = (blocks[1] >> 10) & 1;
+  g.pty = (blocks[1] >> 5) & 0x1F;
+  std::copy(blocks, blocks + 4, g.blocks);
+
+  m_pi = g.pi;
+  m_pty = g.pty;
+
+  if (g.group_type == 0) {
+    // Basic tuning and switching information: 2 PS characters.
+    unsigned int seg = blocks[1] & 0x3;
+    m_ps[2 * seg] = rds_char(blocks[3] >> 8);
+    m_ps[2 * seg + 1] = rds_char(blocks[3] & 0xFF);
+  } else if (g.group_type == 2) {
+    // Radiotext: 4 characters (version A) or 2 characters (version B).
+    unsigned int seg = blocks[1] & 0xF;
+    int ab = (blocks[1] >> 4) & 1;
+    if (ab != m_rt_ab) {
+      std::fill(m_rt, m_rt + sizeof(m_rt), ' ');
+      m_rt_ab = ab;
+    }
+    if (!g.version_b) {
+      m_rt[4 * seg] = rds_char(blocks[2] >> 8);
+      m_rt[4 * seg + 1] = rds_char(blocks[2] & 0xFF);
+      m_rt[4 * seg + 2] = rds_char(blocks[3] >> 8);
+      m_rt[4 * seg + 3] = rds_char(blocks[3] & 0xFF);
+    } else {
+      m_rt[2 * seg] = rds_char(blocks[3] >> 8);
+      m_rt[2 * seg + 1] = rds_char(blocks[3] & 0xFF);
+    }
+  }
+
+  m_groups.push_back(g);
+}
+
+// Reset block synchronization state.
+void RdsDecoder::reset_sync() {
+  m_shift_reg = 0;
+  m_bit_cnt = 0;
+  m_synced = false;
+  m_last_offset = -1;
+  m_last_offset_bit = 0;
+  m_block_pos = 0;
+  m_block_bits = 0;
+  m_block_errors = 0;
+  m_block_cnt = 0;
+  std::fill(m_blocks_valid, m_blocks_valid + 4, false);
+}
+
+// end
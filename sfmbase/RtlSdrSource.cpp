@@ -1,7 +1,9 @@
 #include <climits>
+#include <cmath>
 #include <cstring>
 #include <rtl-sdr.h>
 
+#include "Kernels.h"
 #include "RtlSdrSource.h"
 
 // Open RTL-SDR device.
@@ -75,11 +77,13 @@ bool RtlSdrSource::configure(uint32_t sample_rate, uint32_t frequency,
   }
 
   // set block length
+  // (a multiple of 512 bytes is required for USB bulk transfers)
   m_block_length =
-      (block_length < 4096)
-          ? 4096
+      (block_length < min_block_length)
+          ? min_block_length
           : (block_length > 1024 * 1024) ? 1024 * 1024 : block_length;
-  m_block_length -= m_block_length % 4096;
+  m_block_length -= m_block_length % min_block_length;
+  m_buf.resize(2 * m_block_length);
 
   // reset buffer to start streaming
   if (rtlsdr_reset_buffer(m_dev) < 0) {
@@ -90,6 +94,25 @@ bool RtlSdrSource::configure(uint32_t sample_rate, uint32_t frequency,
   return true;
 }
 
+// Change the center frequency while streaming.
+bool RtlSdrSource::set_frequency(uint32_t frequency) {
+  if (!m_dev)
+    return false;
+
+  if (rtlsdr_set_center_freq(m_dev, frequency) < 0) {
+    m_error = "rtlsdr_set_center_freq failed";
+    return false;
+  }
+
+  return true;
+}
+
+// Return the number of samples to skip after a frequency change.
+std::uint64_t RtlSdrSource::settle_samples() {
+  return m_block_length + std::uint64_t(ceil(tuner_settle_time *
+                                             get_sample_rate()));
+}
+
 // Return current sample frequency in Hz.
 uint32_t RtlSdrSource::get_sample_rate() {
   return rtlsdr_get_sample_rate(m_dev);
@@ -114,16 +137,14 @@ std::vector<int> RtlSdrSource::get_tuner_gains() {
   return gains;
 }
 
-// Fetch a bunch of samples from the device.
-bool RtlSdrSource::get_samples(IQSampleVector &samples) {
+// Read one block of raw samples into m_buf.
+bool RtlSdrSource::read_block() {
   int r, n_read;
 
   if (!m_dev)
     return false;
 
-  std::vector<uint8_t> buf(2 * m_block_length);
-
-  r = rtlsdr_read_sync(m_dev, buf.data(), 2 * m_block_length, &n_read);
+  r = rtlsdr_read_sync(m_dev, m_buf.data(), 2 * m_block_length, &n_read);
   if (r < 0) {
     m_error = "rtlsdr_read_sync failed";
     return false;
@@ -134,13 +155,30 @@ bool RtlSdrSource::get_samples(IQSampleVector &samples) {
     return false;
   }
 
+  return true;
+}
+
+// Fetch a bunch of samples from the device.
+bool RtlSdrSource::get_samples(IQSampleVector &samples) {
+  if (!read_block())
+    return false;
+
   samples.resize(m_block_length);
-  for (int i = 0; i < m_block_length; i++) {
-    int32_t re = buf[2 * i];
-    int32_t im = buf[2 * i + 1];
-    samples[i] = IQSample((re - 128) / IQSample::value_type(128),
-                          (im - 128) / IQSample::value_type(128));
-  }
+  kernels().u8_to_float(m_buf.data(),
+                        reinterpret_cast<IQSample::value_type *>(samples.data()),
+                        2 * m_block_length);
+
+  return true;
+}
+
+// Fetch a bunch of samples from the device into separate I/Q planes.
+bool RtlSdrSource::get_samples(IQBlock &samples) {
+  if (!read_block())
+    return false;
+
+  samples.resize(m_block_length);
+  kernels().u8_to_planes(m_buf.data(), samples.i.data(), samples.q.data(),
+                         m_block_length);
 
   return true;
 }
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+
+#include "DecoderState.h"
+#include "SpectrumMonitor.h"
+
+// class SpectrumMonitor
+
+const std::uint32_t SpectrumMonitor::frame_magic;
+
+// Open the output file and start the monitor thread.
+SpectrumMonitor::SpectrumMonitor(const std::string &filename,
+                                 double sample_rate, unsigned int fft_size,
+                                 unsigned int averages, double frame_rate)
+    : m_fft(fft_size), m_sample_rate(sample_rate),
+      m_averages(std::max(1u, averages)),
+      m_frame_interval(std::max<std::uint64_t>(
+          std::uint64_t(fft_size) * std::max(1u, averages),
+          std::uint64_t(sample_rate / frame_rate))),
+      m_next_frame(0), m_have_pending(false), m_stop(false), m_frame_count(0),
+      m_drop_count(0), m_file(NULL), m_close_file(false) {
+  if (filename == "-") {
+    m_file = stdout;
+  } else {
+    m_file = fopen(filename.c_str(), "wb");
+    if (m_file == NULL) {
+      m_error = "can not open '" + filename + "' (" + strerror(errno) + ")";
+      return;
+    }
+    m_close_file = true;
+  }
+
+  m_collect.samples.reserve(fft_size * m_averages);
+  m_thread = std::thread(&SpectrumMonitor::run, this);
+}
+
+// Stop the monitor thread and close the output file.
+SpectrumMonitor::~SpectrumMonitor() {
+  if (m_thread.joinable()) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stop = true;
+    lock.unlock();
+    m_cond.notify_all();
+    m_thread.join();
+  }
+  if (m_close_file)
+    fclose(m_file);
+}
+
+// Offer a block of IQ samples.
+void SpectrumMonitor::offer(const IQBlock &samples,
+                            std::uint64_t sample_index, double time,
+                            double center_freq) {
+  if (!m_thread.joinable())
+    return;
+
+  const unsigned int frame_samples = m_fft.size() * m_averages;
+  const std::uint64_t end = sample_index + samples.size();
+
+  // Skip ahead to the next frame.
+  if (m_collect.samples.empty()) {
+    if (end <= m_next_frame)
+      return;
+    std::uint64_t first = std::max(m_next_frame, sample_index);
+    m_collect.sample_index = first;
+    m_collect.time = time + (first - sample_index) / m_sample_rate;
+    m_collect.center_freq = center_freq;
+  }
+
+  // A retune in the middle of a frame would smear the spectrum.
+  if (center_freq != m_collect.center_freq) {
+    m_collect.samples.clear();
+    m_next_frame = sample_index;
+    offer(samples, sample_index, time, center_freq);
+    return;
+  }
+
+  std::uint64_t pos = m_collect.sample_index + m_collect.samples.size();
+  unsigned int n = std::min<std::uint64_t>(
+      frame_samples - m_collect.samples.size(), end - pos);
+  for (unsigned int k = pos - sample_index, end_k = k + n; k < end_k; k++)
+    m_collect.samples.push_back(IQSample(samples.i[k], samples.q[k]));
+  if (m_collect.samples.size() < frame_samples)
+    return;
+
+  m_next_frame = m_collect.sample_index + m_frame_interval;
+
+  // Hand the frame over unless the monitor thread is busy.
+  std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+  if (lock.owns_lock() && !m_have_pending) {
+    std::swap(m_pending, m_collect);
+    m_have_pending = true;
+    lock.unlock();
+    m_cond.notify_all();
+  } else {
+    m_drop_count++;
+  }
+  m_collect.samples.clear();
+
+  // The rest of the block may already start the next frame.
+  if (end > m_next_frame)
+    offer(samples, sample_index, time, center_freq);
+}
+
+// Compute and write frames until stopped.
+void SpectrumMonitor::run() {
+  Frame frame;
+  while (true) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_have_pending && !m_stop)
+      m_cond.wait(lock);
+    if (m_stop)
+      break;
+    std::swap(frame, m_pending);
+    m_have_pending = false;
+    lock.unlock();
+
+    if (!write_frame(frame, std::uint32_t(m_drop_count.load()))) {
+      lock.lock();
+      m_error = std::string("write error (") + strerror(errno) + ")";
+      break;
+    }
+    m_frame_count++;
+  }
+}
+
+// Compute the spectrum of a frame and write it.
+bool SpectrumMonitor::write_frame(const Frame &frame, std::uint32_t dropped) {
+  const unsigned int n = m_fft.size();
+  m_power.assign(n, 0);
+  for (unsigned int j = 0; j < m_averages; j++)
+    m_fft.add_power(frame.samples.data() + j * n, m_power, m_fft_buf);
+
+  m_out.clear();
+  StateWriter w(m_out);
+  w.put(frame_magic);
+  w.put(std::uint32_t(n));
+  w.put(frame.sample_index);
+  w.put(frame.time);
+  w.put(frame.center_freq);
+  w.put(m_sample_rate);
+  w.put(std::uint32_t(m_averages));
+  w.put(dropped);
+
+  // A full-scale tone gives 0 dB.
+  const float h = 0.5f * n;
+  const float scale = 1.0f / (m_averages * h * h);
+  for (unsigned int i = 0; i < n; i++) {
+    float db = 10 * log10f(std::max(m_power[i] * scale, 1.0e-20f));
+    w.put(std::uint8_t(std::min(255.0f, std::max(0.0f, 2 * db + 255.5f))));
+  }
+
+  return fwrite(m_out.data(), 1, m_out.size(), m_file) == m_out.size() &&
+         fflush(m_file) == 0;
+}
+
+// end
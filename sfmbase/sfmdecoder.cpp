@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <vector>
+
+#include "FmDecode.h"
+#include "sfmdecoder.h"
+
+// Decoder handle; wraps FmDecoder for the C API.
+struct sfm_decoder {
+  FmDecoder fm;
+  double sample_rate_if;
+  mutable std::vector<std::uint8_t> state; // snapshot buffer
+
+  explicit sfm_decoder(const sfm_decoder_config &cfg)
+      : fm(cfg.sample_rate_if, cfg.ifeq_static_gain, cfg.ifeq_fit_factor,
+           cfg.tuning_offset, cfg.sample_rate_pcm, cfg.deemphasis,
+           cfg.bandwidth_if, cfg.freq_dev, cfg.bandwidth_pcm, cfg.downsample,
+           cfg.pilot_shift != 0, cfg.rds != 0),
+        sample_rate_if(cfg.sample_rate_if) {
+    if (cfg.max_block_length > 0)
+      fm.reserve(cfg.max_block_length);
+  }
+};
+
+unsigned int sfm_api_version(void) { return SFM_API_VERSION; }
+
+void sfm_decoder_config_init(sfm_decoder_config *cfg, double sample_rate_if,
+                             double sample_rate_pcm) {
+  std::memset(cfg, 0, sizeof(*cfg));
+  cfg->struct_size = sizeof(*cfg);
+  cfg->sample_rate_if = sample_rate_if;
+  cfg->sample_rate_pcm = sample_rate_pcm;
+  cfg->tuning_offset = 0;
+  cfg->deemphasis = FmDecoder::default_deemphasis_eu;
+  cfg->bandwidth_if = FmDecoder::default_bandwidth_if;
+  cfg->freq_dev = FmDecoder::default_freq_dev;
+  cfg->bandwidth_pcm =
+      std::min(FmDecoder::default_bandwidth_pcm, 0.45 * sample_rate_pcm);
+
+  // Same choice of downsampling factor as softfm.
+  cfg->downsample =
+      (sample_rate_if > 0 && sample_rate_pcm > 0)
+          ? FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm).downsample
+          : 1;
+
+  cfg->pilot_shift = 0;
+  cfg->rds = 0;
+  cfg->max_block_length = 65536;
+
+  // Equalizer parameters fitted for the sample rate.
+  if (sample_rate_if > 0) {
+    DiscriminatorEqualizer::get_parameters(
+        sample_rate_if, cfg->ifeq_static_gain, cfg->ifeq_fit_factor);
+  } else {
+    cfg->ifeq_static_gain = 1.0;
+    cfg->ifeq_fit_factor = 0.0;
+  }
+}
+
+sfm_decoder *sfm_decoder_create(const sfm_decoder_config *cfg) {
+  if (cfg == NULL || cfg->struct_size < sizeof(sfm_decoder_config))
+    return NULL;
+  if (!(cfg->sample_rate_if > 0) || !(cfg->sample_rate_pcm > 0) ||
+      cfg->downsample < 1 ||
+      cfg->sample_rate_pcm > cfg->sample_rate_if / cfg->downsample)
+    return NULL;
+
+  try {
+    return new sfm_decoder(*cfg);
+  } catch (...) {
+    return NULL;
+  }
+}
+
+void sfm_decoder_destroy(sfm_decoder *dec) { delete dec; }
+
+unsigned int sfm_decoder_max_output(const sfm_decoder *dec, unsigned int n) {
+  return dec->fm.max_output_size(n);
+}
+
+int sfm_decoder_process_planes(sfm_decoder *dec, const float *in_i,
+                               const float *in_q, unsigned int n, double *pcm,
+                               unsigned int pcm_capacity) {
+  if (pcm_capacity < dec->fm.max_output_size(n))
+    return -1;
+
+  try {
+    return dec->fm.process(in_i, in_q, n, pcm, pcm_capacity);
+  } catch (...) {
+    return -1;
+  }
+}
+
+int sfm_decoder_process(sfm_decoder *dec, const float *iq, unsigned int n,
+                        double *pcm, unsigned int pcm_capacity) {
+  if (pcm_capacity < dec->fm.max_output_size(n))
+    return -1;
+
+  try {
+    return dec->fm.process(reinterpret_cast<const IQSample *>(iq), n, pcm,
+                           pcm_capacity);
+  } catch (...) {
+    return -1;
+  }
+}
+
+void sfm_decoder_get_stats(const sfm_decoder *dec, sfm_decoder_stats *stats) {
+  // Fill a complete struct, then copy only the part the caller knows.
+  sfm_decoder_stats s;
+  std::memset(&s, 0, sizeof(s));
+  s.struct_size = std::min<std::size_t>(stats->struct_size, sizeof(s));
+
+  const FmDecoder &fm = dec->fm;
+  s.stereo = fm.stereo_detected();
+  s.tuning_offset = fm.get_tuning_offset();
+  s.if_level = fm.get_if_level();
+  s.baseband_level = fm.get_baseband_level();
+  s.pilot_level = fm.get_pilot_level();
+  s.phase_error = fm.get_phase_error();
+
+  if (fm.rds_enabled()) {
+    const RdsDecoder &rds = fm.get_rds();
+    s.rds_synced = rds.synced();
+    s.rds_pi = rds.get_pi();
+    s.rds_pty = rds.get_pty();
+    rds.get_ps(s.rds_ps);
+    rds.get_rt(s.rds_rt);
+  }
+
+  std::memcpy(stats, &s, s.struct_size);
+}
+
+int sfm_decoder_retune(sfm_decoder *dec, double tuning_offset,
+                       int new_station) {
+  if (!(std::fabs(tuning_offset) < 0.5 * dec->sample_rate_if))
+    return -1;
+
+  try {
+    dec->fm.retune(tuning_offset, new_station != 0);
+  } catch (...) {
+    return -1;
+  }
+  return 0;
+}
+
+unsigned long sfm_decoder_save_state(const sfm_decoder *dec, void *buf,
+                                     unsigned long capacity) {
+  dec->fm.save_state(dec->state);
+  if (buf != NULL && capacity >= dec->state.size())
+    std::memcpy(buf, dec->state.data(), dec->state.size());
+  return dec->state.size();
+}
+
+int sfm_decoder_restore_state(sfm_decoder *dec, const void *buf,
+                              unsigned long size) {
+  if (buf == NULL)
+    return -1;
+  return dec->fm.restore_state(static_cast<const std::uint8_t *>(buf), size)
+             ? 0
+             : -1;
+}
+
+// end
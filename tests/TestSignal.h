@@ -0,0 +1,103 @@
+#ifndef SOFTFM_TESTSIGNAL_H
+#define SOFTFM_TESTSIGNAL_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Append one RDS block (16 information bits, 10 check bits) to bits.
+// offset :: offset word of the block position (A, B, C or D)
+inline void append_rds_block(std::uint16_t info, std::uint16_t offset,
+                             std::vector<std::uint8_t> &bits) {
+  // Remainder of info * x^10 by the generator polynomial
+  // x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + 1.
+  std::uint32_t reg = std::uint32_t(info) << 10;
+  for (int i = 25; i >= 10; i--) {
+    if (reg & (1u << i))
+      reg ^= 0x5B9u << (i - 10);
+  }
+  std::uint32_t block = (std::uint32_t(info) << 10) | (reg ^ offset);
+  for (int i = 25; i >= 0; i--)
+    bits.push_back((block >> i) & 1);
+}
+
+// Generate the RDS data bits which broadcast a programme service name
+// (group 0A, 8 characters) and a radiotext (group 2A, up to 64
+// characters), once each.
+inline void make_rds_test_bits(std::uint16_t pi, unsigned int pty,
+                               const char *ps, const char *rt,
+                               std::vector<std::uint8_t> &bits) {
+  const std::uint16_t offset_a = 0x0FC, offset_b = 0x198, offset_c = 0x168,
+                      offset_d = 0x1B4;
+  char text[64];
+  unsigned int rt_len = 0;
+  for (unsigned int i = 0; i < sizeof(text); i++) {
+    text[i] = (rt[rt_len] != '\0') ? rt[rt_len++] : ' ';
+  }
+  if (rt_len < sizeof(text))
+    text[rt_len] = '\r';
+
+  bits.clear();
+  for (unsigned int seg = 0; seg < 4; seg++) {
+    append_rds_block(pi, offset_a, bits);
+    append_rds_block((0 << 12) | (pty << 5) | seg, offset_b, bits);
+    append_rds_block(0xE0CD, offset_c, bits); // no alternative frequencies
+    append_rds_block((ps[2 * seg] << 8) | ps[2 * seg + 1], offset_d, bits);
+  }
+  for (unsigned int seg = 0; seg < (rt_len + 4) / 4 && seg < 16; seg++) {
+    const char *c = text + 4 * seg;
+    append_rds_block(pi, offset_a, bits);
+    append_rds_block((2 << 12) | (pty << 5) | seg, offset_b, bits);
+    append_rds_block((c[0] << 8) | c[1], offset_c, bits);
+    append_rds_block((c[2] << 8) | c[3], offset_d, bits);
+  }
+}
+
+// Generate a stereo FM broadcast signal as rtl_sdr would record it
+// (interleaved unsigned 8-bit I/Q pairs).
+// sample_rate :: IQ sample rate in Hz
+// offset      :: carrier frequency in Hz relative to the centre
+// seconds     :: length of the signal
+// rds_bits    :: if not NULL, RDS data bits to repeat on the subcarrier
+// The left channel carries a 1 kHz tone and the right channel a 1.5 kHz
+// tone, with a 19 kHz pilot at 10% of the deviation. RDS adds a biphase
+// coded, differentially encoded BPSK subcarrier at 57 kHz with 4% of the
+// deviation.
+inline void make_fm_test_signal(double sample_rate, double offset,
+                                double seconds,
+                                std::vector<std::uint8_t> &iq,
+                                const std::vector<std::uint8_t> *rds_bits =
+                                    NULL) {
+  const double freq_dev = 75000;
+  const double rds_bit_rate = 1187.5;
+  const std::uint64_t n = std::uint64_t(sample_rate * seconds);
+  iq.resize(2 * n);
+
+  double phase = 0;
+  std::uint64_t rds_bit_cnt = 0;
+  unsigned int rds_symbol = 0;
+  for (std::uint64_t k = 0; k < n; k++) {
+    double t = k / sample_rate;
+    double left = 0.5 * sin(2 * M_PI * 1000 * t);
+    double right = 0.5 * sin(2 * M_PI * 1500 * t);
+    double pilot = 2 * M_PI * 19000 * t;
+    double mpx = 0.9 * (0.5 * (left + right) +
+                        0.5 * (left - right) * sin(2 * pilot)) +
+                 0.1 * sin(pilot);
+    if (rds_bits != NULL && !rds_bits->empty()) {
+      double bit_time = t * rds_bit_rate;
+      std::uint64_t b = std::uint64_t(bit_time);
+      for (; rds_bit_cnt <= b; rds_bit_cnt++)
+        rds_symbol ^= (*rds_bits)[rds_bit_cnt % rds_bits->size()];
+      double half = (bit_time - b < 0.5) ? 1 : -1;
+      mpx = 0.96 * mpx +
+            0.04 * (rds_symbol ? half : -half) * sin(3 * pilot);
+    }
+    phase += 2 * M_PI * (offset + freq_dev * mpx) / sample_rate;
+    phase = fmod(phase, 2 * M_PI);
+    iq[2 * k] = std::uint8_t(lrint(127.5 + 100 * cos(phase)));
+    iq[2 * k + 1] = std::uint8_t(lrint(127.5 + 100 * sin(phase)));
+  }
+}
+
+#endif
@@ -0,0 +1,100 @@
+// Check that the decoded audio does not depend on the IQ block length:
+// decode one IQ file with several block lengths and compare the PCM.
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "FmDecode.h"
+#include "IqFileSource.h"
+#include "TestSignal.h"
+
+static const double sample_rate_if = 960000;
+static const double sample_rate_pcm = 48000;
+static const double station_offset = 150000;
+
+// Decode the file with the given block length.
+static bool decode(const std::string &filename, unsigned int block_length,
+                   SampleVector &pcm, bool &stereo) {
+  IqFileSource source(filename, block_length);
+  if (!source) {
+    fprintf(stderr, "ERROR: %s\n", source.error().c_str());
+    return false;
+  }
+
+  double ifeq_static_gain, ifeq_fit_factor;
+  DiscriminatorEqualizer::get_parameters(sample_rate_if, ifeq_static_gain,
+                                         ifeq_fit_factor);
+  FmDecoder fm(sample_rate_if, ifeq_static_gain, ifeq_fit_factor,
+               station_offset, sample_rate_pcm,
+               FmDecoder::default_deemphasis_eu,
+               FmDecoder::default_bandwidth_if, FmDecoder::default_freq_dev,
+               FmDecoder::default_bandwidth_pcm,
+               FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm)
+                   .downsample,
+               false, true);
+  fm.reserve(block_length);
+
+  IQBlock block;
+  SampleVector audio;
+  pcm.clear();
+  while (source.get_samples(block)) {
+    fm.process(block, audio);
+    pcm.insert(pcm.end(), audio.begin(), audio.end());
+  }
+  stereo = fm.stereo_detected();
+  return true;
+}
+
+int main() {
+  const std::string filename = "block_length_test.u8";
+
+  std::vector<std::uint8_t> iq;
+  make_fm_test_signal(sample_rate_if, station_offset, 1.0, iq);
+  FILE *f = fopen(filename.c_str(), "wb");
+  if (f == NULL || fwrite(iq.data(), 1, iq.size(), f) != iq.size()) {
+    fprintf(stderr, "ERROR: can not write %s\n", filename.c_str());
+    return 1;
+  }
+  fclose(f);
+
+  // The long blocks are the reference; the others are shorter than the
+  // filter orders, or do not divide the decimation factors.
+  const unsigned int block_lengths[] = {65536, 4093, 256, 37, 1};
+  SampleVector reference;
+  bool ok = true;
+  for (unsigned int block_length : block_lengths) {
+    SampleVector pcm;
+    bool stereo;
+    if (!decode(filename, block_length, pcm, stereo))
+      return 1;
+    if (!stereo) {
+      fprintf(stderr, "FAIL: block length %u: no stereo detected\n",
+              block_length);
+      ok = false;
+    }
+    if (reference.empty()) {
+      reference.swap(pcm);
+      continue;
+    }
+
+    std::size_t diffs = 0;
+    for (std::size_t i = 0; i < std::min(pcm.size(), reference.size()); i++)
+      diffs += (pcm[i] != reference[i]);
+    if (pcm.size() != reference.size() || diffs != 0) {
+      fprintf(stderr,
+              "FAIL: block length %u: %zu samples, %zu differ "
+              "(reference %zu samples)\n",
+              block_length, pcm.size(), diffs, reference.size());
+      ok = false;
+    } else {
+      printf("block length %u: %zu samples identical\n", block_length,
+             pcm.size());
+    }
+  }
+
+  remove(filename.c_str());
+  return ok ? 0 : 1;
+}
+
+// end
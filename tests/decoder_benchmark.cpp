@@ -0,0 +1,105 @@
+// Measure the decoder throughput on a synthetic stereo FM signal.
+//
+// Usage: decoder_benchmark [kernel_variant]
+//
+// For each IF sample rate the signal is converted once, then decoded
+// from I/Q planes (as softfm does) and from interleaved samples (as the
+// C library does). The result is in IF samples per second of CPU time,
+// together with the real-time factor.
+
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <vector>
+
+#include "FmDecode.h"
+#include "IQBlock.h"
+#include "Kernels.h"
+#include "TestSignal.h"
+
+static const double sample_rate_pcm = 48000;
+static const double seconds = 4.0;
+static const unsigned int block_length = 65536;
+static const int repeats = 3;
+
+static double cpu_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+// Construct a decoder as softfm does for the given IF sample rate.
+static FmDecoder *make_decoder(double sample_rate_if) {
+  double ifeq_static_gain, ifeq_fit_factor;
+  DiscriminatorEqualizer::get_parameters(sample_rate_if, ifeq_static_gain,
+                                         ifeq_fit_factor);
+  FmDecoder *fm = new FmDecoder(
+      sample_rate_if, ifeq_static_gain, ifeq_fit_factor,
+      -0.2 * sample_rate_if, sample_rate_pcm,
+      FmDecoder::default_deemphasis_eu, FmDecoder::default_bandwidth_if,
+      FmDecoder::default_freq_dev, FmDecoder::default_bandwidth_pcm,
+      FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm).downsample,
+      false, false);
+  fm->reserve(block_length);
+  return fm;
+}
+
+// Return the best CPU time in seconds to decode all blocks.
+template <class Block>
+static double run(double sample_rate_if, const std::vector<Block> &blocks) {
+  double best = 0;
+  for (int r = 0; r < repeats; r++) {
+    FmDecoder *fm = make_decoder(sample_rate_if);
+    SampleVector audio;
+    double t0 = cpu_time();
+    for (const Block &block : blocks)
+      fm->process(block, audio);
+    double t = cpu_time() - t0;
+    delete fm;
+    if (r == 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1 && !force_kernels(argv[1])) {
+    fprintf(stderr, "ERROR: kernel variant '%s' not available\n", argv[1]);
+    return 1;
+  }
+  printf("kernels: %s\n", kernels().name);
+
+  const double sample_rates[] = {960000, 2400000};
+  for (double sample_rate_if : sample_rates) {
+    std::vector<std::uint8_t> iq;
+    make_fm_test_signal(sample_rate_if, -0.2 * sample_rate_if, seconds, iq);
+
+    std::vector<IQBlock> planes;
+    std::vector<IQSampleVector> interleaved;
+    for (std::size_t k = 0; k < iq.size(); k += 2 * block_length) {
+      unsigned int n = std::min<std::size_t>(block_length, (iq.size() - k) / 2);
+      planes.push_back(IQBlock());
+      planes.back().resize(n);
+      kernels().u8_to_planes(&iq[k], planes.back().i.data(),
+                             planes.back().q.data(), n);
+      interleaved.push_back(IQSampleVector(n));
+      kernels().u8_to_float(
+          &iq[k],
+          reinterpret_cast<IQSample::value_type *>(interleaved.back().data()),
+          2 * n);
+    }
+
+    double t_planes = run(sample_rate_if, planes);
+    double t_interleaved = run(sample_rate_if, interleaved);
+    double nsamples = iq.size() / 2;
+    printf("%7.0f kS/s  planes: %6.2f MS/s (%5.1fx real time)  "
+           "interleaved: %6.2f MS/s (%5.1fx real time)\n",
+           sample_rate_if * 1.0e-3, nsamples / t_planes * 1.0e-6,
+           seconds / t_planes, nsamples / t_interleaved * 1.0e-6,
+           seconds / t_interleaved);
+  }
+
+  return 0;
+}
+
+// end
@@ -0,0 +1,146 @@
+// Check decoder state snapshots: a decoder restored from a snapshot must
+// continue with exactly the output of the decoder which saved it, and
+// corrupted snapshots must be rejected (or at least be safe to decode).
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "FmDecode.h"
+#include "IQBlock.h"
+#include "Kernels.h"
+#include "TestSignal.h"
+
+static const double sample_rate_if = 960000;
+static const double sample_rate_pcm = 48000;
+static const double station_offset = 150000;
+static const unsigned int block_length = 16384;
+
+static FmDecoder *make_decoder(bool rds, bool afc) {
+  double ifeq_static_gain, ifeq_fit_factor;
+  DiscriminatorEqualizer::get_parameters(sample_rate_if, ifeq_static_gain,
+                                         ifeq_fit_factor);
+  return new FmDecoder(
+      sample_rate_if, ifeq_static_gain, ifeq_fit_factor, station_offset,
+      sample_rate_pcm, FmDecoder::default_deemphasis_eu,
+      FmDecoder::default_bandwidth_if, FmDecoder::default_freq_dev,
+      FmDecoder::default_bandwidth_pcm,
+      FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm).downsample,
+      false, rds, afc);
+}
+
+// Decode blocks [begin, end) and append the audio to pcm.
+static void decode(FmDecoder &fm, const std::vector<IQBlock> &blocks,
+                   std::size_t begin, std::size_t end, SampleVector &pcm) {
+  SampleVector audio;
+  for (std::size_t k = begin; k < end; k++) {
+    fm.process(blocks[k], audio);
+    pcm.insert(pcm.end(), audio.begin(), audio.end());
+  }
+}
+
+// Return true if a and b are identical.
+static bool same(const SampleVector &a, const SampleVector &b) {
+  if (a.size() != b.size())
+    return false;
+  for (std::size_t i = 0; i < a.size(); i++) {
+    if (a[i] != b[i])
+      return false;
+  }
+  return true;
+}
+
+static bool run(const std::vector<IQBlock> &blocks, bool rds, bool afc) {
+  printf("rds %d, afc %d:\n", rds, afc);
+  bool ok = true;
+  const std::size_t half = blocks.size() / 2;
+
+  // Reference: one decoder runs through, with a snapshot halfway.
+  FmDecoder *ref = make_decoder(rds, afc);
+  SampleVector pcm_first, pcm_ref;
+  decode(*ref, blocks, 0, half, pcm_first);
+  std::vector<std::uint8_t> state;
+  ref->save_state(state);
+  decode(*ref, blocks, half, blocks.size(), pcm_ref);
+  delete ref;
+
+  // A fresh decoder restored from the snapshot continues identically.
+  FmDecoder *fm = make_decoder(rds, afc);
+  SampleVector pcm;
+  if (!fm->restore_state(state.data(), state.size())) {
+    fprintf(stderr, "FAIL: valid snapshot rejected\n");
+    return false;
+  }
+  decode(*fm, blocks, half, blocks.size(), pcm);
+  if (!same(pcm, pcm_ref)) {
+    fprintf(stderr, "FAIL: restored decoder differs\n");
+    ok = false;
+  } else {
+    printf("  restored output identical (%zu samples)\n", pcm.size());
+  }
+
+  // A rejected snapshot leaves the decoder unchanged.
+  std::vector<std::uint8_t> bad(state.begin(), state.end() - 1);
+  if (!fm->restore_state(state.data(), state.size()) ||
+      fm->restore_state(bad.data(), bad.size())) {
+    fprintf(stderr, "FAIL: truncated snapshot accepted\n");
+    ok = false;
+  }
+  pcm.clear();
+  decode(*fm, blocks, half, blocks.size(), pcm);
+  if (!same(pcm, pcm_ref)) {
+    fprintf(stderr, "FAIL: rejected snapshot changed the decoder\n");
+    ok = false;
+  }
+
+  // Overwrite each byte in turn. The decoder must reject the snapshot or
+  // decode from it without failing (values out of range would index
+  // outside the filter and lookup tables).
+  const std::uint8_t patterns[] = {0xff, 0x7f, 0x80, 0x01};
+  unsigned int rejected = 0, accepted = 0;
+  IQBlock probe;
+  probe.resize(1024);
+  std::copy(blocks[half].i.begin(), blocks[half].i.begin() + 1024,
+            probe.i.begin());
+  std::copy(blocks[half].q.begin(), blocks[half].q.begin() + 1024,
+            probe.q.begin());
+  SampleVector audio;
+  for (std::size_t pos = 0; pos < state.size(); pos++) {
+    for (std::uint8_t v : patterns) {
+      if (state[pos] == v)
+        continue;
+      bad = state;
+      bad[pos] = v;
+      if (!fm->restore_state(bad.data(), bad.size())) {
+        rejected++;
+        continue;
+      }
+      accepted++;
+      fm->process(probe, audio);
+    }
+  }
+  printf("  %zu byte snapshot: %u corruptions rejected, %u decoded\n",
+         state.size(), rejected, accepted);
+  delete fm;
+  return ok;
+}
+
+int main() {
+  std::vector<std::uint8_t> iq;
+  make_fm_test_signal(sample_rate_if, station_offset, 1.0, iq);
+
+  std::vector<IQBlock> blocks;
+  for (std::size_t k = 0; k < iq.size(); k += 2 * block_length) {
+    unsigned int n = std::min<std::size_t>(block_length, (iq.size() - k) / 2);
+    blocks.push_back(IQBlock());
+    blocks.back().resize(n);
+    kernels().u8_to_planes(&iq[k], blocks.back().i.data(),
+                           blocks.back().q.data(), n);
+  }
+
+  bool ok = run(blocks, false, false);
+  ok = run(blocks, true, true) && ok;
+  return ok ? 0 : 1;
+}
+
+// end
@@ -0,0 +1,136 @@
+// Check the RDS decoder on a synthetic RDS group stream: the programme
+// information must be decoded, and the groups must be reported at the
+// same baseband samples whatever the IQ block length.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "FmDecode.h"
+#include "IQBlock.h"
+#include "Kernels.h"
+#include "TestSignal.h"
+
+static const double sample_rate_if = 960000;
+static const double sample_rate_pcm = 48000;
+static const double station_offset = 150000;
+
+static const std::uint16_t test_pi = 0xD3C2;
+static const unsigned int test_pty = 10;
+static const char test_ps[] = "SOFTFM  ";
+static const char test_rt[] = "Radiotext from the RDS test signal";
+
+static const double sample_rate_baseband =
+    sample_rate_if /
+    FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm).downsample;
+
+// Decode the signal with the given block length and collect the groups
+// after the first second (when the pilot has locked at the same sample
+// for any block length).
+static void decode(const std::vector<std::uint8_t> &iq,
+                   unsigned int block_length, std::string &ps,
+                   std::string &rt, unsigned int &pi, unsigned int &pty,
+                   std::vector<RdsDecoder::Group> &groups) {
+  double ifeq_static_gain, ifeq_fit_factor;
+  DiscriminatorEqualizer::get_parameters(sample_rate_if, ifeq_static_gain,
+                                         ifeq_fit_factor);
+  FmDecoder fm(sample_rate_if, ifeq_static_gain, ifeq_fit_factor,
+               station_offset, sample_rate_pcm,
+               FmDecoder::default_deemphasis_eu,
+               FmDecoder::default_bandwidth_if, FmDecoder::default_freq_dev,
+               FmDecoder::default_bandwidth_pcm,
+               FmDecoder::plan_rates(sample_rate_if, sample_rate_pcm)
+                   .downsample,
+               false, true);
+
+  IQBlock block;
+  SampleVector audio;
+  groups.clear();
+  for (std::size_t k = 0; k < iq.size(); k += 2 * block_length) {
+    unsigned int n = std::min<std::size_t>(block_length, (iq.size() - k) / 2);
+    block.resize(n);
+    kernels().u8_to_planes(&iq[k], block.i.data(), block.q.data(), n);
+    fm.process(block, audio);
+    for (const RdsDecoder::Group &g : fm.get_rds().get_groups()) {
+      if (g.sample_index >= sample_rate_baseband)
+        groups.push_back(g);
+    }
+  }
+
+  const RdsDecoder &rds = fm.get_rds();
+  ps = rds.get_ps();
+  rt = rds.get_rt();
+  pi = rds.get_pi();
+  pty = rds.get_pty();
+}
+
+int main() {
+  std::vector<std::uint8_t> bits, iq;
+  make_rds_test_bits(test_pi, test_pty, test_ps, test_rt, bits);
+  make_fm_test_signal(sample_rate_if, station_offset, 5.0, iq, &bits);
+
+  const double bit_samples = sample_rate_baseband / RdsDecoder::bit_rate;
+
+  // Block lengths which are not multiples of the RDS decimation.
+  const unsigned int block_lengths[] = {16384, 1001};
+  std::vector<RdsDecoder::Group> ref_groups;
+  bool ok = true;
+
+  for (unsigned int block_length : block_lengths) {
+    std::string ps, rt;
+    unsigned int pi, pty;
+    std::vector<RdsDecoder::Group> groups;
+    decode(iq, block_length, ps, rt, pi, pty, groups);
+    printf("block length %5u: %zu groups, PI %04X, PTY %u, PS \"%s\", "
+           "RT \"%s\"\n",
+           block_length, groups.size(), pi, pty, ps.c_str(), rt.c_str());
+
+    if (pi != test_pi || pty != test_pty || ps != test_ps || rt != test_rt) {
+      fprintf(stderr, "FAIL: wrong programme information\n");
+      ok = false;
+    }
+    // 4 seconds hold 45 groups.
+    if (groups.size() < 40) {
+      fprintf(stderr, "FAIL: only %zu groups decoded\n", groups.size());
+      ok = false;
+    }
+
+    if (ref_groups.empty()) {
+      ref_groups = groups;
+      continue;
+    }
+
+    // The group positions may differ by the RDS sampling phase,
+    // which is much less than one bit.
+    if (groups.size() != ref_groups.size()) {
+      fprintf(stderr, "FAIL: %zu groups instead of %zu\n", groups.size(),
+              ref_groups.size());
+      ok = false;
+      continue;
+    }
+    double max_diff = 0;
+    for (std::size_t i = 0; i < groups.size(); i++) {
+      double diff = std::abs(double(groups[i].sample_index) -
+                             double(ref_groups[i].sample_index));
+      max_diff = std::max(max_diff, diff);
+      if (!std::equal(groups[i].blocks, groups[i].blocks + 4,
+                      ref_groups[i].blocks)) {
+        fprintf(stderr, "FAIL: group %zu differs\n", i);
+        ok = false;
+      }
+    }
+    printf("group positions differ by at most %.0f samples "
+           "(%.0f samples per bit)\n",
+           max_diff, bit_samples);
+    if (max_diff > 0.5 * bit_samples) {
+      fprintf(stderr, "FAIL: group positions depend on the block length\n");
+      ok = false;
+    }
+  }
+
+  return ok ? 0 : 1;
+}
+
+// end
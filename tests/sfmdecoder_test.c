@@ -0,0 +1,90 @@
+/*
+ * Check that a C program links against libsfmdecoder alone and decodes:
+ * create a decoder, feed it an FM modulated tone and destroy it.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sfmdecoder.h"
+
+#define SAMPLE_RATE_IF 960000.0
+#define SAMPLE_RATE_PCM 48000.0
+#define BLOCK_LENGTH 16384
+#define NUM_BLOCKS 30
+
+int main(void) {
+  sfm_decoder_config cfg;
+  sfm_decoder *dec;
+  float *iq;
+  double *pcm;
+  double phase = 0, peak = 0;
+  unsigned long k = 0;
+  unsigned int capacity, b, j;
+  int n, ok = 1;
+
+  if (sfm_api_version() != SFM_API_VERSION) {
+    fprintf(stderr, "FAIL: API version %u\n", sfm_api_version());
+    return 1;
+  }
+
+  sfm_decoder_config_init(&cfg, SAMPLE_RATE_IF, SAMPLE_RATE_PCM);
+  cfg.tuning_offset = 100000;
+  cfg.max_block_length = BLOCK_LENGTH;
+  dec = sfm_decoder_create(&cfg);
+  if (dec == NULL) {
+    fprintf(stderr, "FAIL: sfm_decoder_create\n");
+    return 1;
+  }
+
+  capacity = sfm_decoder_max_output(dec, BLOCK_LENGTH);
+  iq = malloc(2 * BLOCK_LENGTH * sizeof(float));
+  pcm = malloc(capacity * sizeof(double));
+  if (iq == NULL || pcm == NULL)
+    return 1;
+
+  /* 1 kHz tone at 50 kHz deviation, 100 kHz above the LO. */
+  for (b = 0; b < NUM_BLOCKS; b++) {
+    for (j = 0; j < BLOCK_LENGTH; j++, k++) {
+      double t = k / SAMPLE_RATE_IF;
+      double freq = cfg.tuning_offset + 50000 * sin(2 * M_PI * 1000 * t);
+      phase = fmod(phase + 2 * M_PI * freq / SAMPLE_RATE_IF, 2 * M_PI);
+      iq[2 * j] = 0.5f * (float)cos(phase);
+      iq[2 * j + 1] = 0.5f * (float)sin(phase);
+    }
+
+    n = sfm_decoder_process(dec, iq, BLOCK_LENGTH, pcm, capacity);
+    if (n < 0 || (unsigned int)n > capacity) {
+      fprintf(stderr, "FAIL: sfm_decoder_process returned %d\n", n);
+      ok = 0;
+      break;
+    }
+
+    /* Skip the first blocks while the filters settle. */
+    for (j = 0; b >= NUM_BLOCKS / 2 && j < (unsigned int)n; j++) {
+      if (!isfinite(pcm[j]))
+        ok = 0;
+      if (fabs(pcm[j]) > peak)
+        peak = fabs(pcm[j]);
+    }
+  }
+
+  /* The mono tone appears at about 50/75 of full scale. */
+  if (!(peak > 0.3 && peak < 1.0)) {
+    fprintf(stderr, "FAIL: audio peak %f\n", peak);
+    ok = 0;
+  }
+  if (sfm_decoder_process(dec, iq, BLOCK_LENGTH, pcm, capacity - 1) != -1) {
+    fprintf(stderr, "FAIL: short output buffer accepted\n");
+    ok = 0;
+  }
+
+  if (ok)
+    printf("decoded %lu IQ samples, audio peak %f\n", k, peak);
+
+  sfm_decoder_destroy(dec);
+  free(pcm);
+  free(iq);
+  return ok ? 0 : 1;
+}